@@ -0,0 +1,279 @@
+/*
+ * sstore blob store microbenchmark.
+ *
+ * Runs the store (sstore_core.c) in user space, on top of sstore_shim.h, so it
+ * can be timed and profiled without loading the module.  For each number of
+ * blobs and blob size asked for, it writes that many blobs into an empty
+ * device, reads random ones back, overwrites every one of them, and deletes
+ * them all (from the last one down, so no other blobs get renumbered), then
+ * prints the operations per second and the latency of each kind of
+ * operation.  Writes and deletes take the device's mutex around each
+ * operation, the same as write() and ioctl() do in the driver.
+ *
+ * $ make bench_core
+ * $ ./bench_core [-b backend] [-n blobs[,blobs...]] [-s size[,size...]]
+ *                [-r reads] [-p pool_pages]
+ *
+ * Latencies are timed one operation at a time with clock_gettime(), which
+ * adds a few tens of nanoseconds to each of them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sstore_core.h"
+
+#define MAX_RUNS 16
+
+
+//what one kind of operation did
+struct bench_result {
+    unsigned long ops;      //operations done
+    double seconds;         //total time they took
+    long * latencies;       //nanoseconds each one took
+};
+
+int parseList(char * arg, unsigned int * list);
+void runBench(struct sstore * device, unsigned int blobs, unsigned int size,
+        unsigned int reads);
+void report(const char * name, struct bench_result * result);
+int compareLongs(const void * a, const void * b);
+long nanoseconds();
+
+int main(int argc, char ** argv)
+{
+    struct sstore * device;
+    unsigned int blobs[MAX_RUNS] = { 1000 };
+    unsigned int sizes[MAX_RUNS] = { 1024 };
+    int blob_runs = 1;
+    int size_runs = 1;
+    unsigned int reads = 100000;
+    int option = 0;
+    int i = 0;
+    int j = 0;
+
+    while ((option = getopt(argc, argv, "b:n:s:r:p:")) != -1) {
+        switch (option) {
+            case 'b': index_backend = optarg; break;
+            case 'n': blob_runs = parseList(optarg, blobs); break;
+            case 's': size_runs = parseList(optarg, sizes); break;
+            case 'r': reads = atoi(optarg); break;
+            case 'p': pool_pages = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-b backend] [-n blobs[,blobs...]] "
+                        "[-s size[,size...]] [-r reads] [-p pool_pages]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (blob_runs < 1 || size_runs < 1 || reads < 1) {
+        fprintf(stderr, "blobs, sizes and reads must be positive\n");
+        return 1;
+    }
+
+    //the store's limits have to fit the biggest run
+    max_blobs = 0;
+    max_size = 0;
+    for (i = 0; i < blob_runs; ++i)
+        max_blobs = max(max_blobs, blobs[i]);
+    for (i = 0; i < size_runs; ++i)
+        max_size = max(max_size, sizes[i]);
+
+    if (sstore_core_init()) {
+        fprintf(stderr, "couldn't set up the store (bad backend?)\n");
+        return 1;
+    }
+    //struct sstore is cache line aligned, which calloc() doesn't promise
+    if (posix_memalign((void **) &device, 64, sizeof (struct sstore)))
+        device = NULL;
+    else
+        memset(device, 0, sizeof (struct sstore));
+    if (!device || sstore_device_init(device)) {
+        printf("\nError in setting up a device: bench_core.c\n");
+        return 1;
+    }
+
+    printf("backend \"%s\", %u random reads per run\n", sstore_index->name,
+                                                                        reads);
+    for (i = 0; i < blob_runs; ++i) {
+        for (j = 0; j < size_runs; ++j)
+            runBench(device, blobs[i], sizes[j], reads);
+    }
+
+    sstore_device_clear(device);
+    sstore_device_destroy(device);
+    free(device);
+    sstore_core_exit();
+    return 0;
+}
+
+
+
+//parse a comma separated list of positive numbers.  Returns how many (or 0)
+int parseList(char * arg, unsigned int * list) {
+    char * number;
+    int count = 0;
+
+    for (number = strtok(arg, ","); number; number = strtok(NULL, ",")) {
+        if (count == MAX_RUNS || atoi(number) < 1)
+            return 0;
+        list[count++] = atoi(number);
+    }
+    return count;
+}
+
+
+
+//write, read, overwrite and delete blobs blobs of size bytes
+void runBench(struct sstore * device, unsigned int blobs, unsigned int size,
+                                                        unsigned int reads) {
+    struct bench_result writing;
+    struct bench_result reading;
+    struct bench_result overwriting;
+    struct bench_result deleting;
+    char * data;
+    char * buffer;
+    unsigned int seed = 1;      //for rand_r()
+    unsigned int index = 0;
+    unsigned long i = 0;
+    long in_place = 0;          //in place overwrites before the overwrites
+    long start = 0;
+    long before = 0;
+    long result = 0;
+
+    data = malloc(size);
+    buffer = malloc(size);
+    writing.latencies = malloc(blobs * sizeof (long));
+    overwriting.latencies = malloc(blobs * sizeof (long));
+    deleting.latencies = malloc(blobs * sizeof (long));
+    reading.latencies = malloc(reads * sizeof (long));
+    if (!data || !buffer || !writing.latencies || !overwriting.latencies ||
+                                    !deleting.latencies || !reading.latencies) {
+        printf("\nError in malloc: bench_core.c\n");
+        exit(1);
+    }
+    memset(data, 'x', size);
+
+    printf("\n%u blobs of %u bytes\n", blobs, size);
+    printf("operation        ops/sec    avg ns    p50 ns    p99 ns    max ns\n");
+
+    //write every blob into the empty device
+    writing.ops = blobs;
+    start = nanoseconds();
+    for (index = 1; index <= blobs; ++index) {
+        before = nanoseconds();
+        down_interruptible(&device->mutex);
+        result = sstore_do_write(device, index, size, data);
+        up(&device->mutex);
+        writing.latencies[index - 1] = nanoseconds() - before;
+        if (result != size) {
+            fprintf(stderr, "write of index %u failed: %ld\n", index, result);
+            exit(1);
+        }
+    }
+    writing.seconds = (nanoseconds() - start) / 1e9;
+    report("write", &writing);
+
+    //read random blobs (without the mutex, like read() does)
+    reading.ops = reads;
+    start = nanoseconds();
+    for (i = 0; i < reads; ++i) {
+        index = rand_r(&seed) % blobs + 1;
+        before = nanoseconds();
+        result = sstore_do_read(device, index, 0, size, buffer);
+        reading.latencies[i] = nanoseconds() - before;
+        if (result != size) {
+            fprintf(stderr, "read of index %u failed: %ld\n", index, result);
+            exit(1);
+        }
+    }
+    reading.seconds = (nanoseconds() - start) / 1e9;
+    report("read", &reading);
+
+    //write every blob again (in place, when nobody else is reading them)
+    overwriting.ops = blobs;
+    in_place = atomic_long_read(&sstore_allocs.in_place);
+    start = nanoseconds();
+    for (index = 1; index <= blobs; ++index) {
+        before = nanoseconds();
+        down_interruptible(&device->mutex);
+        result = sstore_do_write(device, index, size, data);
+        up(&device->mutex);
+        overwriting.latencies[index - 1] = nanoseconds() - before;
+        if (result != size) {
+            fprintf(stderr, "overwrite of index %u failed: %ld\n", index,
+                                                                    result);
+            exit(1);
+        }
+    }
+    overwriting.seconds = (nanoseconds() - start) / 1e9;
+    report("overwrite", &overwriting);
+    printf("  (%ld of them in place)\n",
+                    atomic_long_read(&sstore_allocs.in_place) - in_place);
+
+    //delete every blob, last one first
+    deleting.ops = blobs;
+    start = nanoseconds();
+    for (index = blobs; index >= 1; --index) {
+        before = nanoseconds();
+        down_interruptible(&device->mutex);
+        result = sstore_do_delete(device, index);
+        up(&device->mutex);
+        deleting.latencies[index - 1] = nanoseconds() - before;
+        if (result) {
+            fprintf(stderr, "delete of index %u failed: %ld\n", index, result);
+            exit(1);
+        }
+    }
+    deleting.seconds = (nanoseconds() - start) / 1e9;
+    report("delete", &deleting);
+
+    //free the deleted blobs now, instead of during the next run
+    rcu_barrier();
+
+    free(data);
+    free(buffer);
+    free(writing.latencies);
+    free(reading.latencies);
+    free(overwriting.latencies);
+    free(deleting.latencies);
+}
+
+
+
+//print one line of results (this sorts the latencies)
+void report(const char * name, struct bench_result * result) {
+    long total = 0;
+    unsigned long i = 0;
+
+    qsort(result->latencies, result->ops, sizeof (long), compareLongs);
+    for (i = 0; i < result->ops; ++i)
+        total += result->latencies[i];
+
+    printf("%-10s %13.0f %9ld %9ld %9ld %9ld\n", name,
+            result->ops / result->seconds, total / (long) result->ops,
+            result->latencies[result->ops / 2],
+            result->latencies[result->ops * 99 / 100],
+            result->latencies[result->ops - 1]);
+}
+
+
+
+int compareLongs(const void * a, const void * b) {
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+
+//the time in nanoseconds
+long nanoseconds() {
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000L + time.tv_nsec;
+}
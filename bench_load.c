@@ -0,0 +1,458 @@
+/*
+ * sstore device driver load generator.
+ *
+ * Runs reader threads and writer threads against one or more sstore devices
+ * for a while, with no pauses, and prints what they got done as JSON, so the
+ * numbers from one version of the driver can be saved and compared with the
+ * next.  Readers only read.  Writers write, and delete a given percentage of
+ * the time.  Every thread picks the indices it uses from the same key
+ * distribution: uniform, zipfian (a few indices get most of the traffic) or
+ * sequential (each thread walks through the indices in order).  Threads are
+ * spread over the devices round robin.  Run it as root with the module loaded:
+ *
+ * $ make bench_load
+ * $ ./bench_load [-d device[,device...]] [-R readers] [-W writers]
+ *                [-n blobs] [-s size] [-k uniform|zipf|seq] [-z theta]
+ *                [-D delete percent] [-t seconds]
+ *
+ * The number of blobs must not be more than the driver's max_blobs parameter,
+ * and the size not more than max_size.  Every index is written before the
+ * threads start, but deletes renumber the blobs behind them and shrink the
+ * device, so a read can block until a writer fills its index back in (that
+ * time counts in its latency).  When the time is up, every index is written
+ * once more so that no reader is left blocked.
+ *
+ * Latencies go in a histogram per thread (a bucket per 1/16th of each power of
+ * two nanoseconds, so about 6% resolution), and the percentiles are the top
+ * of the bucket they land in.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "sstore.h"
+
+#define MAX_DEVICES 8
+//the histogram: HIST_SUB buckets for each power of two up to 2^HIST_POWERS ns
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_POWERS 40
+#define HIST_BUCKETS (HIST_POWERS * HIST_SUB)
+
+#define OP_READ 0
+#define OP_WRITE 1
+#define OP_DELETE 2
+#define OP_COUNT 3
+
+#define KEYS_UNIFORM 0
+#define KEYS_ZIPF 1
+#define KEYS_SEQUENTIAL 2
+
+
+//what one thread saw of one kind of operation
+struct op_stats {
+    unsigned long ops;
+    unsigned long errors;
+    unsigned long long total_ns;
+    unsigned long max_ns;
+    unsigned long histogram[HIST_BUCKETS];
+};
+
+//what every thread needs to know
+struct bench {
+    int devices[MAX_DEVICES];   //file descriptors of the devices
+    int device_count;
+    int blobs;                  //indices go from 1 through this
+    int size;                   //bytes per read or write
+    int keys;                   //KEYS_UNIFORM, KEYS_ZIPF or KEYS_SEQUENTIAL
+    double theta;               //zipfian skew
+    double zeta;                //zipfian normalizer for blobs and theta
+    double zeta2;               //same, for two blobs
+    int delete_percent;         //how often a writer deletes instead
+    volatile int stop;          //set when the threads should stop
+};
+
+//one of these per thread
+struct worker {
+    pthread_t thread;
+    struct bench * bench;
+    int device;                 //file descriptor this thread uses
+    int writer;                 //writes and deletes instead of reading
+    unsigned long long random;  //xorshift state
+    unsigned int next_key;      //for sequential keys
+    struct op_stats stats[OP_COUNT];
+};
+
+const char * op_names[OP_COUNT] = { "read", "write", "delete" };
+const char * key_names[] = { "uniform", "zipf", "seq" };
+
+void * workerThread(void * arg);
+int nextKey(struct worker * worker);
+double nextRandom(struct worker * worker);
+double zeta(int n, double theta);
+void record(struct op_stats * stats, unsigned long ns);
+int bucketOf(unsigned long ns);
+unsigned long bucketTop(int bucket);
+unsigned long percentile(struct op_stats * stats, double fraction);
+void printOp(const char * name, struct op_stats * stats, double seconds,
+        int last);
+unsigned long nanoseconds();
+
+int main(int argc, char ** argv)
+{
+    struct bench bench;
+    struct worker * workers;
+    struct op_stats * totals;
+    struct user_buffer buf;
+    char * paths[MAX_DEVICES];
+    char * path_list = "/dev/sstore0,/dev/sstore1";
+    int readers = 4;
+    int writers = 1;
+    int seconds = 5;
+    double elapsed = 0.0;
+    unsigned long start = 0;
+    int option = 0;
+    int threads = 0;
+    int i = 0;
+    int j = 0;
+    int k = 0;
+
+    memset(&bench, 0, sizeof (struct bench));
+    bench.blobs = 10;
+    bench.size = 1024;
+    bench.keys = KEYS_UNIFORM;
+    bench.theta = 0.99;
+
+    while ((option = getopt(argc, argv, "d:R:W:n:s:k:z:D:t:")) != -1) {
+        switch (option) {
+            case 'd': path_list = optarg; break;
+            case 'R': readers = atoi(optarg); break;
+            case 'W': writers = atoi(optarg); break;
+            case 'n': bench.blobs = atoi(optarg); break;
+            case 's': bench.size = atoi(optarg); break;
+            case 'z': bench.theta = atof(optarg); break;
+            case 'D': bench.delete_percent = atoi(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'k':
+                for (bench.keys = 0; bench.keys < 3; ++bench.keys) {
+                    if (!strcmp(optarg, key_names[bench.keys]))
+                        break;
+                }
+                if (bench.keys < 3)
+                    break;
+                //fall through for an unknown distribution
+            default:
+                fprintf(stderr, "usage: %s [-d device[,device...]] "
+                        "[-R readers] [-W writers] [-n blobs] [-s size] "
+                        "[-k uniform|zipf|seq] [-z theta] [-D delete percent] "
+                        "[-t seconds]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (bench.blobs < 1 || bench.size < 1 || seconds < 1 || readers < 0 ||
+            writers < 0 || readers + writers < 1 || bench.delete_percent < 0 ||
+            bench.delete_percent > 100 || bench.theta <= 0.0 ||
+            bench.theta == 1.0) {
+        fprintf(stderr, "bad arguments (see the top of bench_load.c)\n");
+        return 1;
+    }
+    if (bench.keys == KEYS_ZIPF) {
+        bench.zeta = zeta(bench.blobs, bench.theta);
+        bench.zeta2 = zeta(2, bench.theta);
+    }
+
+    //open the devices
+    for (path_list = strtok(path_list, ","); path_list;
+                                        path_list = strtok(NULL, ",")) {
+        if (bench.device_count == MAX_DEVICES) {
+            fprintf(stderr, "at most %d devices\n", MAX_DEVICES);
+            return 1;
+        }
+        paths[bench.device_count] = path_list;
+        bench.devices[bench.device_count] = open(path_list, O_RDWR);
+        if (bench.devices[bench.device_count] < 0) {
+            perror(path_list);
+            return 1;
+        }
+        ++bench.device_count;
+    }
+
+    //write every index of every device, so reads have something to read
+    buf.size = bench.size;
+    buf.data = malloc(bench.size);
+    if (!buf.data) {
+        fprintf(stderr, "\nError in malloc: bench_load.c\n");
+        return 1;
+    }
+    memset(buf.data, 'x', bench.size);
+    for (i = 0; i < bench.device_count; ++i) {
+        for (buf.index = 1; buf.index <= bench.blobs; ++buf.index) {
+            if (write(bench.devices[i], &buf, sizeof (struct user_buffer)) < 0) {
+                perror("write");
+                return 1;
+            }
+        }
+    }
+
+    threads = readers + writers;
+    workers = calloc(threads, sizeof (struct worker));
+    totals = calloc(OP_COUNT, sizeof (struct op_stats));
+    if (!workers || !totals) {
+        fprintf(stderr, "\nError in calloc: bench_load.c\n");
+        return 1;
+    }
+    for (i = 0; i < threads; ++i) {
+        workers[i].bench = &bench;
+        workers[i].device = bench.devices[i % bench.device_count];
+        workers[i].writer = i >= readers;
+        workers[i].random = 0x9e3779b97f4a7c15ULL * (i + 1);
+        workers[i].next_key = i * bench.blobs / threads;
+    }
+
+    //run
+    start = nanoseconds();
+    for (i = 0; i < threads; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, workerThread,
+                                                                &workers[i])) {
+            fprintf(stderr, "pthread_create failed\n");
+            return 1;
+        }
+    }
+    sleep(seconds);
+    bench.stop = 1;
+    elapsed = (nanoseconds() - start) / 1e9;
+
+    //wake up any reader blocked on an index a delete emptied
+    for (i = 0; i < bench.device_count; ++i) {
+        for (buf.index = 1; buf.index <= bench.blobs; ++buf.index)
+            write(bench.devices[i], &buf, sizeof (struct user_buffer));
+    }
+    for (i = 0; i < threads; ++i)
+        pthread_join(workers[i].thread, NULL);
+
+    //add up the threads
+    for (i = 0; i < threads; ++i) {
+        for (j = 0; j < OP_COUNT; ++j) {
+            totals[j].ops += workers[i].stats[j].ops;
+            totals[j].errors += workers[i].stats[j].errors;
+            totals[j].total_ns += workers[i].stats[j].total_ns;
+            if (workers[i].stats[j].max_ns > totals[j].max_ns)
+                totals[j].max_ns = workers[i].stats[j].max_ns;
+            for (k = 0; k < HIST_BUCKETS; ++k)
+                totals[j].histogram[k] += workers[i].stats[j].histogram[k];
+        }
+    }
+
+    printf("{\n  \"config\": {\n    \"devices\": [");
+    for (i = 0; i < bench.device_count; ++i)
+        printf("%s\"%s\"", i ? ", " : "", paths[i]);
+    printf("],\n    \"readers\": %d,\n    \"writers\": %d,\n", readers,
+                                                                    writers);
+    printf("    \"blobs\": %d,\n    \"size\": %d,\n", bench.blobs, bench.size);
+    printf("    \"keys\": \"%s\",\n", key_names[bench.keys]);
+    if (bench.keys == KEYS_ZIPF)
+        printf("    \"theta\": %.2f,\n", bench.theta);
+    printf("    \"delete_percent\": %d,\n", bench.delete_percent);
+    printf("    \"seconds\": %.3f\n  },\n", elapsed);
+    for (j = 0; j < OP_COUNT; ++j)
+        printOp(op_names[j], &totals[j], elapsed, j == OP_COUNT - 1);
+    printf("}\n");
+
+    for (i = 0; i < bench.device_count; ++i)
+        close(bench.devices[i]);
+    free(buf.data);
+    free(workers);
+    free(totals);
+    return 0;
+}
+
+
+
+//read, or write and delete, until told to stop
+void * workerThread(void * arg) {
+    struct worker * worker = arg;
+    struct bench * bench = worker->bench;
+    struct user_buffer buf;
+    unsigned long before = 0;
+    int op = OP_READ;
+    int result = 0;
+
+    buf.size = bench->size;
+    buf.data = malloc(bench->size);
+    if (!buf.data)
+        return NULL;
+    memset(buf.data, 'y', bench->size);
+
+    while (!bench->stop) {
+        buf.index = nextKey(worker);
+        op = OP_READ;
+        if (worker->writer)
+            op = nextRandom(worker) * 100 < bench->delete_percent ?
+                                                        OP_DELETE : OP_WRITE;
+
+        before = nanoseconds();
+        switch (op) {
+            case OP_READ:
+                result = read(worker->device, &buf,
+                                                sizeof (struct user_buffer));
+                break;
+            case OP_WRITE:
+                result = write(worker->device, &buf,
+                                                sizeof (struct user_buffer));
+                break;
+            case OP_DELETE:
+                //fails with EINVAL if deletes have already emptied the index
+                result = ioctl(worker->device, SSTORE_IOCTL_DELETE, buf.index);
+                break;
+        }
+        record(&worker->stats[op], nanoseconds() - before);
+        if (result < 0)
+            ++worker->stats[op].errors;
+    }
+    free(buf.data);
+
+    return NULL;
+}
+
+
+
+//the next index for a thread to use, from the key distribution
+int nextKey(struct worker * worker) {
+    struct bench * bench = worker->bench;
+    double u = 0.0;
+    double alpha = 0.0;
+    double eta = 0.0;
+    double uz = 0.0;
+
+    switch (bench->keys) {
+        case KEYS_SEQUENTIAL:
+            worker->next_key = worker->next_key % bench->blobs + 1;
+            return worker->next_key;
+        /*
+         * zipfian, the way YCSB does it (from Gray et al., "Quickly
+         * Generating Billion-Record Synthetic Databases").  Index 1 is the
+         * most popular.
+         */
+        case KEYS_ZIPF:
+            u = nextRandom(worker);
+            uz = u * bench->zeta;
+            if (uz < 1.0)
+                return 1;
+            if (uz < 1.0 + pow(0.5, bench->theta))
+                return 2;
+            alpha = 1.0 / (1.0 - bench->theta);
+            eta = (1.0 - pow(2.0 / bench->blobs, 1.0 - bench->theta)) /
+                                            (1.0 - bench->zeta2 / bench->zeta);
+            return 1 + (int) (bench->blobs * pow(eta * u - eta + 1.0, alpha)) %
+                                                                bench->blobs;
+        default:
+            return 1 + (int) (nextRandom(worker) * bench->blobs);
+    }
+}
+
+//a random number in [0, 1), from the thread's own xorshift64* generator
+double nextRandom(struct worker * worker) {
+    worker->random ^= worker->random >> 12;
+    worker->random ^= worker->random << 25;
+    worker->random ^= worker->random >> 27;
+    return ((worker->random * 2685821657736338717ULL) >> 11) /
+                                                        9007199254740992.0;
+}
+
+//sum of 1 / i^theta for i from 1 to n
+double zeta(int n, double theta) {
+    double sum = 0.0;
+    int i = 0;
+
+    for (i = 1; i <= n; ++i)
+        sum += 1.0 / pow(i, theta);
+    return sum;
+}
+
+
+
+//count an operation that took ns nanoseconds
+void record(struct op_stats * stats, unsigned long ns) {
+    ++stats->ops;
+    stats->total_ns += ns;
+    if (ns > stats->max_ns)
+        stats->max_ns = ns;
+    ++stats->histogram[bucketOf(ns)];
+}
+
+/*
+ * values under HIST_SUB get a bucket each, and from there each power of two is
+ * split into HIST_SUB buckets
+ */
+int bucketOf(unsigned long ns) {
+    int power = 0;
+
+    if (ns < HIST_SUB)
+        return ns;
+    power = 63 - __builtin_clzl(ns);
+    if (power >= HIST_POWERS)
+        return HIST_BUCKETS - 1;
+    return (power - HIST_SUB_BITS + 1) * HIST_SUB +
+                    ((ns >> (power - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+//the highest value that goes in a bucket
+unsigned long bucketTop(int bucket) {
+    int power = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    unsigned long sub = bucket % HIST_SUB;
+
+    if (bucket < HIST_SUB)
+        return bucket;
+    return ((HIST_SUB + sub + 1) << (power - HIST_SUB_BITS)) - 1;
+}
+
+//the latency fraction of the operations took at most
+unsigned long percentile(struct op_stats * stats, double fraction) {
+    unsigned long wanted = ceil(stats->ops * fraction);
+    unsigned long seen = 0;
+    int i = 0;
+
+    if (!stats->ops)
+        return 0;
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        seen += stats->histogram[i];
+        if (seen >= wanted)
+            break;
+    }
+    //the top of the last bucket can be past the real maximum
+    if (i >= HIST_BUCKETS || bucketTop(i) > stats->max_ns)
+        return stats->max_ns;
+    return bucketTop(i);
+}
+
+void printOp(const char * name, struct op_stats * stats, double seconds,
+                                                                    int last) {
+    printf("  \"%s\": {\n", name);
+    printf("    \"ops\": %lu,\n", stats->ops);
+    printf("    \"errors\": %lu,\n", stats->errors);
+    printf("    \"ops_per_sec\": %.1f,\n", stats->ops / seconds);
+    printf("    \"latency_ns\": {\n");
+    printf("      \"mean\": %llu,\n",
+                        stats->ops ? stats->total_ns / stats->ops : 0ULL);
+    printf("      \"p50\": %lu,\n", percentile(stats, 0.50));
+    printf("      \"p99\": %lu,\n", percentile(stats, 0.99));
+    printf("      \"p999\": %lu,\n", percentile(stats, 0.999));
+    printf("      \"max\": %lu\n", stats->max_ns);
+    printf("    }\n  }%s\n", last ? "" : ",");
+}
+
+
+
+//the time in nanoseconds
+unsigned long nanoseconds() {
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000UL + time.tv_nsec;
+}
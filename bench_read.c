@@ -0,0 +1,246 @@
+/*
+ * sstore device driver read scaling benchmark.
+ *
+ * Fills a device with blobs, then has 1, 2, 4, ... threads read random blobs
+ * from it as fast as they can for a few seconds each, and prints the reads per
+ * second for each thread count.  Reads don't take the device's mutex, so the
+ * total should go up with the number of threads (until you run out of cores)
+ * instead of staying flat.  Run it as root with the module loaded:
+ *
+ * $ gcc -O2 -pthread -o bench_read bench_read.c
+ * $ ./bench_read [-d device] [-n blobs] [-N blobs] [-s size] [-t seconds]
+ *         [-T threads]
+ *
+ * It runs twice: once with every thread reading a few hot blobs (-n, 10 by
+ * default), where the threads are all reading the same blobs at once, and once
+ * with the reads spread over lots of them (-N, 1000 by default, or the
+ * driver's max_blobs if that's less).  Reads of up to a page don't write to
+ * the blob at all (see sstore_read_quick() in sstore_core.c), so the two
+ * should scale about the same; bigger reads (-s) hold a reference to the blob
+ * while they copy, which is a cache line every reader of it writes to, so the
+ * hot run will fall behind.
+ *
+ * The number of blobs must not be more than the driver's max_blobs parameter,
+ * and the size not more than max_size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "sstore.h"
+
+
+//what every thread needs to know
+struct bench {
+    int device;             //file descriptor for the device
+    int blobs;              //reads go to indices 1 through this
+    int size;               //bytes to read per blob
+    volatile int stop;      //set when the threads should stop reading
+};
+
+//one of these per thread
+struct reader {
+    pthread_t thread;
+    struct bench * bench;
+    unsigned int seed;      //for rand_r(), so threads don't share rand() state
+    unsigned long reads;    //how many reads the thread got done
+    int failed;             //set if a read returned an error
+};
+
+int runReads(struct bench * bench, struct reader * readers, int max_threads,
+        int seconds);
+void * readerThread(void * arg);
+double now();
+
+int main(int argc, char ** argv)
+{
+    struct bench bench;
+    struct reader * readers;
+    struct user_buffer buf;
+    char * path = "/dev/sstore0";
+    FILE * parameter;       //the driver's max_blobs
+    int max_blobs = 0;
+    int seconds = 3;
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int hot = 10;           //blobs for the hot run
+    int spread = 1000;      //and for the spread one
+    int option = 0;
+    int i = 0;
+
+    bench.size = 1024;
+    bench.stop = 0;
+
+    //no more blobs than the driver has room for, unless asked for
+    parameter = fopen("/sys/module/sstore/parameters/max_blobs", "r");
+    if (parameter) {
+        if (fscanf(parameter, "%d", &max_blobs) == 1 && max_blobs < spread)
+            spread = max_blobs;
+        fclose(parameter);
+    }
+
+    while ((option = getopt(argc, argv, "d:n:N:s:t:T:")) != -1) {
+        switch (option) {
+            case 'd': path = optarg; break;
+            case 'n': hot = atoi(optarg); break;
+            case 'N': spread = atoi(optarg); break;
+            case 's': bench.size = atoi(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'T': max_threads = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-d device] [-n blobs] [-N blobs] "
+                        "[-s size] [-t seconds] [-T threads]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (hot < 1 || spread < 1 || bench.size < 1 || seconds < 1 ||
+                                                            max_threads < 1) {
+        fprintf(stderr, "blobs, size, seconds and threads must be positive\n");
+        return 1;
+    }
+
+    //open the device
+    bench.device = open(path, O_RDWR);
+    if (bench.device < 0) {
+        perror("open");
+        return 1;
+    }
+
+    //fill the device with blobs to read
+    buf.size = bench.size;
+    buf.data = malloc(bench.size);
+    if (!buf.data) {
+        printf("\nError in malloc: bench_read.c\n");
+        return 1;
+    }
+    memset(buf.data, 'x', bench.size);
+    for (i = 1; i <= hot || i <= spread; ++i) {
+        buf.index = i;
+        if (write(bench.device, &buf, sizeof (struct user_buffer)) < 0) {
+            perror("write");
+            return 1;
+        }
+    }
+    free(buf.data);
+
+    readers = calloc(max_threads, sizeof (struct reader));
+    if (!readers) {
+        printf("\nError in calloc: bench_read.c\n");
+        return 1;
+    }
+
+    printf("blobs of %d bytes, %d second(s) per run\n", bench.size, seconds);
+    printf("\nhot: every thread reading the same %d blob(s)\n", hot);
+    bench.blobs = hot;
+    if (runReads(&bench, readers, max_threads, seconds))
+        return 1;
+    printf("\nspread: reads spread over %d blob(s)\n", spread);
+    bench.blobs = spread;
+    if (runReads(&bench, readers, max_threads, seconds))
+        return 1;
+
+    free(readers);
+    close(bench.device);
+    return 0;
+}
+
+
+
+/*
+ * run with 1, 2, 4, ... threads, and finally with max_threads, printing the
+ * reads per second for each.  Returns 0, or 1 if a read failed.
+ */
+int runReads(struct bench * bench, struct reader * readers, int max_threads,
+                                                                int seconds) {
+    int threads = 0;
+    int next = 0;
+    double single = 0.0;    //reads per second with one thread
+    double rate = 0.0;
+    double start = 0.0;
+    unsigned long total = 0;
+    int failed = 0;
+    int i = 0;
+
+    printf("threads      reads/sec   per thread   speedup\n");
+    for (threads = 1; threads <= max_threads; threads = next) {
+        bench->stop = 0;
+        for (i = 0; i < threads; ++i) {
+            readers[i].bench = bench;
+            readers[i].seed = i + 1;
+            readers[i].reads = 0;
+            readers[i].failed = 0;
+        }
+        start = now();
+        for (i = 0; i < threads; ++i) {
+            if (pthread_create(&readers[i].thread, NULL, readerThread,
+                                                                &readers[i])) {
+                fprintf(stderr, "pthread_create failed\n");
+                exit(1);
+            }
+        }
+        sleep(seconds);
+        bench->stop = 1;
+        total = 0;
+        for (i = 0; i < threads; ++i) {
+            pthread_join(readers[i].thread, NULL);
+            total += readers[i].reads;
+            failed |= readers[i].failed;
+        }
+        if (failed)
+            return 1;
+
+        rate = total / (now() - start);
+        if (threads == 1)
+            single = rate;
+        printf("%7d %14.0f %12.0f %9.2f\n", threads, rate, rate / threads,
+                                                                rate / single);
+
+        //make sure the last run is with exactly max_threads
+        next = threads * 2;
+        if (threads < max_threads && next > max_threads)
+            next = max_threads;
+    }
+
+    return 0;
+}
+
+
+
+//read random blobs until told to stop
+void * readerThread(void * arg) {
+    struct reader * reader = arg;
+    struct bench * bench = reader->bench;
+    struct user_buffer buf;
+
+    buf.size = bench->size;
+    buf.data = malloc(bench->size);
+    if (!buf.data) {
+        reader->failed = 1;
+        return NULL;
+    }
+    while (!bench->stop) {
+        buf.index = rand_r(&reader->seed) % bench->blobs + 1;
+        if (read(bench->device, &buf, sizeof (struct user_buffer)) < 0) {
+            perror("read");
+            reader->failed = 1;
+            break;
+        }
+        ++reader->reads;
+    }
+    free(buf.data);
+
+    return NULL;
+}
+
+
+
+//the time in seconds
+double now() {
+    struct timeval time;
+
+    gettimeofday(&time, NULL);
+    return time.tv_sec + time.tv_usec / 1000000.0;
+}
@@ -4,10 +4,35 @@
  * sstore.h 
  */
 
-#include <linux/cdev.h>         /* for the cdev struct */
-#include <linux/semaphore.h>    /* for a mutual exclusion semaphore */
+/*
+ * This header is shared with user space programs (the test and benchmark
+ * programs include it for the ioctl commands and struct user_buffer).  The
+ * parts only the driver needs are inside #ifdef __KERNEL__, and the structures
+ * of the store itself are in sstore_core.h.
+ */
+
+#ifndef _SSTORE_H
+#define _SSTORE_H
+
 #include <linux/ioctl.h>        /* for ioctl macros */
-#include <linux/wait.h>         /* for a wait queue */
+
+//----------------------------------------------------------------------------
+
+#ifdef __KERNEL__
+/*
+ * DEBUG OUTPUT.  PDEBUG() is a printk() at KERN_DEBUG when the driver is built
+ * with SSTORE_DEBUG defined (run make with DEBUG=y), and nothing otherwise.
+ * read() and write() print on every call, and every printk() goes through the
+ * one log buffer lock, so leaving them on would line up every reader on every
+ * core behind each other.  (See "Linux Device Drivers" 3rd Ed. pgs. 80-81)
+ */
+#undef PDEBUG
+#ifdef SSTORE_DEBUG
+#  define PDEBUG(fmt, args...) printk(KERN_DEBUG fmt, ## args)
+#else
+#  define PDEBUG(fmt, args...)
+#endif
+#endif
 
 //----------------------------------------------------------------------------
 
@@ -29,8 +54,21 @@
  * IOCTL DEFINITIONS
  *
  * ioctl() system call in user space is used for things other than read and
- * write.  This driver only uses one ioctl command, which is deleting a blob at
- * a given index.
+ * write.  This driver has ioctl commands for deleting a blob at a given
+ * index, running a batch of reads, writes and deletes in one go, reading
+ * just part of a blob, watching indices with poll(), reading, writing and
+ * deleting blobs by key instead of by index (see below), deleting without
+ * renumbering (one index or a range of them), clearing a device, writing or
+ * reading a blob only if its version is (or isn't) the one given, appending
+ * to a blob while readers follow it as it grows, restoring a device from
+ * an image of it, setting the size from which a device compresses blobs, and
+ * taking a snapshot of a device.  (The argument of SSTORE_IOCTL_COMPRESS is
+ * that size in bytes, and 0 turns compression off.  Blobs already written are
+ * left the way they are.  SSTORE_IOCTL_SNAPSHOT takes no argument: from then
+ * on, read(), SSTORE_IOCTL_READ_RANGE and SSTORE_IOCTL_READ_TIMED through the
+ * file it was done on see the device's indices as they were at that moment,
+ * without waiting, and give -ENODATA for an index that had no blob.  The file
+ * keeps the snapshot until it's closed.)
  * 0xFF is chosen as the driver's "magic number" simply because it's not listed
  * as being used in the Documentaion/ioctl/ioctl-number.txt file.  (See
  * "Linux Device Drivers" 3rd Ed. pgs. 137-140 for more detail,
@@ -39,15 +77,52 @@
  */
 #define SSTORE_IOCTL_MAGIC 0xFF
 #define SSTORE_IOCTL_DELETE _IO(SSTORE_IOCTL_MAGIC, 0)
+#define SSTORE_IOCTL_BATCH _IOWR(SSTORE_IOCTL_MAGIC, 1, struct sstore_batch)
+#define SSTORE_IOCTL_READ_RANGE _IOW(SSTORE_IOCTL_MAGIC, 2, struct sstore_range)
+#define SSTORE_IOCTL_WATCH _IO(SSTORE_IOCTL_MAGIC, 3)
+#define SSTORE_IOCTL_UNWATCH _IO(SSTORE_IOCTL_MAGIC, 4)
+#define SSTORE_IOCTL_READY _IOWR(SSTORE_IOCTL_MAGIC, 5, struct sstore_ready)
+#define SSTORE_IOCTL_READ_TIMED _IOW(SSTORE_IOCTL_MAGIC, 6, \
+                                                    struct sstore_timed_read)
+#define SSTORE_IOCTL_KEY_READ _IOW(SSTORE_IOCTL_MAGIC, 7, struct sstore_key_op)
+#define SSTORE_IOCTL_KEY_WRITE _IOW(SSTORE_IOCTL_MAGIC, 8, struct sstore_key_op)
+#define SSTORE_IOCTL_KEY_DELETE _IOW(SSTORE_IOCTL_MAGIC, 9, \
+                                                        struct sstore_key_op)
+#define SSTORE_IOCTL_PUNCH _IO(SSTORE_IOCTL_MAGIC, 10)
+#define SSTORE_IOCTL_DELETE_RANGE _IOW(SSTORE_IOCTL_MAGIC, 11, \
+                                                    struct sstore_delete_range)
+#define SSTORE_IOCTL_CLEAR _IO(SSTORE_IOCTL_MAGIC, 12)
+#define SSTORE_IOCTL_WRITE_IF _IOWR(SSTORE_IOCTL_MAGIC, 13, \
+                                                    struct sstore_versioned)
+#define SSTORE_IOCTL_READ_IF_CHANGED _IOWR(SSTORE_IOCTL_MAGIC, 14, \
+                                                    struct sstore_versioned)
+#define SSTORE_IOCTL_APPEND _IOW(SSTORE_IOCTL_MAGIC, 15, struct user_buffer)
+#define SSTORE_IOCTL_TAIL _IOW(SSTORE_IOCTL_MAGIC, 16, struct sstore_range)
+#define SSTORE_IOCTL_RESTORE _IOW(SSTORE_IOCTL_MAGIC, 17, struct sstore_restore)
+#define SSTORE_IOCTL_COMPRESS _IO(SSTORE_IOCTL_MAGIC, 18)
+#define SSTORE_IOCTL_SNAPSHOT _IO(SSTORE_IOCTL_MAGIC, 19)
 /*
  * this max value is used in driver's ioctl() to test that user's command number
  * passed in is valid.  The number corresponds to the largest command number.
  * Each command is given a sequential number (using the _IO, IOR, _IOW, or _IOWR
- * macros) starting with 0.  Since there is only one here (0, corresponding to
- * SSTORE_IOCTL_DELETE), 0 is used.  If there were 14 different commands, 14
- * would be used.
+ * macros) starting with 0.  There are twenty here (0 for
+ * SSTORE_IOCTL_DELETE through 19 for SSTORE_IOCTL_SNAPSHOT), so 19 is used.
+ * If there were 21 different commands, 20 would be used.
  */
-#define SSTORE_IOCTL_MAX 0
+#define SSTORE_IOCTL_MAX 19
+
+//the operations a descriptor of a batch can ask for
+#define SSTORE_BATCH_READ 0
+#define SSTORE_BATCH_WRITE 1
+#define SSTORE_BATCH_DELETE 2
+#define SSTORE_BATCH_PUNCH 3
+//the most descriptors one batch can have
+#define SSTORE_BATCH_MAX 1024
+//the longest key a blob can be stored under, in bytes
+#define SSTORE_KEY_MAX 255
+//what a device image starts with (see struct sstore_image_header)
+#define SSTORE_IMAGE_MAGIC 0x49545353   /* "SSTI" little endian */
+#define SSTORE_IMAGE_FORMAT 1
 
 //----------------------------------------------------------------------------
 
@@ -55,8 +130,12 @@
  * MISC. DEFINITIONS
  */
 
-//the number of devices that can be associated with this driver
-const int SSTORE_DEVICE_COUNT = 2;
+/*
+ * the number of devices made when the device_count module parameter isn't
+ * given (a #define, since this header is included by both halves of the
+ * driver)
+ */
+#define SSTORE_DEVICE_COUNT 2
 
 //----------------------------------------------------------------------------
 
@@ -64,40 +143,187 @@ const int SSTORE_DEVICE_COUNT = 2;
  * STRUCT DEFINITIONS
  */
 
-//the device will be storing a linked list of this struct
-struct blob {
-    int index;              //index number of the blob (where it is in the list)
-    char * junk;            //the data that the blob holds
-    struct blob * next;     //pointer to the next blob in the list
+//this structure mirrors the readWriteBuffer struct in the test program
+struct user_buffer {
+    int index;      //index into the blob list
+    int size;       //size of the data transfer
+    char * data;    //where the data being transfered resides
 };
 
 
-//the device structure
-struct sstore {
-    /*
-     * fd_count keeps track of how many open file descriptors in user space are
-     * associated with the device represented by an instance of this struct.
-     * This is done so that the release function in the driver can shut down
-     * the device on the last close. (See "Linux Device Drivers" 3rd Ed. pg. 59)
-     */
-    unsigned int fd_count;
-    unsigned int blob_count;    //number of blobs in the list at any given time
-    /*
-     * this is the head of the wait queue. wait_queue_head_t is a typedef for
-     * struct __wait_queue_head (see linux/wait.h).  This queue is used in the
-     * read() function of sstore.c.
-     */
-    wait_queue_head_t wait_queue;
-    struct blob * list_head;    //head of the blob linked list
-    struct blob * seek_blob;    //a pointer to the last used blob
-    struct semaphore mutex;     //semaphore for mutal exclusion
-    struct cdev cdev;
+//one descriptor of a batch (like a struct user_buffer, plus what to do)
+struct sstore_batch_op {
+    int op;         //SSTORE_BATCH_READ, _WRITE, _DELETE or _PUNCH
+    int index;      //index of the blob
+    int size;       //size of the data transfer (ignored for a delete)
+    char * data;    //where the data being transfered resides (ditto)
 };
 
 
-//this structure mirrors the readWriteBuffer struct in the test program
-struct user_buffer {
-    int index;      //index into the blob list
-    int size;       //size of the data transfer
-    char * data;    //where the data being transfered resides
+/*
+ * what SSTORE_IOCTL_READ_RANGE is given: read up to size bytes of the blob at
+ * index, starting offset bytes into it.  It returns the number of bytes read,
+ * which is less than size (0 if offset is past the end) when the blob runs out
+ * first, so a big blob can be read in chunks until a short read.  Like read(),
+ * it waits if there is no blob at the index.
+ *
+ * SSTORE_IOCTL_TAIL is given one too, for following a blob that's being
+ * appended to with SSTORE_IOCTL_APPEND (which is given a struct user_buffer,
+ * and adds its data to the end of the blob).  offset is how much of the blob
+ * the reader has already read: if the blob has no more than that, it waits
+ * until an append (or write) gives it more, so it never returns 0.  The
+ * reader then adds what it got to offset and asks again.
+ */
+struct sstore_range {
+    int index;      //index of the blob
+    int offset;     //where in the blob's data to start reading
+    int size;       //the most bytes to read
+    char * data;    //where to put them
+};
+
+
+/*
+ * what SSTORE_IOCTL_READ_TIMED is given: a range read that gives up with
+ * -ETIMEDOUT after timeout_ms milliseconds with no blob (0 returns -EAGAIN
+ * right away, like a read of a file opened O_NONBLOCK, and a negative timeout
+ * waits for as long as it takes).  For readers that can't afford to be put to
+ * sleep for a blob that's about to show up, spin_us asks it to busy-poll for
+ * up to that many microseconds before sleeping.  The driver caps that at its
+ * spin_usecs parameter, and spins for less while spinning isn't paying off.
+ */
+struct sstore_timed_read {
+    struct sstore_range range;
+    int timeout_ms;             //how long to wait for a blob
+    unsigned int spin_us;       //how long to busy-poll first (0 for none)
 };
+
+
+/*
+ * what SSTORE_IOCTL_DELETE_RANGE is given: delete the blobs at indices first
+ * up to (but not including) last.  Like SSTORE_IOCTL_PUNCH, it leaves the
+ * indices empty instead of moving the blobs after them down, so indices of
+ * other blobs never change.  Indices in the range with no blob are fine.
+ */
+struct sstore_delete_range {
+    int first;      //the first index to delete
+    int last;       //the index after the last one to delete
+};
+
+
+/*
+ * what the key ioctls are given.  A key is any 1 up to SSTORE_KEY_MAX bytes
+ * (it doesn't have to be a string), and names a blob the same way an index
+ * does, but in a namespace of its own: a device's keyed blobs and its indexed
+ * blobs never see each other.  SSTORE_IOCTL_KEY_WRITE stores size bytes of
+ * data under the key and returns the bytes written, like write().
+ * SSTORE_IOCTL_KEY_READ copies up to size bytes of the key's blob into data
+ * and returns the bytes read, or -ENOENT if there is no such key (it never
+ * waits for one).  SSTORE_IOCTL_KEY_DELETE deletes the key's blob (size and
+ * data are ignored), or returns -ENOENT.
+ */
+struct sstore_key_op {
+    const char * key;       //the key
+    unsigned int key_size;  //bytes of key
+    int size;               //size of the data transfer
+    char * data;            //where the data being transfered resides
+};
+
+
+/*
+ * what the versioned ioctls are given.  Every write gives the data it writes a
+ * new version, higher than any version the device has had before, so a
+ * version names one write's data at an index (0 stands for no blob at all).
+ * SSTORE_IOCTL_WRITE_IF writes like write(), but only if the blob at the index
+ * is still at version: it returns the bytes written and sets version to the
+ * new data's, or returns -ESTALE and sets version to the one that's there, so
+ * the caller can read it and try again.  SSTORE_IOCTL_READ_IF_CHANGED reads
+ * like read(), but returns 0 without copying anything if the blob is still at
+ * version, and otherwise sets version to the one it read.  It never waits for
+ * a blob: -ENODATA means there isn't one.
+ */
+struct sstore_versioned {
+    struct user_buffer buffer;      //the index, size and data, as for read()
+    unsigned long long version;     //the version known (and the one found)
+};
+
+
+/*
+ * the records of /proc/sstore/data.bin: one of these for each blob with data,
+ * followed by size bytes of the blob's data.  Blobs come in order of device,
+ * then index.
+ */
+struct sstore_dump_record {
+    unsigned int device;    //which device (0 for /dev/sstore0)
+    unsigned int index;     //index of the blob
+    unsigned int size;      //bytes of data after this
+};
+
+
+/*
+ * DEVICE IMAGES.  /proc/sstore/image<N> is an image of device N's blobs (not
+ * its keys), for saving the store and loading it back with
+ * SSTORE_IOCTL_RESTORE after a restart.  An image is one of these headers,
+ * then a struct sstore_image_record for each blob with data followed by size
+ * bytes of its data, in order of index, and then a record with index 0 to
+ * mark the end.  Numbers are in the byte order of the machine that made the
+ * image.
+ */
+struct sstore_image_header {
+    unsigned int magic;     //SSTORE_IMAGE_MAGIC
+    unsigned int format;    //SSTORE_IMAGE_FORMAT
+    unsigned int max_blobs; //the max_blobs of the driver that made the image
+    unsigned int max_size;  //and its max_size
+};
+
+struct sstore_image_record {
+    unsigned int index;     //index of the blob (0 for the end of the image)
+    unsigned int size;      //bytes of data after this
+};
+
+
+/*
+ * what SSTORE_IOCTL_RESTORE is given: a whole image (or an image cut off
+ * after any record), from the header on.  Every blob in it is written to its
+ * index, replacing whatever is there, with the device's mutexes taken once
+ * for the whole image.  Indices not in the image are left alone (clear the
+ * device first for an exact copy).  It returns how many blobs were restored,
+ * or -EINVAL if the image is bad or has a blob the device can't hold (the
+ * blobs before that one are still restored).
+ */
+struct sstore_restore {
+    const char * image;     //the image
+    unsigned long size;     //bytes of it
+};
+
+
+/*
+ * WATCHES.  Instead of a thread blocked in read() for every index it's waiting
+ * on, a program can watch any number of indices on one open file with
+ * SSTORE_IOCTL_WATCH (the argument is the index, like SSTORE_IOCTL_DELETE),
+ * and then poll(), select() or epoll the file: it's readable when any of the
+ * indices it watches has a blob.  SSTORE_IOCTL_READY is then given one of
+ * these, and puts up to count of the watched indices that have blobs in
+ * indices.  It returns how many it found, and stops watching those (so the
+ * file stops being readable once they've all been picked up).
+ * SSTORE_IOCTL_UNWATCH stops watching an index without waiting for it.
+ */
+struct sstore_ready {
+    unsigned int count;     //room in indices
+    int * indices;          //where to put the ready indices
+};
+
+
+/*
+ * what SSTORE_IOCTL_BATCH is given.  The descriptors are run in order, all with
+ * the device's mutex held the whole time, and status[i] is set to what a
+ * read(), write() or delete ioctl would have returned for ops[i] (the number
+ * of bytes read or written, 0 for a delete, or a negative errno).  A read of an
+ * index with no blob doesn't wait, it gets -EAGAIN.
+ */
+struct sstore_batch {
+    unsigned int count;             //number of descriptors (at most SSTORE_BATCH_MAX)
+    struct sstore_batch_op * ops;   //the descriptors
+    int * status;                   //count ints to put the status of each in
+};
+
+#endif
@@ -0,0 +1,3315 @@
+/*
+ * sstore_core.c - the blob store behind the sstore device driver
+ *
+ * COPYRIGHT (C) 2009 Tyler Hayes - tgh@pdx.edu
+ *
+ */
+
+/*
+ * Everything here used to be in sstore.c along with the file operations.  It
+ * was pulled out so that it can also be built in user space (see
+ * sstore_shim.h and bench_core.c), which means no file, inode, proc or mmap
+ * stuff in this file--that all stays in sstore_main.c.
+ */
+
+#ifdef __KERNEL__
+#include <linux/module.h>
+#include <linux/moduleparam.h>  /* for module_param(), so that the module can
+                                 * take arguments from the command line when
+                                 * using insmod */
+#include <linux/sched.h>        /* for current process info */
+#include <linux/uaccess.h>      /* for copy_to_user() and copy_from_user() */
+#include <linux/slab.h>         /* for the slab caches blobs are allocated
+                                 * from */
+#include <linux/vmalloc.h>      /* for vmalloc() of the blob table */
+#include <linux/string.h>       /* for strcmp() */
+#include <linux/radix-tree.h>   /* for the radix tree blob index */
+#include <linux/rcupdate.h>     /* for the lockless (RCU) read path */
+#include <linux/hash.h>         /* for hash_long() of indices to wait
+                                 * buckets */
+#include <linux/mm.h>           /* for the page allocator */
+#include <linux/log2.h>         /* for ilog2() and roundup_pow_of_two() */
+#include <linux/spinlock.h>     /* for the page pool's lock */
+#include <linux/ktime.h>        /* for timing busy-polling readers and the
+                                 * latency histograms */
+#include <linux/percpu.h>       /* for alloc_percpu() of the stats */
+#include <linux/smp.h>          /* for get_cpu() and put_cpu() */
+#include <linux/bitops.h>       /* for fls64() */
+#include <linux/jhash.h>        /* for jhash() of keys */
+#include <linux/lzo.h>          /* for compressing blob data */
+#endif
+#include "sstore_core.h"        /* struct sstore, struct blob,
+                                   struct sstore_index_ops, and the kernel
+                                   stand-ins when in user space */
+
+
+/*
+ * Function prototypes (the rest are in sstore_core.h)
+ */
+static int sstore_table_init(struct sstore * device);
+static void sstore_table_destroy(struct sstore * device);
+static struct blob * sstore_table_lookup(struct sstore * device,
+        unsigned int index);
+static int sstore_table_store(struct sstore * device, unsigned int index,
+        struct blob * blob, struct blob ** old);
+static struct blob * sstore_table_erase(struct sstore * device,
+        unsigned int index);
+static struct blob * sstore_table_next(struct sstore * device,
+        unsigned int * index);
+static int sstore_radix_init(struct sstore * device);
+static void sstore_radix_destroy(struct sstore * device);
+static struct blob * sstore_radix_lookup(struct sstore * device,
+        unsigned int index);
+static int sstore_radix_store(struct sstore * device, unsigned int index,
+        struct blob * blob, struct blob ** old);
+static struct blob * sstore_radix_erase(struct sstore * device,
+        unsigned int index);
+static struct blob * sstore_radix_next(struct sstore * device,
+        unsigned int * index);
+static void sstore_blob_free_rcu(struct rcu_head * head);
+static int sstore_pools_init(void);
+static void sstore_pools_destroy(void);
+static struct blob * sstore_blob_alloc(void);
+static void sstore_blob_free(struct blob * blob);
+static void sstore_blob_free_data(struct blob * blob);
+static char * sstore_junk_alloc(size_t size, unsigned int * capacity);
+static void sstore_junk_free(char * junk, unsigned int capacity);
+static char * sstore_page_alloc(void);
+static void sstore_page_free(char * address);
+static unsigned long sstore_chunk_tables(void);
+static int sstore_chunks_grow(struct blob * blob, size_t size);
+static void sstore_chunks_free(struct blob * blob);
+static void sstore_wake_readers(struct sstore * device, unsigned int index);
+static int sstore_spin_for_blob(struct sstore * device, unsigned int index,
+        unsigned int spin);
+static void sstore_stat_add(struct sstore * device, int counter,
+        unsigned long n);
+static void sstore_stat_time(struct sstore * device, int op, ktime_t start);
+static int sstore_collapse(struct sstore * device, unsigned int index);
+static int sstore_prefault(const char __user * data, int size);
+static int sstore_blob_past(struct sstore * device, unsigned int index,
+        unsigned int offset);
+static ssize_t sstore_read_quick(struct sstore * device, int index,
+        int offset, int size, char __user * data);
+static ssize_t sstore_copy_out(struct sstore * device, struct blob * blob,
+        int offset, int size, char __user * data, ktime_t start);
+static int sstore_blob_new(struct sstore * device, int size,
+        const char __user * data, struct blob ** new_blob);
+static struct blob * sstore_blob_make(unsigned int room);
+static int sstore_blob_fill(struct blob * blob, unsigned int offset, int size,
+        const char __user * data);
+static int sstore_blob_mapped(struct blob * blob, unsigned int offset);
+static int sstore_overwrite(struct sstore * device, struct blob * blob,
+        int size, const char __user * data);
+static int sstore_append_fill(struct sstore * device, struct blob * blob,
+        int size, const char __user * data);
+static unsigned int sstore_blob_room(unsigned int size);
+static unsigned long sstore_blob_need(struct blob * blob, int size);
+static unsigned long sstore_blob_bytes(struct sstore * device,
+        struct blob * blob);
+static void sstore_charge(struct sstore * device, struct blob * blob);
+static void sstore_uncharge(struct sstore * device, struct blob * blob);
+static int sstore_evict_one(struct sstore * device, unsigned int skip);
+static int sstore_make_room(struct sstore * device, unsigned int index,
+        unsigned long need, unsigned long freed);
+struct sstore_scratch;
+static int sstore_scratch_alloc(void);
+static void sstore_scratch_free(struct sstore_scratch * scratch);
+static void sstore_compress_free(struct sstore * device);
+static int sstore_blob_compress(struct sstore * device, int size,
+        const char __user * data, struct blob ** new_blob);
+static int sstore_blob_unpack(struct blob * blob, int cpu, char ** data);
+static int sstore_blob_unpack_into(struct blob * blob, struct blob * to);
+static int sstore_unpack_out(struct sstore * device, struct blob * blob,
+        int offset, int size, char __user * data);
+static int sstore_prefault_out(char __user * data, int size);
+static void sstore_blob_copy_in(struct blob * blob, unsigned int offset,
+        unsigned int size, const char * from);
+static void sstore_blob_clear_tail(struct blob * blob, unsigned int end);
+static void sstore_blob_copy(struct blob * blob, struct blob * to);
+static int sstore_shares_init(struct sstore * device);
+static void sstore_shares_clear(struct sstore * device);
+static void sstore_shares_free(struct sstore * device);
+static u32 sstore_blob_hash(struct blob * blob);
+static int sstore_blob_same(struct blob * blob, struct blob * other);
+static int sstore_blob_share(struct sstore * device, int size,
+        const char __user * data, struct blob ** new_blob);
+static struct sstore_share ** sstore_share_slot(struct sstore * device,
+        struct blob * blob);
+static void sstore_unshare(struct sstore * device, struct blob * blob);
+static void sstore_shared_put(struct blob * shared);
+static void sstore_blob_discard(struct sstore * device, struct blob * blob);
+static int sstore_snapshot_keep(struct sstore * device, unsigned int index);
+static int sstore_snapshot_has(struct sstore * device, struct blob * blob);
+static struct sstore_key_table * sstore_key_table_alloc(unsigned int buckets,
+        int link);
+static void sstore_key_table_free(struct sstore_key_table * table);
+static void sstore_keys_quiet_rcu(struct rcu_head * head);
+static void sstore_keys_switched(struct sstore * device);
+static int sstore_keys_rehash(struct sstore * device);
+static struct sstore_key * sstore_key_find(struct sstore_key_table * table,
+        const char * key, unsigned int size, u32 hash,
+        struct sstore_key *** slot);
+static struct sstore_key * sstore_key_lookup(struct sstore * device,
+        const char * key, unsigned int size, u32 hash,
+        struct sstore_key *** slot, struct sstore_key_table ** table);
+static struct blob * sstore_key_get(struct sstore * device, const char * key,
+        unsigned int size, u32 hash);
+static void sstore_key_free_rcu(struct rcu_head * head);
+static void sstore_keys_clear(struct sstore * device);
+
+/*
+ * Global variables
+ */
+//the blob index backend all of the devices use (picked by index_backend)
+struct sstore_index_ops * sstore_index;
+/*
+ * where blobs and their data are allocated from (see ALLOCATION below).
+ * sstore_junk_caches[i] holds blob data of up to 2^(i + SSTORE_MIN_CLASS_SHIFT)
+ * bytes, and sstore_page_pool is a list of free pages, linked through their
+ * struct page's lru.
+ */
+#define SSTORE_MIN_CLASS_SHIFT 5
+#define SSTORE_SLAB_CLASSES (PAGE_SHIFT - SSTORE_MIN_CLASS_SHIFT)
+static struct kmem_cache * sstore_blob_cache;
+static struct kmem_cache * sstore_junk_caches[SSTORE_SLAB_CLASSES];
+static char sstore_junk_cache_names[SSTORE_SLAB_CLASSES][24];
+static LIST_HEAD(sstore_page_pool);
+static unsigned long sstore_pool_count;     //pages in the page pool
+//protects sstore_page_pool and its count
+static DEFINE_SPINLOCK(sstore_pool_lock);
+//allocation counters for /proc/sstore/stats
+struct sstore_alloc_stats sstore_allocs;
+/*
+ * each CPU's buffers for decompressing blobs into (see COMPRESSION below),
+ * allocated the first time any device turns compression on, under
+ * sstore_scratch_lock.
+ */
+struct sstore_scratch {
+    char * packed;          //a compressed blob's chunks, put back together
+    char * data;            //what it decompresses to
+};
+static struct sstore_scratch * sstore_scratch;
+static struct semaphore sstore_scratch_lock;
+
+/*
+ * Module Parameters -- S_IRUGO is a permissions mask that means this parameter
+ * can be read by the world, but cannot be changed.  In user space these are
+ * just globals for the program to set before sstore_core_init().
+ */
+unsigned int max_blobs = 10;
+unsigned int max_size = 1048;
+/*
+ * which structure holds the blobs of a device: "table" is a flat array of blob
+ * pointers (one slot per possible index, allocated on the first write), which
+ * is the fastest but costs max_blobs pointers per device.  "radix" is the
+ * kernel's radix tree, which only allocates nodes for indices that are used,
+ * so it's the one to pick for a big, sparsely written max_blobs.
+ */
+char * index_backend = "table";
+/*
+ * how many freed pages of blob data are kept around to reuse, instead of going
+ * back to the page allocator.
+ */
+unsigned int pool_pages = 256;
+/*
+ * the longest, in microseconds, a timed read is allowed to busy-poll for a
+ * blob before it goes to sleep, whatever it asks for (0 turns spinning off).
+ */
+unsigned int spin_usecs = 50;
+/*
+ * the most bytes of blob data each device holds (0 for no limit).  Past that,
+ * the blobs that haven't been used in the longest while are evicted to make
+ * room (see EVICTION below).
+ */
+unsigned long max_bytes = 0;
+/*
+ * writes of at least this many bytes (up to SSTORE_COMPRESS_MAX) are
+ * compressed, on every device that isn't told otherwise (0 for none).
+ */
+unsigned int compress_min = 0;
+/*
+ * whether each device keeps data that more than one blob has only once,
+ * shared by all of them (see SHARING below).
+ */
+int dedup = 0;
+#ifdef __KERNEL__
+module_param(max_blobs, uint, S_IRUGO);
+module_param(max_size, uint, S_IRUGO);
+module_param(index_backend, charp, S_IRUGO);
+module_param(pool_pages, uint, S_IRUGO);
+module_param(spin_usecs, uint, S_IRUGO);
+module_param(max_bytes, ulong, S_IRUGO);
+module_param(compress_min, uint, S_IRUGO);
+module_param(dedup, bool, S_IRUGO);
+#endif
+
+/*
+ * the blob index backends (see struct sstore_index_ops in sstore_core.h).  The
+ * index_backend module parameter is matched against the names here.
+ */
+struct sstore_index_ops sstore_index_backends[] = {
+    {
+        .name = "table",
+        .init = sstore_table_init,
+        .destroy = sstore_table_destroy,
+        .lookup = sstore_table_lookup,
+        .store = sstore_table_store,
+        .erase = sstore_table_erase,
+        .next = sstore_table_next
+    },
+    {
+        .name = "radix",
+        .init = sstore_radix_init,
+        .destroy = sstore_radix_destroy,
+        .lookup = sstore_radix_lookup,
+        .store = sstore_radix_store,
+        .erase = sstore_radix_erase,
+        .next = sstore_radix_next
+    }
+};
+
+//---------------------------------------------------------------------------
+
+/*
+ * BLOB INDEX: "table" backend.
+ *
+ * A flat array of max_blobs + 1 blob pointers, indexed directly by the blob
+ * index (slot 0 is never used since indices start at 1).  It's vmalloc()ed
+ * instead of kmalloc()ed since it gets big, and it isn't allocated until the
+ * first write so that a device nobody writes to doesn't cost anything.  Once
+ * allocated, the table itself stays put until the module is unloaded, so
+ * lockless lookups only have to worry about the blob pointers in it.
+ */
+static int sstore_table_init(struct sstore * device) {
+    device->blob_table = NULL;
+    return 0;
+}
+
+static void sstore_table_destroy(struct sstore * device) {
+    vfree(device->blob_table);
+    device->blob_table = NULL;
+}
+
+static struct blob * sstore_table_lookup(struct sstore * device,
+                                                        unsigned int index) {
+    struct blob ** table = rcu_dereference(device->blob_table);
+
+    if (!table || index > max_blobs)
+        return NULL;
+    return rcu_dereference(table[index]);
+}
+
+static int sstore_table_store(struct sstore * device, unsigned int index,
+                                    struct blob * blob, struct blob ** old) {
+    struct blob ** table = device->blob_table;
+
+    if (!table) {
+        table = vmalloc((max_blobs + 1) * sizeof (struct blob *));
+        if (!table)
+            return -ENOMEM;
+        memset(table, 0, (max_blobs + 1) * sizeof (struct blob *));
+        rcu_assign_pointer(device->blob_table, table);
+    }
+    *old = table[index];
+    rcu_assign_pointer(table[index], blob);
+    return 0;
+}
+
+static struct blob * sstore_table_erase(struct sstore * device,
+                                                        unsigned int index) {
+    struct blob * blob = sstore_table_lookup(device, index);
+
+    if (blob)
+        device->blob_table[index] = NULL;
+    return blob;
+}
+
+static struct blob * sstore_table_next(struct sstore * device,
+                                                    unsigned int * index) {
+    unsigned int i = 0;
+
+    //nothing is ever stored past blob_count, so don't look past it either
+    if (!device->blob_table)
+        return NULL;
+    for (i = *index; i <= device->blob_count; ++i) {
+        if (device->blob_table[i]) {
+            *index = i;
+            return device->blob_table[i];
+        }
+    }
+    return NULL;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * BLOB INDEX: "radix" backend.
+ *
+ * The kernel's radix tree (see lib/radix-tree.c), keyed by blob index.  It
+ * only allocates tree nodes for parts of the index space that hold blobs, so
+ * lookups are O(log n) instead of O(1) but a huge max_blobs costs nothing.
+ * The radix tree already supports lookups under rcu_read_lock() alongside
+ * changes made under a lock, and frees its nodes after a grace period.
+ */
+static int sstore_radix_init(struct sstore * device) {
+    INIT_RADIX_TREE(&device->blob_tree, GFP_KERNEL);
+    return 0;
+}
+
+static void sstore_radix_destroy(struct sstore * device) {
+    //the tree frees its own nodes as the last blobs are deleted from it
+}
+
+static struct blob * sstore_radix_lookup(struct sstore * device,
+                                                        unsigned int index) {
+    return radix_tree_lookup(&device->blob_tree, index);
+}
+
+static int sstore_radix_store(struct sstore * device, unsigned int index,
+                                    struct blob * blob, struct blob ** old) {
+    void ** slot;
+    int error = 0;
+
+    //an overwrite just swaps the pointer in the slot that's already there
+    slot = radix_tree_lookup_slot(&device->blob_tree, index);
+    if (slot) {
+        *old = radix_tree_deref_slot(slot);
+        radix_tree_replace_slot(slot, blob);
+        return 0;
+    }
+
+    /*
+     * otherwise a new slot is needed, which may need tree nodes allocated.
+     * Preloading does the allocating up front (where we're allowed to sleep),
+     * so that the insert itself can't fail for lack of memory.
+     */
+    *old = NULL;
+    error = radix_tree_preload(GFP_KERNEL);
+    if (error)
+        return error;
+    error = radix_tree_insert(&device->blob_tree, index, blob);
+    radix_tree_preload_end();
+    return error;
+}
+
+static struct blob * sstore_radix_erase(struct sstore * device,
+                                                        unsigned int index) {
+    return radix_tree_delete(&device->blob_tree, index);
+}
+
+static struct blob * sstore_radix_next(struct sstore * device,
+                                                    unsigned int * index) {
+    struct blob * blob;
+
+    if (!radix_tree_gang_lookup(&device->blob_tree, (void **) &blob, *index,
+                                                                        1))
+        return NULL;
+    *index = blob->index;
+    return blob;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * BLOB INDEX: helpers used by the file operations, on top of whichever backend
+ * was picked.
+ */
+
+/*
+ * the condition a sleeping reader waits on.  This is checked without the
+ * device's mutex, which is fine since the blob isn't touched, only whether one
+ * is there or not.
+ */
+int sstore_blob_ready(struct sstore * device, unsigned int index) {
+    int ready = 0;
+
+    rcu_read_lock();
+    ready = sstore_index->lookup(device, index) != NULL;
+    rcu_read_unlock();
+
+    return ready;
+}
+
+/*
+ * the condition a tail reader waits on: the blob at index has more than offset
+ * bytes of data (see sstore_tail_blob()).  Since every blob has some data, an
+ * offset of 0 is the same as sstore_blob_ready().
+ */
+static int sstore_blob_past(struct sstore * device, unsigned int index,
+                                                        unsigned int offset) {
+    struct blob * blob;
+    int ready = 0;
+
+    rcu_read_lock();
+    blob = sstore_index->lookup(device, index);
+    ready = blob && ACCESS_ONCE(blob->size) > offset;
+    rcu_read_unlock();
+
+    return ready;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * ALLOCATION.
+ *
+ * Blobs come from a slab cache of their own, and their data comes from one of
+ * a set of power-of-two size classes, so that writing and overwriting blobs
+ * keeps reusing the same memory instead of going through kmalloc() every time.
+ * Data of up to half a page comes from a slab cache per size class, and data
+ * of up to a page gets a page of its own (so that mmap() can map it as it is).
+ * Anything bigger is split into chunks, one page each, so a blob of many
+ * megabytes never needs more than a page of contiguous memory: the blob keeps
+ * a small kmalloc()ed array of pointers to pages of pointers to its chunks
+ * (see sstore_blob_data()).  Every page comes from a pool of freed pages, or
+ * the page allocator when the pool is empty.  Pages are freed from RCU
+ * callbacks (in softirq context), so the pool is protected by a spinlock,
+ * taken with bottom halves disabled everywhere else.
+ */
+#define SSTORE_CHUNKS_PER_PAGE (PAGE_SIZE / sizeof (char *))
+
+//create the caches.  Returns 0 or -ENOMEM (with whatever was created freed)
+static int sstore_pools_init(void) {
+    int i = 0;
+
+    sstore_blob_cache = kmem_cache_create("sstore_blob", sizeof (struct blob),
+                                                    0, SLAB_HWCACHE_ALIGN, NULL);
+    if (!sstore_blob_cache)
+        return -ENOMEM;
+
+    //only the size classes max_size can reach are needed
+    for (i = 0; i < SSTORE_SLAB_CLASSES && (i == 0 ||
+                    (1 << (i + SSTORE_MIN_CLASS_SHIFT - 1)) <= max_size); ++i) {
+        sprintf(sstore_junk_cache_names[i], "sstore_junk_%d",
+                                            1 << (i + SSTORE_MIN_CLASS_SHIFT));
+        sstore_junk_caches[i] = kmem_cache_create(sstore_junk_cache_names[i],
+                            1 << (i + SSTORE_MIN_CLASS_SHIFT), 0, 0, NULL);
+        if (!sstore_junk_caches[i]) {
+            sstore_pools_destroy();
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+//free the caches and the pages in the pool (every blob must be freed already)
+static void sstore_pools_destroy(void) {
+    struct page * page;
+    int i = 0;
+
+    while (!list_empty(&sstore_page_pool)) {
+        page = list_entry(sstore_page_pool.next, struct page, lru);
+        list_del(&page->lru);
+        __free_pages(page, 0);
+    }
+    sstore_pool_count = 0;
+
+    for (i = 0; i < SSTORE_SLAB_CLASSES; ++i) {
+        if (sstore_junk_caches[i])
+            kmem_cache_destroy(sstore_junk_caches[i]);
+        sstore_junk_caches[i] = NULL;
+    }
+    if (sstore_blob_cache)
+        kmem_cache_destroy(sstore_blob_cache);
+    sstore_blob_cache = NULL;
+}
+
+static struct blob * sstore_blob_alloc(void) {
+    atomic_long_inc(&sstore_allocs.blobs);
+    return kmem_cache_alloc(sstore_blob_cache, GFP_KERNEL);
+}
+
+//free a blob and its data
+static void sstore_blob_free(struct blob * blob) {
+    sstore_blob_free_data(blob);
+    kmem_cache_free(sstore_blob_cache, blob);
+}
+
+/*
+ * free a blob's data, or drop its reference to the data if it's shared (which
+ * is freed with the last one, see SHARING), and leave the blob with none.
+ */
+static void sstore_blob_free_data(struct blob * blob) {
+    if (blob->shared)
+        sstore_shared_put(blob->shared);
+    else if (blob->junk)
+        sstore_junk_free(blob->junk, blob->capacity);
+    else if (blob->chunks)
+        sstore_chunks_free(blob);
+    blob->shared = NULL;
+    blob->junk = NULL;
+    blob->chunks = NULL;
+    blob->capacity = 0;
+}
+
+/*
+ * where byte offset of the blob's data is, and, in *length, how many bytes
+ * from there up to end (which can't be past its capacity) are in one piece:
+ * all of them, or the rest of the chunk it's in.  Copying a blob is a loop
+ * over this, a chunk at a time.
+ */
+char * sstore_blob_data(struct blob * blob, unsigned int offset,
+                                    unsigned int end, unsigned int * length) {
+    unsigned long chunk = offset >> PAGE_SHIFT;
+
+    if (blob->junk) {
+        *length = end - offset;
+        return blob->junk + offset;
+    }
+    offset &= ~PAGE_MASK;
+    *length = min((unsigned int) (PAGE_SIZE - offset),
+                                        end - (chunk << PAGE_SHIFT) - offset);
+    return blob->chunks[chunk / SSTORE_CHUNKS_PER_PAGE]
+                                    [chunk % SSTORE_CHUNKS_PER_PAGE] + offset;
+}
+
+/*
+ * the blob's size, for a reader that doesn't hold the device's mutex.  An
+ * append can make the blob bigger while it's being read (see
+ * sstore_do_append()), so the size is read once, before any of the data, and
+ * the data up to it is all there.
+ */
+unsigned int sstore_blob_size(struct blob * blob) {
+    unsigned int size = ACCESS_ONCE(blob->size);
+
+    smp_rmb();
+    return size;
+}
+
+/*
+ * allocate space for size bytes (at most a page) of blob data, from the
+ * smallest size class that fits it.  *capacity is set to the size of that
+ * class, which is what the data really has room for.
+ */
+static char * sstore_junk_alloc(size_t size, unsigned int * capacity) {
+    int class = 0;
+
+    if (size <= PAGE_SIZE / 2) {
+        if (size > 1 << SSTORE_MIN_CLASS_SHIFT)
+            class = ilog2(roundup_pow_of_two(size)) - SSTORE_MIN_CLASS_SHIFT;
+        *capacity = 1 << (class + SSTORE_MIN_CLASS_SHIFT);
+        atomic_long_inc(&sstore_allocs.junk);
+        return kmem_cache_alloc(sstore_junk_caches[class], GFP_KERNEL);
+    }
+
+    *capacity = PAGE_SIZE;
+    return sstore_page_alloc();
+}
+
+//free blob data from sstore_junk_alloc()
+static void sstore_junk_free(char * junk, unsigned int capacity) {
+    if (capacity <= PAGE_SIZE / 2)
+        kmem_cache_free(sstore_junk_caches[ilog2(capacity) -
+                                        SSTORE_MIN_CLASS_SHIFT], junk);
+    else
+        sstore_page_free(junk);
+}
+
+/*
+ * get a page for blob data (or a blob's chunk pointers) from the pool, or from
+ * the page allocator if the pool is empty.  Pages aren't zeroed: the write
+ * fills them in and zeroes whatever is past its data, since all of the pages
+ * can get mapped by mmap().
+ */
+static char * sstore_page_alloc(void) {
+    struct page * page = NULL;
+
+    spin_lock_bh(&sstore_pool_lock);
+    if (!list_empty(&sstore_page_pool)) {
+        page = list_entry(sstore_page_pool.next, struct page, lru);
+        list_del(&page->lru);
+        --sstore_pool_count;
+    }
+    spin_unlock_bh(&sstore_pool_lock);
+    if (page) {
+        atomic_long_inc(&sstore_allocs.pool_hits);
+        return page_address(page);
+    }
+    atomic_long_inc(&sstore_allocs.pool_misses);
+    return (char *) __get_free_pages(GFP_KERNEL, 0);
+}
+
+/*
+ * free a page from sstore_page_alloc().  It goes back in the pool if the pool
+ * isn't full, unless it's still mapped into some process by mmap() (then it's
+ * only really freed when it's unmapped).
+ */
+static void sstore_page_free(char * address) {
+    struct page * page = virt_to_page(address);
+
+    if (page_count(page) == 1) {
+        spin_lock_bh(&sstore_pool_lock);
+        if (sstore_pool_count < pool_pages) {
+            list_add(&page->lru, &sstore_page_pool);
+            ++sstore_pool_count;
+            page = NULL;
+        }
+        spin_unlock_bh(&sstore_pool_lock);
+    }
+    if (page)
+        __free_pages(page, 0);
+}
+
+/*
+ * how many pages of chunk pointers a blob of max_size bytes needs.  Every
+ * chunked blob gets room for that many pointers to them up front, so that an
+ * append never has to move the pointers readers are using.
+ */
+static unsigned long sstore_chunk_tables(void) {
+    return DIV_ROUND_UP(PAGE_ALIGN((unsigned long) max_size) >> PAGE_SHIFT,
+                                                    SSTORE_CHUNKS_PER_PAGE);
+}
+
+/*
+ * add chunks to a blob (and pages of pointers to them, as they're needed)
+ * until it has room for size bytes.  The new chunks are past the blob's data,
+ * so readers don't look at them until its size says they can.  Returns 0 or
+ * -ENOMEM (then the blob has whatever chunks did get added).
+ */
+static int sstore_chunks_grow(struct blob * blob, size_t size) {
+    unsigned long chunk = blob->capacity >> PAGE_SHIFT;
+    char ** table;
+    char * page;
+
+    if (!blob->chunks) {
+        atomic_long_inc(&sstore_allocs.general);
+        blob->chunks = kzalloc(sstore_chunk_tables() * sizeof (char **),
+                                                                GFP_KERNEL);
+        if (!blob->chunks)
+            return -ENOMEM;
+    }
+    for (; blob->capacity < size; ++chunk) {
+        table = blob->chunks[chunk / SSTORE_CHUNKS_PER_PAGE];
+        if (!table) {
+            table = (char **) sstore_page_alloc();
+            if (!table)
+                return -ENOMEM;
+            memset(table, 0, PAGE_SIZE);
+            blob->chunks[chunk / SSTORE_CHUNKS_PER_PAGE] = table;
+        }
+        page = sstore_page_alloc();
+        if (!page)
+            return -ENOMEM;
+        table[chunk % SSTORE_CHUNKS_PER_PAGE] = page;
+        blob->capacity += PAGE_SIZE;
+    }
+    return 0;
+}
+
+//free the chunks of a blob, and the pages of pointers to them
+static void sstore_chunks_free(struct blob * blob) {
+    unsigned long tables = sstore_chunk_tables();
+    unsigned long i = 0;
+    unsigned long j = 0;
+
+    for (i = 0; i < tables && blob->chunks[i]; ++i) {
+        for (j = 0; j < SSTORE_CHUNKS_PER_PAGE && blob->chunks[i][j]; ++j)
+            sstore_page_free(blob->chunks[i][j]);
+        sstore_page_free((char *) blob->chunks[i]);
+    }
+    kfree(blob->chunks);
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * WAITING: readers that find no blob at their index sleep on the wait bucket
+ * its index hashes to, and writers only wake up the bucket of the index they
+ * wrote to.
+ */
+struct sstore_wait_bucket * sstore_wait_bucket(struct sstore * device,
+                                                        unsigned int index) {
+    return &device->wait_buckets[hash_long(index, SSTORE_WAIT_BITS)];
+}
+
+/*
+ * sleep until there's a blob at index with more than offset bytes of data (0
+ * for any blob), for at most *timeout jiffies (MAX_SCHEDULE_TIMEOUT to wait
+ * for as long as it takes).  Called without the device's mutex.  This is
+ * wait_event_interruptible_timeout() written out by hand, so that a wakeup
+ * that turns out to be for some other index in the same bucket can be
+ * counted.  Returns 0 once the blob is there, -ERESTARTSYS if a signal came
+ * first, or -ETIMEDOUT if the time ran out.  *timeout is left with whatever
+ * time there was left.
+ */
+int sstore_wait_for_blob(struct sstore * device, unsigned int index,
+                                        unsigned int offset, long * timeout) {
+    struct sstore_wait_bucket * bucket = sstore_wait_bucket(device, index);
+    DEFINE_WAIT(wait);
+    int error = 0;
+
+    /*
+     * count ourselves as a waiter before checking for the blob, so a writer
+     * either sees us waiting or we see its blob (prepare_to_wait() sets the
+     * task state with a memory barrier, and the writer has one to match).
+     */
+    atomic_inc(&bucket->waiters);
+    atomic_inc(&device->waiters);
+    for (;;) {
+        prepare_to_wait(&bucket->queue, &wait, TASK_INTERRUPTIBLE);
+        if (sstore_blob_past(device, index, offset))
+            break;
+        if (signal_pending(current)) {
+            error = -ERESTARTSYS;
+            break;
+        }
+        if (!*timeout) {
+            error = -ETIMEDOUT;
+            break;
+        }
+        *timeout = schedule_timeout(*timeout);
+        if (*timeout && !sstore_blob_past(device, index, offset) &&
+                                                    !signal_pending(current))
+            atomic_inc(&device->spurious_wakeups);
+    }
+    finish_wait(&bucket->queue, &wait);
+    atomic_dec(&device->waiters);
+    atomic_dec(&bucket->waiters);
+
+    return error;
+}
+
+/*
+ * wake up the readers waiting on the bucket of index, after a blob has been
+ * put there.  Called with the device's mutex held.
+ */
+static void sstore_wake_readers(struct sstore * device, unsigned int index) {
+    struct sstore_wait_bucket * bucket = sstore_wait_bucket(device, index);
+    int waiters = 0;
+
+    //make sure the new blob is visible before looking for waiters
+    smp_mb();
+    waiters = atomic_read(&bucket->waiters);
+    //everyone sleeping on the other buckets would have been woken up before
+    device->wakeups_avoided += atomic_read(&device->waiters) - waiters;
+    if (waiters) {
+        wake_up_interruptible(&bucket->queue);
+        sstore_stat_add(device, SSTORE_WAKEUPS, 1);
+    }
+}
+
+/*
+ * busy-poll for a blob at index for up to spin microseconds, instead of going
+ * to sleep right away, for readers that would rather burn a little CPU than
+ * pay for a sleep and a wakeup when the blob is only microseconds away.
+ * Returns 1 if the blob showed up, 0 if it didn't.
+ *
+ * How long to spin adapts to how well spinning has been working on the
+ * device (like an adaptive mutex): device->spin_usecs is doubled every time a
+ * spin finds its blob and halved every time one doesn't, so readers that
+ * keep giving up don't keep burning their whole budget.  It never goes below
+ * 1, so spinning gets another chance once writes start coming in quickly
+ * again.
+ */
+static int sstore_spin_for_blob(struct sstore * device, unsigned int index,
+                                                        unsigned int spin) {
+    unsigned int limit = atomic_read(&device->spin_usecs);
+    ktime_t start = ktime_get();
+
+    spin = min(spin, spin_usecs);
+    limit = min(limit, spin);
+    if (!limit)
+        return 0;
+
+    do {
+        if (sstore_blob_ready(device, index)) {
+            atomic_inc(&device->spin_hits);
+            atomic_set(&device->spin_usecs, min(limit * 2, spin_usecs));
+            return 1;
+        }
+        cpu_relax();
+    } while (!need_resched() && ktime_us_delta(ktime_get(), start) < limit);
+
+    atomic_inc(&device->spin_misses);
+    atomic_set(&device->spin_usecs, max(limit / 2, 1U));
+    return 0;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * look up the blob at index without the device's mutex and take a reference
+ * to it, so it stays around after rcu_read_unlock().  Returns NULL if there is
+ * no blob.
+ */
+struct blob * sstore_blob_get(struct sstore * device,
+                                                        unsigned int index) {
+    struct blob * blob;
+
+    for (;;) {
+        rcu_read_lock();
+        blob = sstore_index->lookup(device, index);
+        if (!blob || atomic_inc_not_zero(&blob->refs)) {
+            rcu_read_unlock();
+            return blob;
+        }
+        rcu_read_unlock();
+
+        /*
+         * atomic_inc_not_zero() fails if the blob has no references.  Either
+         * the last one was dropped after the lookup found it (it was just
+         * replaced or deleted, so look again and find what's there now), or
+         * a write is overwriting it in place, which holds the references at
+         * zero while it copies (see sstore_overwrite()).  That's one copy of
+         * at most a page, so just give it a moment and look again.
+         */
+        cpu_relax();
+        cond_resched();
+    }
+}
+
+//called by RCU once no lockless lookup can still be looking at the blob
+static void sstore_blob_free_rcu(struct rcu_head * head) {
+    struct blob * blob = container_of(head, struct blob, rcu);
+
+    sstore_blob_free(blob);
+}
+
+//drop a reference to a blob, freeing it (after a grace period) on the last one
+void sstore_blob_put(struct blob * blob) {
+    if (atomic_dec_and_test(&blob->refs))
+        call_rcu(&blob->rcu, sstore_blob_free_rcu);
+}
+
+/*
+ * close the gap left by deleting the blob at index, by moving every blob after
+ * it down by one index (delete has always renumbered the blobs behind the one
+ * deleted), waking up anyone waiting on the index a blob moves into.  Each
+ * blob is stored in its new slot before it is erased from the old one, so if
+ * the backend runs out of memory part way through, nothing is lost--the rest
+ * of the blobs just stay where they are.
+ */
+static int sstore_collapse(struct sstore * device, unsigned int index) {
+    struct blob * blob;
+    struct blob * old;
+    unsigned int next_index = index + 1;
+    int error = 0;
+
+    while ((blob = sstore_index->next(device, &next_index))) {
+        //both indices change, so snapshots keep what they had first
+        error = sstore_snapshot_keep(device, next_index - 1);
+        if (!error)
+            error = sstore_snapshot_keep(device, next_index);
+        if (!error)
+            error = sstore_index->store(device, next_index - 1, blob, &old);
+        if (error)
+            return error;
+        sstore_index->erase(device, next_index);
+        blob->index = next_index - 1;
+        sstore_wake_readers(device, blob->index);
+        ++next_index;
+    }
+    return 0;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * STATS.  Each CPU counts into its own struct sstore_cpu_stats (get_cpu()
+ * keeps us on it while we do), so nothing here is shared between CPUs until
+ * the stats file adds them all up.
+ */
+
+//add n to one of the counters
+static void sstore_stat_add(struct sstore * device, int counter,
+                                                        unsigned long n) {
+    struct sstore_cpu_stats * stats = per_cpu_ptr(device->stats, get_cpu());
+
+    stats->count[counter] += n;
+    put_cpu();
+}
+
+//count an operation of kind op that started at start, and how long it took
+static void sstore_stat_time(struct sstore * device, int op, ktime_t start) {
+    s64 nsecs = ktime_to_ns(ktime_sub(ktime_get(), start));
+    struct sstore_cpu_stats * stats;
+    int bucket = 0;
+
+    if (nsecs < 0)
+        nsecs = 0;
+    bucket = min(fls64(nsecs), SSTORE_HIST_BUCKETS - 1);
+
+    stats = per_cpu_ptr(device->stats, get_cpu());
+    ++stats->ops[op];
+    stats->nsecs[op] += nsecs;
+    ++stats->hist[op][bucket];
+    put_cpu();
+}
+
+/*
+ * take the device's mutex, timing how long that took.  Returns 0, or
+ * -ERESTARTSYS if a signal came while waiting for it.
+ */
+int sstore_lock(struct sstore * device) {
+    ktime_t start = ktime_get();
+
+    if (down_interruptible(&device->mutex)) {
+        sstore_stat_add(device, SSTORE_RESTARTS, 1);
+        return -ERESTARTSYS;
+    }
+    sstore_stat_time(device, SSTORE_OP_LOCK, start);
+
+    return 0;
+}
+
+/*
+ * add the stats of every CPU to total (so the stats of several devices can be
+ * added up too).  The other CPUs keep counting while we do, so it's a close
+ * look, not a snapshot.
+ */
+void sstore_stats_sum(struct sstore * device, struct sstore_cpu_stats * total) {
+    struct sstore_cpu_stats * stats;
+    int cpu = 0;
+    int op = 0;
+    int i = 0;
+
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(device->stats, cpu);
+        for (op = 0; op < SSTORE_OPS; ++op) {
+            total->ops[op] += stats->ops[op];
+            total->nsecs[op] += stats->nsecs[op];
+            for (i = 0; i < SSTORE_HIST_BUCKETS; ++i)
+                total->hist[op][i] += stats->hist[op][i];
+        }
+        for (i = 0; i < SSTORE_COUNTERS; ++i)
+            total->count[i] += stats->count[i];
+    }
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * SETUP AND TEARDOWN.  Called from the driver's init, release and exit (or
+ * straight from a user space program).
+ */
+
+/*
+ * find the blob index backend asked for with the index_backend parameter, and
+ * create the caches blobs and their data are allocated from.  Returns 0 or a
+ * negative errno.
+ */
+int sstore_core_init(void) {
+    int i = 0;
+
+    for (i = 0; i < ARRAY_SIZE(sstore_index_backends); ++i) {
+        if (!strcmp(index_backend, sstore_index_backends[i].name))
+            sstore_index = &sstore_index_backends[i];
+    }
+    if (!sstore_index) {
+        printk(KERN_ALERT "Unknown index_backend \"%s\": sstore",
+                                                            index_backend);
+        return -EINVAL;
+    }
+    sema_init(&sstore_scratch_lock, 1);
+
+    return sstore_pools_init();
+}
+
+/*
+ * let any blobs still waiting on a grace period be freed, then free the caches
+ * (and the buffers for decompressing)
+ */
+void sstore_core_exit(void) {
+    rcu_barrier();
+    sstore_pools_destroy();
+    sstore_scratch_free(sstore_scratch);
+    sstore_scratch = NULL;
+}
+
+int sstore_device_init(struct sstore * device) {
+    int error = 0;
+    int i = 0;
+
+    //set blob count to 0
+    device->blob_count = 0;
+    //nothing has been used yet
+    device->seek_index = 0;
+    device->version = 0;
+    //no data yet, and the budget the driver (or program) asked for
+    device->bytes = 0;
+    device->budget = max_bytes;
+    device->clock_hand = 1;
+    //no compression until it's turned on (below)
+    device->compress_min = 0;
+    device->compress_in = NULL;
+    device->compress_out = NULL;
+    device->compress_work = NULL;
+    //nothing shared until the table is made (below)
+    device->shares = NULL;
+    device->share_mask = 0;
+    device->share_count = 0;
+    device->shared_bytes = 0;
+    //no snapshots until one is taken
+    device->snapshots = NULL;
+    device->snapshot_count = 0;
+    device->kept_count = 0;
+    //initialize mutex lock for mutual exclusion of sstore struct variables
+    sema_init(&device->mutex, 1);
+    sema_init(&device->map_mutex, 1);
+    //deletes renumber the blobs after them unless the driver says otherwise
+    device->renumber = 1;
+    //initialize wait queues for blocking i/o in read
+    for (i = 0; i < SSTORE_WAIT_BUCKETS; ++i) {
+        init_waitqueue_head(&device->wait_buckets[i].queue);
+        atomic_set(&device->wait_buckets[i].waiters, 0);
+    }
+    atomic_set(&device->waiters, 0);
+    device->wakeups_avoided = 0;
+    atomic_set(&device->spurious_wakeups, 0);
+    atomic_set(&device->watches, 0);
+    atomic_set(&device->spin_usecs, spin_usecs);
+    atomic_set(&device->spin_hits, 0);
+    atomic_set(&device->spin_misses, 0);
+    atomic_set(&device->timeouts, 0);
+    //no keys yet (the first keyed write makes their table)
+    device->keys = NULL;
+    device->old_keys = NULL;
+    device->retired_keys = NULL;
+    device->key_count = 0;
+    atomic_set(&device->keys_quiet, 1);
+    //per-CPU stats (they come zeroed)
+    device->stats = alloc_percpu(struct sstore_cpu_stats);
+    if (!device->stats)
+        return -ENOMEM;
+    //set up the blob index
+    error = sstore_index->init(device);
+    if (error) {
+        free_percpu(device->stats);
+        device->stats = NULL;
+        return error;
+    }
+    //compress writes if the compress_min parameter says to
+    error = sstore_set_compression(device, compress_min);
+    //and share data if the dedup parameter says to
+    if (!error && dedup)
+        error = sstore_shares_init(device);
+    if (error)
+        sstore_device_destroy(device);
+    return error;
+}
+
+void sstore_device_destroy(struct sstore * device) {
+    //RCU may still have a hold of keys_rcu (see KEYS)
+    if (!atomic_read(&device->keys_quiet))
+        rcu_barrier();
+    sstore_index->destroy(device);
+    free_percpu(device->stats);
+    device->stats = NULL;
+    sstore_compress_free(device);
+    sstore_shares_free(device);
+}
+
+/*
+ * the device mustn't have any snapshots, since clearing it doesn't keep
+ * anything for them (the driver only clears devices that don't)
+ */
+void sstore_device_clear(struct sstore * device) {
+    struct blob * current_blob;
+    unsigned int index = 1;
+
+    while ((current_blob = sstore_index->next(device, &index))) {
+        sstore_index->erase(device, index);
+        sstore_blob_put(current_blob);
+    }
+    device->blob_count = 0;
+    device->seek_index = 0;
+    sstore_keys_clear(device);
+    //the blobs are all gone, so nothing is shared anymore
+    sstore_shares_clear(device);
+    device->bytes = 0;
+    device->clock_hand = 1;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * BLOB OPERATIONS.  These do the actual reading, writing and deleting for
+ * read(), write() and ioctl(), and for each descriptor of a batch ioctl.
+ * Writing and deleting must be done with the device's mutex held, reading
+ * doesn't need it (but doesn't mind it either).
+ */
+
+/*
+ * copy up to size bytes of the blob at index, starting offset bytes into its
+ * data, to the user's data buffer, or all of the blob's data from there on if
+ * there's less than that.  Returns the number of bytes copied (0 if offset is
+ * at or past the end of the data), or -EAGAIN if there is no blob at the index
+ * (read() then waits for one, a batch just reports it).
+ *
+ * The blob is found under RCU and we hold a reference to it while copying, so
+ * writers and deletes can replace or remove it in the meantime without waiting
+ * on us (see struct blob in sstore_core.h).  Small reads don't even need the
+ * reference (see sstore_read_quick()).
+ */
+ssize_t sstore_do_read(struct sstore * device, int index, int offset,
+                                            int size, char __user * data) {
+    struct blob * blob;         //the blob at the requested index
+    ssize_t bytes_read = 0;
+    ktime_t start = ktime_get();
+
+    //return inavlid argument error if requested index goes beyond maximum blobs
+    if (index > max_blobs || index <= 0 || offset < 0 || size < 0)
+        return -EINVAL;
+
+    bytes_read = sstore_read_quick(device, index, offset, size, data);
+    if (bytes_read >= 0) {
+        sstore_stat_time(device, SSTORE_OP_READ, start);
+        sstore_stat_add(device, SSTORE_BYTES_OUT, bytes_read);
+        return bytes_read;
+    }
+
+    blob = sstore_blob_get(device, index);
+    if (!blob)
+        return -EAGAIN;
+
+    return sstore_copy_out(device, blob, offset, size, data, start);
+}
+
+/*
+ * the read of sstore_do_read() for a blob that isn't compressed and that has
+ * no more than SSTORE_QUICK_READ bytes to read, without taking a reference to
+ * it.  A reference count is one cache line every reader of the blob writes to,
+ * so with it, reads of a hot blob on different CPUs take turns at that line
+ * and can't go any faster with more CPUs.  Instead, the copy is done under
+ * rcu_read_lock() (which keeps the blob from being freed), with page faults
+ * off, since it can't sleep, and the blob's reference count and version are
+ * checked before and after, like a seqlock: sstore_overwrite() holds the
+ * count at zero while it changes the data, and gives the data a new version
+ * before letting go.  Appends in place don't change any data below the size,
+ * so they don't matter.  Returns the bytes read, or -EAGAIN if it has to be
+ * read the usual way (no blob, a big or compressed one, an overwrite going
+ * on, or the user's buffer not all there).
+ */
+static ssize_t sstore_read_quick(struct sstore * device, int index,
+                                int offset, int size, char __user * data) {
+    struct blob * blob;
+    unsigned int blob_size = 0; //the blob's size when we started
+    int bytes_read = 0;
+    int copied = 0;
+    unsigned int length = 0;    //bytes to copy from the current chunk
+    unsigned long left = 0;     //bytes that didn't get copied
+    char * from;
+    u64 version = 0;
+    int ok = 0;
+
+    rcu_read_lock();
+    blob = sstore_index->lookup(device, index);
+    if (blob && !blob->stored && atomic_read(&blob->refs)) {
+        smp_rmb();
+        version = blob->version;
+        smp_rmb();
+        blob_size = sstore_blob_size(blob);
+        if (offset < blob_size)
+            bytes_read = min((unsigned int) size, blob_size - offset);
+        ok = bytes_read <= SSTORE_QUICK_READ;
+    }
+    if (ok) {
+        pagefault_disable();
+        for (copied = 0; !left && copied < bytes_read; copied += length) {
+            from = sstore_blob_data(blob, offset + copied,
+                                            offset + bytes_read, &length);
+            left = __copy_to_user_inatomic(data + copied, from, length);
+        }
+        pagefault_enable();
+        //the copy before the checks
+        smp_rmb();
+        ok = !left && atomic_read(&blob->refs);
+        smp_rmb();
+        ok = ok && blob->version == version;
+        //tell the clock hand it's been used (only writing when it has to)
+        if (ok && !blob->referenced)
+            blob->referenced = 1;
+    }
+    rcu_read_unlock();
+
+    return ok ? bytes_read : -EAGAIN;
+}
+
+/*
+ * copy up to size bytes of blob's data from offset on to the user, and drop
+ * the reference to the blob the caller got for it.  start is when the read
+ * started, for the stats.  Returns the number of bytes copied.
+ */
+static ssize_t sstore_copy_out(struct sstore * device, struct blob * blob,
+                    int offset, int size, char __user * data, ktime_t start) {
+    unsigned int blob_size = 0; //the blob's size when we started
+    int bytes_read = 0;         //the amount actually read (sent back to user)
+    int copied = 0;             //how much of it has been copied so far
+    unsigned int length = 0;    //bytes to copy from the current chunk
+    char * from;                //where in the blob they are
+    int error = 0;              //used for detecting error return values
+
+    /*
+     * determine the amount of data to copy to the user. it will either be the
+     * amount requested by the user if there is enough data in the blob past
+     * offset, or it will be whatever is left in the blob if the requested
+     * amount is too big.  The blob knows how much data it holds, so there's
+     * no need to go looking for the end of it (and the data can have '\0's in
+     * it).
+     */
+    blob_size = sstore_blob_size(blob);
+    if (offset < blob_size)
+        bytes_read = min((unsigned int) size, blob_size - offset);
+
+    //copy the data to the buffer sent in by the user, a chunk at a time
+    if (blob->stored)
+        error = sstore_unpack_out(device, blob, offset, bytes_read, data);
+    else {
+        for (copied = 0; copied < bytes_read && !error; copied += length) {
+            from = sstore_blob_data(blob, offset + copied,
+                                            offset + bytes_read, &length);
+            if (copy_to_user(data + copied, from, length))
+                error = -EFAULT;
+        }
+    }
+    //tell the clock hand it's been used (only writing when it has to)
+    if (!blob->referenced)
+        blob->referenced = 1;
+    //done with the blob
+    sstore_blob_put(blob);
+    if (error)
+        return error;
+
+    sstore_stat_time(device, SSTORE_OP_READ, start);
+    sstore_stat_add(device, SSTORE_BYTES_OUT, bytes_read);
+    return bytes_read;
+}
+
+/*
+ * read the blob at the requested index (from offset on), and wait if there
+ * isn't one.  There is no blob when the index is beyond the last one written,
+ * or when it was skipped over by a write further down the index (the old blob
+ * list had empty blobs there).  This also takes care of the case where the
+ * device is empty.  Used by read() and the range read ioctls.
+ *
+ * timeout is how many jiffies to wait: 0 doesn't wait at all (for O_NONBLOCK)
+ * and returns -EAGAIN, MAX_SCHEDULE_TIMEOUT waits for as long as it takes, and
+ * anything in between returns -ETIMEDOUT if no blob shows up in time.  spin is
+ * how many microseconds to busy-poll before going to sleep (see
+ * sstore_spin_for_blob()), 0 for none.
+ *
+ * The mutex is never taken here (see sstore_do_read()), which also means
+ * the seek pointer is only moved by writes.
+ */
+ssize_t sstore_read_blob(struct sstore * device, int index, int offset,
+                int size, char __user * data, long timeout, unsigned int spin) {
+    ssize_t bytes_read = 0;
+    int waited = 0;             //whether we've slept yet
+    ktime_t start;              //when we went to sleep
+    int error = 0;
+
+    while ((bytes_read = sstore_do_read(device, index, offset, size,
+                                                        data)) == -EAGAIN) {
+        if (!timeout && !waited)
+            return -EAGAIN;
+        //only spin the first time around (once woken up, the blob is there)
+        if (spin && sstore_spin_for_blob(device, index, spin)) {
+            spin = 0;
+            continue;
+        }
+        spin = 0;
+        //DEBUG OUTPUT
+        PDEBUG("\n\"%s\" in read() is sleeping...", current->comm);
+        //block (wait for data at requested index)
+        start = ktime_get();
+        error = sstore_wait_for_blob(device, index, 0, &timeout);
+        sstore_stat_time(device, SSTORE_OP_WAIT, start);
+        waited = 1;
+        if (error == -ETIMEDOUT)
+            atomic_inc(&device->timeouts);
+        if (error == -ERESTARTSYS)
+            sstore_stat_add(device, SSTORE_RESTARTS, 1);
+        if (error)
+            return error;
+    }
+
+    return bytes_read;
+}
+
+/*
+ * read up to size bytes of the blob at index from offset on, like
+ * sstore_read_blob(), but for a reader following a blob as it's appended to:
+ * offset is how much of it the reader already has, and if the blob has no
+ * more than that (or isn't there at all), wait until an append or write gives
+ * it more.  A timeout of 0 returns -EAGAIN instead of waiting.  Returns the
+ * number of bytes read, which is never 0.
+ */
+ssize_t sstore_tail_blob(struct sstore * device, int index, int offset,
+                                int size, char __user * data, long timeout) {
+    ssize_t bytes_read = 0;
+    ktime_t start;              //when we went to sleep
+    int error = 0;
+
+    if (size <= 0)
+        return -EINVAL;
+
+    for (;;) {
+        bytes_read = sstore_do_read(device, index, offset, size, data);
+        if (bytes_read && bytes_read != -EAGAIN)
+            return bytes_read;
+        if (!timeout)
+            return -EAGAIN;
+        start = ktime_get();
+        error = sstore_wait_for_blob(device, index, offset, &timeout);
+        sstore_stat_time(device, SSTORE_OP_WAIT, start);
+        if (error == -ERESTARTSYS)
+            sstore_stat_add(device, SSTORE_RESTARTS, 1);
+        if (error)
+            return error;
+    }
+}
+
+/*
+ * touch every page of a user buffer, so that copying from it right after won't
+ * fault (unless the user unmaps it in between).  Returns 0, or -EFAULT if the
+ * buffer isn't all there.
+ */
+static int sstore_prefault(const char __user * data, int size) {
+    const char __user * end = data + size - 1;
+    char c;
+
+    for (; data <= end; data += PAGE_SIZE) {
+        if (get_user(c, data))
+            return -EFAULT;
+    }
+    //the loop can step over the start of the last page
+    if (get_user(c, end))
+        return -EFAULT;
+
+    return 0;
+}
+
+/*
+ * whether any of the pages holding the blob's data from offset on (up to its
+ * capacity) are mapped by mmap(), which promises a mapping won't change.
+ * Data of up to half a page is in a size class, which mmap() copies instead,
+ * and a page nobody but the blob has a reference to isn't mapped.
+ */
+static int sstore_blob_mapped(struct blob * blob, unsigned int offset) {
+    unsigned int length = 0;    //bytes in the chunk at offset
+    char * data;
+
+    if (blob->junk)
+        return blob->capacity > PAGE_SIZE / 2 &&
+                                    page_count(virt_to_page(blob->junk)) > 1;
+    for (offset &= PAGE_MASK; offset < blob->capacity; offset += length) {
+        data = sstore_blob_data(blob, offset, blob->capacity, &length);
+        if (page_count(virt_to_page(data)) > 1)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * overwrite the data of a blob that's in the index, in place, with size bytes
+ * of the user's data.  This is only done when nobody but the index has a
+ * reference to the blob (so no reader is copying from it, and no snapshot is
+ * keeping it, see SNAPSHOTS), its data fits in
+ * the space it already has (which is a page at most: chunked blobs are always
+ * replaced, or readers could be left waiting on a copy of megabytes), and its
+ * pages aren't mapped by mmap() (which
+ * promises a mapping won't change).  Returns 0 if the blob was overwritten,
+ * 1 if it can't be (sstore_do_write() puts a new blob there instead), or a
+ * negative errno.  Called with the device's mutex held.
+ *
+ * Readers are kept off the blob by taking its reference count from 1 (the
+ * index's) to 0 while copying, so their atomic_inc_not_zero() fails and they
+ * wait for it to come back (see sstore_blob_get()).  That keeps mmap() off it
+ * too, since it gets the blob the same way, but only from then on: faulting
+ * in the user's buffer can sleep, and an mmap() can map the blob and let go
+ * of it in the meantime, so whether it's mapped is looked at again once the
+ * references are at 0.  The copy is done with
+ * page faults disabled, so they're only waiting on a memcpy(): the user's
+ * buffer is faulted in first, and only if it gets unmapped in between does the
+ * copy have to fault, and sleep, while they wait.
+ */
+static int sstore_overwrite(struct sstore * device, struct blob * blob,
+                                    int size, const char __user * data) {
+    unsigned long left = 0;     //bytes that didn't get copied
+
+    if (!blob->junk || blob->stored || blob->shared ||
+                                                size + 1 > blob->capacity)
+        return 1;
+    if (sstore_blob_mapped(blob, 0))
+        return 1;
+    if (sstore_prefault(data, size))
+        return -EFAULT;
+    if (atomic_cmpxchg(&blob->refs, 1, 0) != 1)
+        return 1;
+    //(mapped while the buffer was faulted in)
+    if (sstore_blob_mapped(blob, 0)) {
+        atomic_set(&blob->refs, 1);
+        return 1;
+    }
+
+    pagefault_disable();
+    left = __copy_from_user_inatomic(blob->junk, data, size);
+    pagefault_enable();
+    if (left)
+        left = copy_from_user(blob->junk + size - left, data + size - left,
+                                                                        left);
+    //don't leave what's left of the old data behind a failed copy
+    if (left)
+        memset(blob->junk + size - left, 0, left);
+    blob->junk[size] = '\0';
+    blob->size = size;
+    //clear the rest of the pages, since all of them can be mapped by mmap()
+    if (blob->capacity > PAGE_SIZE / 2)
+        memset(blob->junk + size + 1, 0, blob->capacity - size - 1);
+    //it's new data, whether or not the blob is (see sstore_read_quick())
+    smp_wmb();
+    blob->version = ++device->version;
+    blob->referenced = 1;
+
+    //make sure the new data is there before readers can get at it again
+    smp_wmb();
+    atomic_set(&blob->refs, 1);
+
+    atomic_long_inc(&sstore_allocs.in_place);
+    return left ? -EFAULT : 0;
+}
+
+/*
+ * make a new blob holding size bytes of the user's data, with one reference
+ * (for the index, or key, it's about to go in) and the device's next version.
+ * Returns 0 or a negative errno.  Called with the device's mutex held.
+ */
+static int sstore_blob_new(struct sstore * device, int size,
+                        const char __user * data, struct blob ** new_blob) {
+    struct blob * blob;
+    int error = 0;
+
+    blob = sstore_blob_make(size);
+    if (!blob)
+        return -ENOMEM;
+    error = sstore_blob_fill(blob, 0, size, data);
+    if (error) {
+        sstore_blob_free(blob);
+        return error;
+    }
+    blob->size = size;
+    blob->version = ++device->version;
+
+    *new_blob = blob;
+    return 0;
+}
+
+/*
+ * make a blob with room for room bytes of data but none yet, with one
+ * reference.  Data that fits in a page (with its '\0') is kept in one piece,
+ * anything bigger in chunks.  Returns NULL if there's no memory for it.
+ */
+static struct blob * sstore_blob_make(unsigned int room) {
+    struct blob * blob;
+    int error = 0;
+
+    blob = sstore_blob_alloc();
+    if (!blob)
+        return NULL;
+    blob->index = 0;
+    blob->version = 0;
+    atomic_set(&blob->refs, 1);
+    blob->junk = NULL;
+    blob->chunks = NULL;
+    blob->size = 0;
+    blob->capacity = 0;
+    blob->stored = 0;
+    blob->referenced = 1;
+    blob->shared = NULL;
+    blob->hash = 0;
+    if (room < PAGE_SIZE) {
+        blob->junk = sstore_junk_alloc(room + 1, &blob->capacity);
+        if (!blob->junk)
+            error = -ENOMEM;
+    } else
+        error = sstore_chunks_grow(blob, room);
+    if (error) {
+        sstore_blob_free(blob);
+        return NULL;
+    }
+    return blob;
+}
+
+/*
+ * copy size bytes of the user's data into the blob at offset, a chunk at a
+ * time, and clear the rest of the page they end in, since all of a blob's
+ * pages can be mapped by mmap().  The blob has to have room for them.  The
+ * blob's size isn't changed, that's up to the caller.  Returns 0 or -EFAULT.
+ */
+static int sstore_blob_fill(struct blob * blob, unsigned int offset, int size,
+                                                const char __user * data) {
+    unsigned int end = offset + size;
+    unsigned int length = 0;    //bytes to copy into the current chunk
+    char * to;                  //where in the blob they go
+    int copied = 0;             //bytes copied from the user so far
+
+    for (copied = 0; copied < size; copied += length) {
+        to = sstore_blob_data(blob, offset + copied, end, &length);
+        if (copy_from_user(to, data + copied, length))
+            return -EFAULT;
+        if (blob->chunks)
+            cond_resched();
+    }
+
+    sstore_blob_clear_tail(blob, end);
+    return 0;
+}
+
+/*
+ * the same as sstore_blob_fill(), but from a kernel buffer.  This one never
+ * sleeps.
+ */
+static void sstore_blob_copy_in(struct blob * blob, unsigned int offset,
+                                    unsigned int size, const char * from) {
+    unsigned int end = offset + size;
+    unsigned int length = 0;    //bytes to copy into the current chunk
+    unsigned int copied = 0;
+    char * to;                  //where in the blob they go
+
+    for (copied = 0; copied < size; copied += length) {
+        to = sstore_blob_data(blob, offset + copied, end, &length);
+        memcpy(to, from + copied, length);
+    }
+    sstore_blob_clear_tail(blob, end);
+}
+
+/*
+ * '\0' terminate a blob's data, which ends at end, and clear the rest of the
+ * page it ends in (see sstore_blob_fill()).
+ */
+static void sstore_blob_clear_tail(struct blob * blob, unsigned int end) {
+    unsigned int length = 0;
+    char * to;
+
+    if (blob->junk) {
+        blob->junk[end] = '\0';
+        if (blob->capacity > PAGE_SIZE / 2)
+            memset(blob->junk + end + 1, 0, blob->capacity - end - 1);
+    } else if (end & ~PAGE_MASK) {
+        to = sstore_blob_data(blob, end - 1, end, &length) + 1;
+        memset(to, 0, PAGE_SIZE - (end & ~PAGE_MASK));
+    }
+}
+
+/*
+ * copy the data of a blob that isn't compressed into another blob, which has
+ * to have room for it, a chunk at a time.  Never sleeps.
+ */
+static void sstore_blob_copy(struct blob * blob, struct blob * to) {
+    unsigned int offset = 0;
+    unsigned int length = 0;    //bytes to copy from the current chunk
+    char * from;                //where in the blob they are
+
+    for (offset = 0; offset < blob->size; offset += length) {
+        from = sstore_blob_data(blob, offset, blob->size, &length);
+        sstore_blob_copy_in(to, offset, length, from);
+    }
+}
+
+/*
+ * store a new blob with size bytes of the user's data at index (or max_size
+ * bytes, if size is more than that).  If there is data already in a blob at
+ * the given index, its data is overwritten in place if it can be, otherwise
+ * that blob is replaced by the new one.  Returns the number of bytes written.
+ */
+ssize_t sstore_do_write(struct sstore * device, int index, int size,
+                                                const char __user * data) {
+    struct blob * blob = NULL;  //the new blob being written
+    struct blob * old_blob;     //the blob it replaces, if any
+    int error = 0;              //used for detecting error return values
+    int bytes_written = 0;      //the amount actually written
+    ktime_t start = ktime_get();
+
+    //return inavlid argument error if given index is beyond maximum blobs
+    if (index > max_blobs || index <= 0  || size <= 0)
+        return -EINVAL;
+
+    /*
+     * allocate the new blob and space for its data.  If the given amount to
+     * write is greater than the maximum size specified by the module
+     * parameter max_size, then max_size of data is written.
+     */
+    if (size > max_size)
+        size = max_size;
+    bytes_written = size;
+
+    //snapshots keep what the index has before it changes (see SNAPSHOTS)
+    error = sstore_snapshot_keep(device, index);
+    if (error)
+        return error;
+
+    //compress it, if the device compresses data this size (see COMPRESSION)
+    error = sstore_blob_compress(device, size, data, &blob);
+    //and share it with any blob that has the same data (see SHARING)
+    if (!error)
+        error = sstore_blob_share(device, size, data, &blob);
+    if (error)
+        return error;
+
+    /*
+     * if there's already a blob at the index, just overwrite its data where it
+     * is if we can.  That's one copy, with no allocating, freeing or changing
+     * the index.  Either way, the data it has now won't count against the
+     * budget once it's gone (shared data is already counted).
+     */
+    old_blob = sstore_index->lookup(device, index);
+    error = sstore_make_room(device, index, sstore_blob_need(blob, size),
+                    old_blob ? sstore_blob_bytes(device, old_blob) : 0);
+    if (error) {
+        if (blob)
+            sstore_blob_discard(device, blob);
+        return error;
+    }
+    if (old_blob && !blob) {
+        error = sstore_overwrite(device, old_blob, size, data);
+        if (error <= 0) {
+            device->seek_index = index;
+            if (error)
+                return error;
+            sstore_stat_time(device, SSTORE_OP_WRITE, start);
+            sstore_stat_add(device, SSTORE_BYTES_IN, bytes_written);
+            return bytes_written;
+        }
+    }
+
+    if (!blob)
+        error = sstore_blob_new(device, size, data, &blob);
+    if (error)
+        return error;
+    blob->index = index;
+
+    /*
+     * put the blob in the index at the given index.  Indices skipped over on
+     * the way just stay empty, there's no need to allocate blobs for them.  If
+     * there was already data at this index, the blob holding it comes back
+     * out of the index in old_blob and the index's reference to it is dropped
+     * (readers still copying from it have their own).
+     */
+    error = sstore_index->store(device, blob->index, blob, &old_blob);
+    if (error) {
+        sstore_blob_discard(device, blob);
+        return error;
+    }
+    sstore_charge(device, blob);
+    if (old_blob) {
+        sstore_uncharge(device, old_blob);
+        sstore_blob_put(old_blob);
+    }
+    if (blob->index > device->blob_count)
+        device->blob_count = blob->index;
+    device->seek_index = blob->index;
+
+    //notify readers sleeping on this index that something has been written
+    sstore_wake_readers(device, blob->index);
+
+    sstore_stat_time(device, SSTORE_OP_WRITE, start);
+    sstore_stat_add(device, SSTORE_BYTES_IN, bytes_written);
+    return bytes_written;
+}
+
+/*
+ * add size bytes of the user's data to the end of the blob at index (or write
+ * them there, if there's no blob yet).  A blob never grows past max_size: the
+ * data that doesn't fit is left off, and -EFBIG is returned if none of it
+ * does.  Returns the number of bytes appended.  Called with the device's
+ * mutex held.
+ *
+ * Readers don't need to be kept off the blob, since nobody reads past its
+ * size: the new data (and any chunks added for it) goes in past the end, and
+ * then the size is moved up over it.  Data kept in one piece is given twice
+ * the room it needs when it has to be moved to a bigger blob, and chunked data
+ * just gets more chunks, so a blob that's appended to over and over isn't
+ * copied over and over.  Compressed data is decompressed into a new blob,
+ * which is left uncompressed, and shared data is copied into one, which isn't
+ * shared.  So is a blob a snapshot has (see SNAPSHOTS), so it doesn't change
+ * under the snapshot.  And so is one whose pages past the end of its data are
+ * mapped by mmap() (see sstore_blob_mapped()), since the new data would show
+ * up in the mapping, which can't be known for sure until the data is being
+ * copied in (see sstore_append_fill()).
+ */
+ssize_t sstore_do_append(struct sstore * device, int index, int size,
+                                                const char __user * data) {
+    struct blob * blob;         //the blob being appended to
+    struct blob * new_blob;     //a bigger one for it, if it's out of room
+    struct blob * old_blob;     //what comes back out of the index
+    unsigned int end = 0;       //its size with the new data
+    unsigned int room = 0;      //what a bigger blob gets room for
+    unsigned int capacity = 0;  //what the blob had room for before
+    int in_place = 0;           //whether the data can stay where it is
+    int error = 0;
+    ktime_t start = ktime_get();
+
+    if (index > max_blobs || index <= 0 || size <= 0)
+        return -EINVAL;
+
+    blob = sstore_index->lookup(device, index);
+    if (!blob)
+        return sstore_do_write(device, index, size, data);
+    if (blob->size >= max_size)
+        return -EFBIG;
+    error = sstore_snapshot_keep(device, index);
+    if (error)
+        return error;
+    if (size > max_size - blob->size)
+        size = max_size - blob->size;
+    end = blob->size + size;
+    capacity = blob->capacity;
+    //(whether it's mapped is only settled in sstore_append_fill())
+    in_place = !blob->stored && !blob->shared &&
+                !sstore_snapshot_has(device, blob) &&
+                !sstore_blob_mapped(blob, blob->size) &&
+                (blob->chunks || end + 1 <= capacity);
+
+    if (in_place) {
+        //there's room (or there can be) right where the data is
+        error = sstore_make_room(device, index, blob->chunks ?
+        max((unsigned long) capacity, (unsigned long) PAGE_ALIGN(end)) :
+                                                                capacity,
+                                        sstore_blob_bytes(device, blob));
+        if (!error && blob->chunks) {
+            error = sstore_chunks_grow(blob, end);
+            //whatever chunks it did get count, even if it ran out
+            device->bytes += blob->capacity - capacity;
+        }
+        if (!error)
+            error = sstore_append_fill(device, blob, size, data);
+        if (error < 0)
+            return error;
+        //1 if it got mapped after all
+        in_place = !error;
+    }
+
+    if (in_place) {
+        //the new data has to be there before readers can see the new size
+        smp_wmb();
+        blob->size = end;
+        //and the size before the version (see sstore_do_read_if())
+        smp_wmb();
+        blob->version = ++device->version;
+        blob->referenced = 1;
+    } else {
+        room = end;
+        if (end < PAGE_SIZE)
+            room = min(min(end * 2, max_size), (unsigned int) PAGE_SIZE - 1);
+        error = sstore_make_room(device, index, sstore_blob_room(room),
+                                        sstore_blob_bytes(device, blob));
+        if (error)
+            return error;
+        new_blob = sstore_blob_make(room);
+        if (!new_blob)
+            return -ENOMEM;
+        //the data it has so far (which is left uncompressed from now on)
+        if (blob->stored)
+            error = sstore_blob_unpack_into(blob, new_blob);
+        else
+            sstore_blob_copy(blob, new_blob);
+        if (!error)
+            error = sstore_blob_fill(new_blob, blob->size, size, data);
+        if (error) {
+            sstore_blob_free(new_blob);
+            return error;
+        }
+        new_blob->index = index;
+        new_blob->size = end;
+        new_blob->version = ++device->version;
+        error = sstore_index->store(device, index, new_blob, &old_blob);
+        if (error) {
+            sstore_blob_free(new_blob);
+            return error;
+        }
+        sstore_charge(device, new_blob);
+        sstore_uncharge(device, old_blob);
+        sstore_blob_put(old_blob);
+    }
+    device->seek_index = index;
+
+    //wake up readers following the blob (see sstore_tail_blob())
+    sstore_wake_readers(device, index);
+
+    sstore_stat_time(device, SSTORE_OP_WRITE, start);
+    sstore_stat_add(device, SSTORE_BYTES_IN, size);
+    return size;
+}
+
+/*
+ * copy size bytes of the user's data in past the end of a blob's data, for
+ * an append in place.  The blob has to have room for them.  Returns 0, 1 if
+ * the page the data ends in is mapped by mmap() (then nothing is copied, and
+ * the append has to go to a new blob), or -EFAULT.  Called with the device's
+ * mutex held.
+ *
+ * mmap() only maps the pages a blob's data is in, so of the pages the new
+ * data goes in, only the one the old data ends in (all of junk, for data in
+ * one piece) can be mapped before the size is moved up over it.  Whether it
+ * is and the copy into it are done under the device's map_mutex, which
+ * mmap() holds while it maps a blob, so it can't get mapped in between.
+ * mmap() is called with mmap_sem held, and copying from the user can take
+ * mmap_sem, so that copy is done with page faults off (after faulting in the
+ * user's data first, and over again if it went away in between).  The rest
+ * of the data goes in pages nobody can map yet, so it's copied the usual way.
+ */
+static int sstore_append_fill(struct sstore * device, struct blob * blob,
+                                    int size, const char __user * data) {
+    unsigned int head = size;   //bytes going in the page the data ends in
+    unsigned int length = 0;
+    unsigned long left = 0;     //bytes that didn't get copied
+    char * to;                  //where they go
+    int error = 0;
+
+    if (blob->chunks)
+        head = min(head, (unsigned int) PAGE_ALIGN(blob->size) - blob->size);
+
+    while (head) {
+        if (sstore_prefault(data, head))
+            return -EFAULT;
+        //acquire map lock
+        down(&device->map_mutex);
+        if (sstore_blob_mapped(blob, blob->size))
+            error = 1;
+        else {
+            to = sstore_blob_data(blob, blob->size, blob->size + head,
+                                                                    &length);
+            pagefault_disable();
+            left = __copy_from_user_inatomic(to, data, head);
+            pagefault_enable();
+            if (!left && head == size)
+                sstore_blob_clear_tail(blob, blob->size + size);
+        }
+        //release map lock
+        up(&device->map_mutex);
+        if (error || !left)
+            break;
+    }
+
+    if (error || head == size)
+        return error;
+    return sstore_blob_fill(blob, blob->size + head, size - head, data + head);
+}
+
+/*
+ * delete the blob at index, moving every blob after it down by one index
+ * (unless device->renumber is off, then it just punches a hole there, see
+ * sstore_do_punch()).  That's O(n) in the blobs after it.
+ * When a blob does not exist at the valid index passed in by the user, -EINVAL
+ * is returned.  It would be nice to have a -ENOBLOB error defined, but oh well.
+ */
+int sstore_do_delete(struct sstore * device, unsigned long index) {
+    struct blob * current_blob;     //the blob being deleted
+    int error = 0;                  //used for detecting error return values
+    ktime_t start = ktime_get();
+
+    //return no blob error if the index is past the last blob
+    if (index > max_blobs || index <= 0 || index > device->blob_count)
+        return -EINVAL;
+    if (!device->renumber)
+        return sstore_do_punch(device, index, index + 1);
+
+    /*
+     * take the blob out of the index and drop its reference.  There may not
+     * be one there if the index was never written to, but it still counts as
+     * a blob (see blob_count in sstore_core.h), so it's still deleted.
+     * Snapshots keep it first (see SNAPSHOTS).
+     */
+    error = sstore_snapshot_keep(device, index);
+    if (error)
+        return error;
+    current_blob = sstore_index->erase(device, index);
+    if (current_blob) {
+        sstore_uncharge(device, current_blob);
+        sstore_blob_put(current_blob);
+    }
+
+    //update the index numbers of the remaining blobs in the index
+    error = sstore_collapse(device, index);
+    if (error)
+        return error;
+
+    //update the blob count
+    --device->blob_count;
+
+    sstore_stat_time(device, SSTORE_OP_DELETE, start);
+    return 0;
+}
+
+/*
+ * delete the blobs at indices first up to (but not including) last, and leave
+ * the indices empty instead of moving the blobs after them down.  That makes
+ * it O(1) for one index (O(log n) with the "radix" backend), and in general
+ * takes time for the indices in the range and nothing else.  Indices past the
+ * last blob are left alone, so if the range covers the end, blob_count ends up
+ * right before it.  Returns 0, or -EINVAL for a bad range (or -ENOMEM if a
+ * snapshot couldn't keep a blob, see SNAPSHOTS, which stops it there).
+ */
+int sstore_do_punch(struct sstore * device, unsigned long first,
+                                                        unsigned long last) {
+    struct blob * current_blob;     //the blob being deleted
+    unsigned long index = 0;
+    int error = 0;
+    ktime_t start = ktime_get();
+
+    if (first <= 0 || last <= first || last > (unsigned long) max_blobs + 1)
+        return -EINVAL;
+
+    for (index = first; index < last && index <= device->blob_count; ++index) {
+        //(empty indices don't change, so snapshots don't need them kept)
+        if (sstore_index->lookup(device, index))
+            error = sstore_snapshot_keep(device, index);
+        if (error)
+            return error;
+        current_blob = sstore_index->erase(device, index);
+        if (current_blob) {
+            sstore_uncharge(device, current_blob);
+            sstore_blob_put(current_blob);
+        }
+        //a big range can take a while, and we're allowed to sleep
+        if (!(index % 1024))
+            cond_resched();
+    }
+    if (first <= device->blob_count && last > device->blob_count)
+        device->blob_count = first - 1;
+
+    sstore_stat_time(device, SSTORE_OP_DELETE, start);
+    return 0;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * EVICTION.  A device with a budget (device->budget bytes of blob data, from
+ * the max_bytes parameter) makes room for each write that would go over it by
+ * evicting blobs, the way a cache would, instead of failing the write.  Which
+ * blobs go is picked by the CLOCK algorithm, which is close to evicting the
+ * least recently used one without keeping a list in order of use (that would
+ * mean every read taking a lock to move its blob to the front).  Each blob
+ * just has a referenced bit, set whenever it's read or written.  The clock
+ * hand goes around the indices, clearing the bits it finds set, and evicts
+ * the first blob it comes to whose bit is already clear, which is a blob
+ * nobody has used since the hand last went by.
+ *
+ * Evicting a blob just punches its index (see sstore_do_punch()), so no other
+ * blob is renumbered.  Blobs under keys count against the budget but aren't
+ * evicted: a key only goes away when it's deleted.  So a write that can't be
+ * made room for, because it's bigger than the budget or the rest is all keys,
+ * fails with -ENOSPC.
+ *
+ * Shared data (see SHARING) only counts once, however many blobs share it, so
+ * evicting a blob whose data is shared only frees anything if it's the last
+ * blob sharing it.  And a blob a snapshot keeps (see SNAPSHOTS) stops counting
+ * once it's evicted, but isn't freed until the snapshot is dropped.
+ */
+
+/*
+ * how many bytes of data a blob holding size bytes has room for: its size
+ * class (with room for the '\0'), a page, or a page for each chunk (see
+ * sstore_blob_make()).
+ */
+static unsigned int sstore_blob_room(unsigned int size) {
+    if (size + 1 <= PAGE_SIZE / 2)
+        return max((unsigned int) roundup_pow_of_two(size + 1),
+                                            1U << SSTORE_MIN_CLASS_SHIFT);
+    if (size < PAGE_SIZE)
+        return PAGE_SIZE;
+    return PAGE_ALIGN(size);
+}
+
+/*
+ * how many more bytes of data the device will have once size bytes are
+ * written in blob (or in a blob made for them, if it's NULL).  Shared data is
+ * counted when it's shared (see sstore_blob_share()), so that's none.
+ */
+static unsigned long sstore_blob_need(struct blob * blob, int size) {
+    if (!blob)
+        return sstore_blob_room(size);
+    return blob->shared ? 0 : blob->capacity;
+}
+
+/*
+ * how many bytes of data the device will have fewer of once blob is out of
+ * the index (or from under its key).  Called with the device's mutex held.
+ */
+static unsigned long sstore_blob_bytes(struct sstore * device,
+                                                        struct blob * blob) {
+    if (blob->shared && (*sstore_share_slot(device, blob))->users > 1)
+        return 0;
+    return blob->capacity;
+}
+
+/*
+ * count a blob that just went into the index (or under a key) against the
+ * budget, and stop counting one that just came out.  Called with the
+ * device's mutex held.
+ */
+static void sstore_charge(struct sstore * device, struct blob * blob) {
+    if (!blob->shared)
+        device->bytes += blob->capacity;
+}
+
+static void sstore_uncharge(struct sstore * device, struct blob * blob) {
+    if (blob->shared)
+        sstore_unshare(device, blob);
+    else
+        device->bytes -= blob->capacity;
+}
+
+/*
+ * move the clock hand on to the next blob nobody has used since it last went
+ * by (leaving the blob at index skip alone), and evict it.  Returns 1, or 0 if
+ * there's nothing left to evict.  Called with the device's mutex held.
+ */
+static int sstore_evict_one(struct sstore * device, unsigned int skip) {
+    struct blob * blob;
+    unsigned int index = device->clock_hand;
+    int laps = 0;               //times the hand has gone back to the start
+
+    /*
+     * the first lap may start part of the way around, the next one clears
+     * whatever bits are left, and by the one after that, anything there is
+     * to evict has been found
+     */
+    while (laps < 3) {
+        blob = sstore_index->next(device, &index);
+        if (!blob) {
+            ++laps;
+            index = 1;
+            continue;
+        }
+        if (index != skip && !blob->referenced)
+            break;
+        if (index != skip)
+            blob->referenced = 0;
+        ++index;
+    }
+    if (laps == 3)
+        return 0;
+    //(a snapshot that can't keep the blob would lose it, so it stays)
+    if (sstore_snapshot_keep(device, index))
+        return 0;
+
+    sstore_index->erase(device, index);
+    sstore_uncharge(device, blob);
+    sstore_blob_put(blob);
+    device->clock_hand = index + 1;
+    return 1;
+}
+
+/*
+ * evict blobs until the device has room in its budget for need more bytes of
+ * data, after freed bytes of it are freed (the data the write replaces).  The
+ * blob at index (the one being written) is never evicted.  Returns 0, or
+ * -ENOSPC if evicting everything there is to evict still isn't enough.
+ * Called with the device's mutex held.
+ */
+static int sstore_make_room(struct sstore * device, unsigned int index,
+                                    unsigned long need, unsigned long freed) {
+    if (!device->budget || device->bytes - freed + need <= device->budget)
+        return 0;
+    if (need > device->budget)
+        return -ENOSPC;
+
+    while (device->bytes - freed + need > device->budget) {
+        if (!sstore_evict_one(device, index))
+            return -ENOSPC;
+        sstore_stat_add(device, SSTORE_EVICTIONS, 1);
+    }
+    return 0;
+}
+
+/*
+ * evict blobs nobody has used lately until bytes bytes of data have been
+ * freed (or there's nothing left to evict), for the kernel when it's short on
+ * memory (see the shrinker in sstore_main.c).  Returns the bytes freed.
+ * Called with the device's mutex held.
+ */
+unsigned long sstore_evict(struct sstore * device, unsigned long bytes) {
+    unsigned long before = device->bytes;
+
+    while (before - device->bytes < bytes && sstore_evict_one(device, 0))
+        sstore_stat_add(device, SSTORE_RECLAIMS, 1);
+    return before - device->bytes;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * COMPRESSION.  A device can keep the data of blobs of compress_min up to
+ * SSTORE_COMPRESS_MAX bytes compressed with LZO (lib/lzo), which is fast
+ * enough to run on every write and read, and which shrinks text and JSON to
+ * a half or a third of their size or better.  It's decided write by write:
+ * data that doesn't come out at least an eighth smaller is stored as it is,
+ * since decompressing it on every read would buy next to nothing.  The
+ * compressed bytes (blob->stored of them) are kept in junk or chunks like any
+ * other data, and blob->size is still the size of the data, so only the code
+ * that copies data out of blobs has to know.
+ *
+ * A write compresses with the device's own buffers, which it can since it
+ * has the mutex, after copying the user's data in (which can sleep).  Reads
+ * don't take the mutex, so every CPU has buffers of its own to decompress
+ * into instead (sstore_scratch), used with preemption off (get_cpu()) so that
+ * nothing else on the CPU uses them at the same time.  That means the copy to
+ * the user can't sleep either: the user's buffer is faulted in first and the
+ * copy is done with page faults off, like the copy from the user in
+ * sstore_overwrite(), and if the buffer went away in between, it's all done
+ * over.  A read of part of a blob decompresses all of it (LZO can't start in
+ * the middle), which is why only blobs of up to SSTORE_COMPRESS_MAX are
+ * compressed: that bounds how long preemption is off for, at about what
+ * copying that much takes.
+ *
+ * Compressed blobs are never overwritten in place, and appending to one
+ * decompresses it into a new blob.  mmap() and the /proc files, which look at
+ * blobs' data where it is, get a decompressed copy from sstore_blob_expand().
+ */
+
+/*
+ * compress writes of threshold bytes or more from now on (0 turns it off).
+ * Blobs already written are left the way they are.  Returns 0 or -ENOMEM.
+ * Called with the device's mutex held (or before anyone can use it).
+ */
+int sstore_set_compression(struct sstore * device, unsigned int threshold) {
+    int error = 0;
+
+    if (threshold && !device->compress_work) {
+        error = sstore_scratch_alloc();
+        if (error)
+            return error;
+        device->compress_in = vmalloc(SSTORE_COMPRESS_MAX);
+        device->compress_out =
+                            vmalloc(lzo1x_worst_compress(SSTORE_COMPRESS_MAX));
+        device->compress_work = vmalloc(LZO1X_1_MEM_COMPRESS);
+        if (!device->compress_in || !device->compress_out ||
+                                                    !device->compress_work) {
+            sstore_compress_free(device);
+            return -ENOMEM;
+        }
+    }
+    device->compress_min = threshold;
+    return 0;
+}
+
+//free a device's buffers for compressing (which turns compression off)
+static void sstore_compress_free(struct sstore * device) {
+    vfree(device->compress_in);
+    vfree(device->compress_out);
+    vfree(device->compress_work);
+    device->compress_in = NULL;
+    device->compress_out = NULL;
+    device->compress_work = NULL;
+    device->compress_min = 0;
+}
+
+/*
+ * give every CPU its buffers for decompressing, if they don't have them yet.
+ * Returns 0, -ENOMEM or -ERESTARTSYS.
+ */
+static int sstore_scratch_alloc(void) {
+    struct sstore_scratch * scratch = NULL;
+    struct sstore_scratch * buffers;    //one CPU's
+    int error = 0;
+    int cpu = 0;
+
+    if (down_interruptible(&sstore_scratch_lock))
+        return -ERESTARTSYS;
+    if (!sstore_scratch) {
+        scratch = alloc_percpu(struct sstore_scratch);
+        if (!scratch)
+            error = -ENOMEM;
+        for_each_possible_cpu(cpu) {
+            if (error)
+                break;
+            buffers = per_cpu_ptr(scratch, cpu);
+            buffers->packed = vmalloc(SSTORE_COMPRESS_MAX);
+            buffers->data = vmalloc(SSTORE_COMPRESS_MAX);
+            if (!buffers->packed || !buffers->data)
+                error = -ENOMEM;
+        }
+        if (error)
+            sstore_scratch_free(scratch);
+        else
+            sstore_scratch = scratch;
+    }
+    up(&sstore_scratch_lock);
+
+    return error;
+}
+
+static void sstore_scratch_free(struct sstore_scratch * scratch) {
+    int cpu = 0;
+
+    if (!scratch)
+        return;
+    for_each_possible_cpu(cpu) {
+        vfree(per_cpu_ptr(scratch, cpu)->packed);
+        vfree(per_cpu_ptr(scratch, cpu)->data);
+    }
+    free_percpu(scratch);
+}
+
+/*
+ * make a blob holding size bytes of the user's data compressed, with one
+ * reference and the device's next version, in *new_blob.  *new_blob is left
+ * NULL if the device doesn't compress data of this size, or if it doesn't
+ * compress well enough (see above): the data is written the usual way then.
+ * Returns 0 or a negative errno.  Called with the device's mutex held.
+ */
+static int sstore_blob_compress(struct sstore * device, int size,
+                        const char __user * data, struct blob ** new_blob) {
+    struct blob * blob;
+    size_t packed = 0;          //bytes it compressed to
+    ktime_t start;
+    int error = 0;
+
+    *new_blob = NULL;
+    if (!device->compress_min || size < device->compress_min ||
+                                                size > SSTORE_COMPRESS_MAX)
+        return 0;
+    if (copy_from_user(device->compress_in, data, size))
+        return -EFAULT;
+
+    start = ktime_get();
+    error = lzo1x_1_compress(device->compress_in, size, device->compress_out,
+                                &packed, device->compress_work);
+    //the time's counted even when it's thrown away
+    sstore_stat_time(device, SSTORE_OP_PACK, start);
+    if (error != LZO_E_OK || packed > size - size / 8) {
+        sstore_stat_add(device, SSTORE_INCOMPRESSIBLE, 1);
+        return 0;
+    }
+
+    blob = sstore_blob_make(packed);
+    if (!blob)
+        return -ENOMEM;
+    sstore_blob_copy_in(blob, 0, packed, (char *) device->compress_out);
+    blob->stored = packed;
+    blob->size = size;
+    blob->version = ++device->version;
+    sstore_stat_add(device, SSTORE_PACKED_IN, size);
+    sstore_stat_add(device, SSTORE_PACKED_OUT, packed);
+
+    *new_blob = blob;
+    return 0;
+}
+
+/*
+ * decompress a compressed blob's data into the buffers of cpu, and point
+ * *data at it.  Called with preemption off (from get_cpu()) on that CPU.
+ * Returns 0, or -EIO if the data doesn't decompress to what it should.
+ */
+static int sstore_blob_unpack(struct blob * blob, int cpu, char ** data) {
+    struct sstore_scratch * scratch = per_cpu_ptr(sstore_scratch, cpu);
+    char * packed = blob->junk;     //the compressed data, in one piece
+    size_t size = SSTORE_COMPRESS_MAX;
+    unsigned int offset = 0;
+    unsigned int length = 0;
+    char * from;
+
+    //chunks have to be put back together first
+    if (!packed) {
+        for (offset = 0; offset < blob->stored; offset += length) {
+            from = sstore_blob_data(blob, offset, blob->stored, &length);
+            memcpy(scratch->packed + offset, from, length);
+        }
+        packed = scratch->packed;
+    }
+    if (lzo1x_decompress_safe((unsigned char *) packed, blob->stored,
+                    (unsigned char *) scratch->data, &size) != LZO_E_OK ||
+                                                        size != blob->size)
+        return -EIO;
+
+    *data = scratch->data;
+    return 0;
+}
+
+/*
+ * decompress a compressed blob's data into another blob, which has to have
+ * room for it.  Returns 0 or -EIO.
+ */
+static int sstore_blob_unpack_into(struct blob * blob, struct blob * to) {
+    char * data;
+    int error = 0;
+
+    error = sstore_blob_unpack(blob, get_cpu(), &data);
+    if (!error)
+        sstore_blob_copy_in(to, 0, blob->size, data);
+    put_cpu();
+
+    return error;
+}
+
+/*
+ * copy size bytes of a compressed blob's data, from offset on, to the user
+ * (see above for why it's done this way).  Returns 0, -EFAULT or -EIO.
+ */
+static int sstore_unpack_out(struct sstore * device, struct blob * blob,
+                            int offset, int size, char __user * data) {
+    unsigned long left = 0;     //bytes that didn't get copied
+    ktime_t start;
+    char * from;
+    int error = 0;
+
+    if (!size)
+        return 0;
+    do {
+        error = sstore_prefault_out(data, size);
+        if (error)
+            return error;
+        start = ktime_get();
+        error = sstore_blob_unpack(blob, get_cpu(), &from);
+        if (!error) {
+            sstore_stat_time(device, SSTORE_OP_UNPACK, start);
+            pagefault_disable();
+            left = __copy_to_user_inatomic(data, from + offset, size);
+            pagefault_enable();
+        }
+        put_cpu();
+    } while (!error && left);
+
+    return error;
+}
+
+/*
+ * fault in every page of a user buffer that's about to be written to, so that
+ * the copy won't fault (see sstore_prefault()).  Each page has a byte read
+ * and written back as it was, so the buffer is left the way it was if the
+ * copy is never made (the data turns out to be corrupt, say).  Returns 0, or
+ * -EFAULT if the buffer isn't all there.
+ */
+static int sstore_prefault_out(char __user * data, int size) {
+    char __user * end = data + size - 1;
+    char c;
+
+    for (; data <= end; data += PAGE_SIZE) {
+        if (get_user(c, data) || put_user(c, data))
+            return -EFAULT;
+    }
+    //the loop can step over the start of the last page
+    if (get_user(c, end) || put_user(c, end))
+        return -EFAULT;
+
+    return 0;
+}
+
+/*
+ * a blob holding blob's data decompressed, for looking at the data where it
+ * is (with sstore_blob_data()).  It takes over the caller's reference to blob
+ * and has one of its own, and isn't in any index.  A blob that isn't
+ * compressed is just handed back.  Returns NULL if there's no memory for it
+ * (or the data is corrupt).
+ */
+struct blob * sstore_blob_expand(struct blob * blob) {
+    struct blob * expanded;
+
+    if (!blob->stored)
+        return blob;
+
+    expanded = sstore_blob_make(blob->size);
+    if (expanded && sstore_blob_unpack_into(blob, expanded)) {
+        sstore_blob_free(expanded);
+        expanded = NULL;
+    }
+    if (expanded) {
+        expanded->index = blob->index;
+        expanded->version = blob->version;
+        expanded->size = blob->size;
+    }
+    sstore_blob_put(blob);
+
+    return expanded;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * SHARING.  On a device with a shares table (the dedup parameter), every
+ * write (or keyed write) hashes the data it's about to store, and if a blob
+ * with the same data is already there, the new blob shares that data instead
+ * of keeping a copy of its own.  That's for stores where lots of indices hold
+ * the same bytes (default configs, the same response over and over), which
+ * then only take the memory for it once.
+ *
+ * The data itself is moved to a blob of its own that isn't in the index (the
+ * struct sstore_share's blob), and every blob sharing it points its junk or
+ * chunks at that blob's and has a reference to it (blob->shared).  So reading
+ * a blob doesn't care whether its data is shared, and shared data is freed
+ * with the last blob that had it, after the readers of that one are done.
+ * The share itself counts the blobs in the index, and under keys, that share
+ * it (users, with the mutex held), and goes away when there are none left.
+ * Shared data is never changed: overwriting a blob that shares its data puts
+ * a new blob there, and appending to one copies the data first.
+ *
+ * The data is hashed and compared as it's stored, so compressed data is
+ * shared with the blobs it compresses the same for, which is all of the ones
+ * with the same data.  It counts against the budget (see EVICTION) once, from
+ * when the first blob with it is written until the last one is gone.
+ */
+#define SSTORE_SHARE_BUCKETS (1 << 16)    //the most a shares table has
+
+//make a device's shares table, with a bucket for each of max_blobs (or so)
+static int sstore_shares_init(struct sstore * device) {
+    unsigned int buckets = min(max_blobs, (unsigned int) SSTORE_SHARE_BUCKETS);
+    size_t size = 0;
+
+    buckets = roundup_pow_of_two(max(buckets, 16U));
+    size = buckets * sizeof (struct sstore_share *);
+
+    if (size > PAGE_SIZE)
+        device->shares = vmalloc(size);
+    else
+        device->shares = kmalloc(size, GFP_KERNEL);
+    if (!device->shares)
+        return -ENOMEM;
+    memset(device->shares, 0, size);
+    device->share_mask = buckets - 1;
+    return 0;
+}
+
+/*
+ * empty a device's shares table.  Blobs still sharing data keep it until
+ * they're freed, but their shares are gone, so this is only for when they're
+ * out of the index and keys already (see sstore_device_clear()).
+ */
+static void sstore_shares_clear(struct sstore * device) {
+    struct sstore_share * share;
+    struct sstore_share * next;
+    unsigned int i = 0;
+
+    if (!device->shares)
+        return;
+    for (i = 0; i <= device->share_mask; ++i) {
+        for (share = device->shares[i]; share; share = next) {
+            next = share->next;
+            sstore_shared_put(share->blob);
+            kfree(share);
+        }
+        device->shares[i] = NULL;
+    }
+    device->share_count = 0;
+    device->shared_bytes = 0;
+}
+
+//empty and free a device's shares table
+static void sstore_shares_free(struct sstore * device) {
+    sstore_shares_clear(device);
+    if ((device->share_mask + 1) * sizeof (struct sstore_share *) > PAGE_SIZE)
+        vfree(device->shares);
+    else
+        kfree(device->shares);
+    device->shares = NULL;
+}
+
+//hash the data a blob has stored (compressed, if it is), a chunk at a time
+static u32 sstore_blob_hash(struct blob * blob) {
+    unsigned int end = blob->stored ? blob->stored : blob->size;
+    unsigned int offset = 0;
+    unsigned int length = 0;
+    char * data;
+    u32 hash = blob->size;
+
+    for (offset = 0; offset < end; offset += length) {
+        data = sstore_blob_data(blob, offset, end, &length);
+        hash = jhash(data, length, hash);
+    }
+    return hash;
+}
+
+/*
+ * whether two blobs hold the same data.  Blobs holding as many bytes have
+ * room for as many, so their chunks line up.
+ */
+static int sstore_blob_same(struct blob * blob, struct blob * other) {
+    unsigned int end = blob->stored ? blob->stored : blob->size;
+    unsigned int offset = 0;
+    unsigned int length = 0;
+    char * data;
+    char * other_data;
+
+    if (blob->size != other->size || blob->stored != other->stored)
+        return 0;
+    for (offset = 0; offset < end; offset += length) {
+        data = sstore_blob_data(blob, offset, end, &length);
+        other_data = sstore_blob_data(other, offset, end, &length);
+        if (memcmp(data, other_data, length))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * have a blob about to be written share its data with the blobs that already
+ * have the same, or start a share of it for blobs written later to use.  If
+ * *new_blob is NULL (the data wasn't compressed), it's made from the user's
+ * data first.  The data counts against the budget from here on, the first
+ * time it's written (so the blob has to go in the index, or under a key, or
+ * be let go with sstore_blob_discard()).  Does nothing on a device without a
+ * shares table, and if there's no memory to start a share, the blob just
+ * keeps its data.  Returns 0 or a negative errno.  Called with the device's
+ * mutex held.
+ */
+static int sstore_blob_share(struct sstore * device, int size,
+                        const char __user * data, struct blob ** new_blob) {
+    struct sstore_share ** bucket;
+    struct sstore_share * share;
+    struct blob * blob;
+    struct blob * shared;       //the blob the data is moved to
+    u32 hash = 0;
+    int error = 0;
+
+    if (!device->shares)
+        return 0;
+    if (!*new_blob) {
+        error = sstore_blob_new(device, size, data, new_blob);
+        if (error)
+            return error;
+    }
+    blob = *new_blob;
+    hash = sstore_blob_hash(blob);
+    bucket = &device->shares[hash & device->share_mask];
+
+    for (share = *bucket; share; share = share->next) {
+        if (share->hash == hash && sstore_blob_same(share->blob, blob))
+            break;
+    }
+    if (share) {
+        //it's already here, so the copy that was just made isn't needed
+        sstore_blob_free_data(blob);
+        ++share->users;
+        device->shared_bytes += share->blob->capacity;
+        sstore_stat_add(device, SSTORE_SHARE_HITS, 1);
+    } else {
+        share = kmalloc(sizeof (struct sstore_share), GFP_KERNEL);
+        shared = share ? sstore_blob_alloc() : NULL;
+        if (!shared) {
+            kfree(share);
+            return 0;
+        }
+        atomic_long_inc(&sstore_allocs.general);
+        //the data moves to a blob of its own, with the share's reference
+        *shared = *blob;
+        atomic_set(&shared->refs, 1);
+        share->blob = shared;
+        share->hash = hash;
+        share->users = 1;
+        share->next = *bucket;
+        *bucket = share;
+        ++device->share_count;
+        device->bytes += shared->capacity;
+        sstore_stat_add(device, SSTORE_SHARE_MISSES, 1);
+    }
+
+    blob->junk = share->blob->junk;
+    blob->chunks = share->blob->chunks;
+    blob->capacity = share->blob->capacity;
+    blob->shared = share->blob;
+    blob->hash = hash;
+    atomic_inc(&share->blob->refs);
+    return 0;
+}
+
+//where the share of a blob sharing its data is in the shares table
+static struct sstore_share ** sstore_share_slot(struct sstore * device,
+                                                        struct blob * blob) {
+    struct sstore_share ** slot;
+
+    slot = &device->shares[blob->hash & device->share_mask];
+    while ((*slot)->blob != blob->shared)
+        slot = &(*slot)->next;
+    return slot;
+}
+
+/*
+ * stop counting a blob as sharing its data, because it's out of the index (or
+ * from under its key), or never got there.  The last one takes the share out
+ * of the table, and the data stops counting against the budget (it's freed
+ * once the blobs that had it are, see sstore_blob_free_data()).  Called with
+ * the device's mutex held.
+ */
+static void sstore_unshare(struct sstore * device, struct blob * blob) {
+    struct sstore_share ** slot = sstore_share_slot(device, blob);
+    struct sstore_share * share = *slot;
+
+    if (--share->users) {
+        device->shared_bytes -= share->blob->capacity;
+        return;
+    }
+    *slot = share->next;
+    --device->share_count;
+    device->bytes -= share->blob->capacity;
+    sstore_shared_put(share->blob);
+    kfree(share);
+}
+
+/*
+ * drop a reference to shared data.  The last one frees it right away: the
+ * data's blob is never in the index, so no reader can get at it but through
+ * a blob sharing it, and those are all gone.
+ */
+static void sstore_shared_put(struct blob * shared) {
+    if (atomic_dec_and_test(&shared->refs))
+        sstore_blob_free(shared);
+}
+
+/*
+ * free a blob that was made to be written, but isn't going to be after all
+ * (it never got into the index, or under a key).  Called with the device's
+ * mutex held.
+ */
+static void sstore_blob_discard(struct sstore * device, struct blob * blob) {
+    if (blob->shared)
+        sstore_unshare(device, blob);
+    sstore_blob_free(blob);
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * VERSIONS.  Every write or append gives the data it writes the next version
+ * of the device (device->version, counted up with the mutex held), whether it
+ * goes into a new blob or an old one.  So a blob's version changes whenever
+ * its data does, and never comes back, even if the index is deleted and
+ * written again, or the device is cleared.  0 is never a version, so it stands
+ * for "no blob".
+ */
+
+/*
+ * write size bytes of the user's data at index like sstore_do_write(), but
+ * only if the blob there is still at *version (0 if there should be no blob
+ * there yet).  Returns the bytes written and sets *version to the new data's
+ * version, or returns -ESTALE and sets *version to the version that is there.
+ * Called with the device's mutex held.
+ */
+ssize_t sstore_do_write_if(struct sstore * device, int index, int size,
+                                const char __user * data, u64 * version) {
+    struct blob * blob;         //the blob at the index now
+    u64 current_version = 0;
+    ssize_t bytes_written = 0;
+
+    if (index > max_blobs || index <= 0)
+        return -EINVAL;
+
+    //writes only happen with the mutex held, so it can't change after this
+    blob = sstore_index->lookup(device, index);
+    if (blob)
+        current_version = blob->version;
+    if (current_version != *version) {
+        *version = current_version;
+        sstore_stat_add(device, SSTORE_CONFLICTS, 1);
+        return -ESTALE;
+    }
+
+    bytes_written = sstore_do_write(device, index, size, data);
+    if (bytes_written >= 0)
+        *version = device->version;
+    return bytes_written;
+}
+
+/*
+ * read up to size bytes of the blob at index, but only if its version isn't
+ * *version already (so the caller already has that data).  Returns 0 if it
+ * is, or the bytes read, with *version set to the version read.  It never
+ * waits: -ENODATA means there's no blob at the index.
+ */
+ssize_t sstore_do_read_if(struct sstore * device, int index, int size,
+                                        char __user * data, u64 * version) {
+    struct blob * blob;         //the blob at the requested index
+    u64 blob_version = 0;       //its version when we looked
+    ktime_t start = ktime_get();
+
+    if (index > max_blobs || index <= 0 || size < 0)
+        return -EINVAL;
+
+    blob = sstore_blob_get(device, index);
+    if (!blob)
+        return -ENODATA;
+
+    /*
+     * an append can change the version while we hold a reference to the
+     * blob, but it moves the size up first, so whatever we copy is at least
+     * all of the data of the version we read.
+     */
+    blob_version = ACCESS_ONCE(blob->version);
+    smp_rmb();
+    if (blob_version == *version) {
+        sstore_blob_put(blob);
+        sstore_stat_add(device, SSTORE_UNCHANGED, 1);
+        return 0;
+    }
+    *version = blob_version;
+    return sstore_copy_out(device, blob, 0, size, data, start);
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * SNAPSHOTS.  A snapshot is a view of a device's indices as they were when it
+ * was taken, which can be read while writers go on changing the device, so a
+ * scan of a lot of blobs sees all of them as of one moment without holding
+ * the mutex (and every writer) up for the whole scan.
+ *
+ * Taking one copies nothing, it just notes the device's version: a blob in
+ * the index whose version is no newer was there when the snapshot was taken.
+ * What's copied is only what changes.  Before anything is done to an index
+ * (a write, append, delete, eviction, or a blob being moved into or out of
+ * it), sstore_snapshot_keep() has each snapshot that doesn't have the index
+ * kept yet keep what it has now: the blob, with a reference, or NULL if it's
+ * empty.  That's the blob the snapshot saw, since the index hasn't changed
+ * since.  Holding the reference is enough to keep the blob as it is, since
+ * blobs with more than one aren't overwritten in place, and appends don't go
+ * into a blob a snapshot has (see sstore_snapshot_has()), they copy it.  A
+ * blob nothing changes is never copied, so a snapshot costs the blobs that
+ * were written over (or deleted) while it was around, and nothing else.
+ *
+ * Reading index i of a snapshot is then its kept blob, if it kept the index,
+ * or else the blob in the index, if that's no newer than the snapshot (a newer
+ * one was written after it, over an index that was kept as empty).  Readers
+ * don't take the mutex, so the index is looked at first, and the kept tree
+ * second: a writer keeps the old blob before changing the index, so if the
+ * reader saw a changed index, it finds the kept blob there too.
+ *
+ * Keys aren't in snapshots, just indices.
+ */
+
+/*
+ * take a snapshot of the device's indices.  Returns it, or NULL if there's no
+ * memory for it.  Called with the device's mutex held.
+ */
+struct sstore_snapshot * sstore_snapshot_take(struct sstore * device) {
+    struct sstore_snapshot * snapshot;
+
+    snapshot = kmalloc(sizeof (struct sstore_snapshot), GFP_KERNEL);
+    if (!snapshot)
+        return NULL;
+    atomic_long_inc(&sstore_allocs.general);
+    snapshot->version = device->version;
+    INIT_RADIX_TREE(&snapshot->kept, GFP_KERNEL);
+    snapshot->kept_list = NULL;
+
+    snapshot->next = device->snapshots;
+    device->snapshots = snapshot;
+    ++device->snapshot_count;
+    return snapshot;
+}
+
+/*
+ * drop a snapshot of the device, and the references to the blobs it kept.
+ * Nobody can be reading it anymore.  Called with the device's mutex held.
+ */
+void sstore_snapshot_drop(struct sstore * device,
+                                    struct sstore_snapshot * snapshot) {
+    struct sstore_snapshot ** link = &device->snapshots;
+    struct sstore_kept * kept;
+
+    while (*link != snapshot)
+        link = &(*link)->next;
+    *link = snapshot->next;
+    --device->snapshot_count;
+
+    while ((kept = snapshot->kept_list)) {
+        snapshot->kept_list = kept->next;
+        radix_tree_delete(&snapshot->kept, kept->index);
+        if (kept->blob)
+            sstore_blob_put(kept->blob);
+        kfree(kept);
+        --device->kept_count;
+    }
+    kfree(snapshot);
+}
+
+/*
+ * have every snapshot of the device that hasn't kept index yet keep what's
+ * there now, before it changes.  Returns 0, or -ENOMEM (then some snapshots
+ * may have kept it, which does no harm, but the index mustn't be changed).
+ * Called with the device's mutex held.
+ */
+static int sstore_snapshot_keep(struct sstore * device, unsigned int index) {
+    struct sstore_snapshot * snapshot;
+    struct sstore_kept * kept;
+    struct blob * blob;
+    int error = 0;
+
+    if (!device->snapshots)
+        return 0;
+
+    blob = sstore_index->lookup(device, index);
+    for (snapshot = device->snapshots; snapshot; snapshot = snapshot->next) {
+        //written since the snapshot, so it already kept what was there
+        if (blob && blob->version > snapshot->version)
+            continue;
+        if (radix_tree_lookup(&snapshot->kept, index))
+            continue;
+
+        kept = kmalloc(sizeof (struct sstore_kept), GFP_KERNEL);
+        if (!kept)
+            return -ENOMEM;
+        kept->index = index;
+        kept->blob = blob;
+        error = radix_tree_preload(GFP_KERNEL);
+        if (!error) {
+            error = radix_tree_insert(&snapshot->kept, index, kept);
+            radix_tree_preload_end();
+        }
+        if (error) {
+            kfree(kept);
+            return error;
+        }
+        atomic_long_inc(&sstore_allocs.general);
+        if (blob)
+            atomic_inc(&blob->refs);
+        kept->next = snapshot->kept_list;
+        snapshot->kept_list = kept;
+        ++device->kept_count;
+    }
+
+    //what's kept has to be there before readers can see the index change
+    smp_wmb();
+    return 0;
+}
+
+/*
+ * whether any snapshot of the device may have blob, which is in the index.
+ * It may if it's no newer than the newest snapshot.  Called with the device's
+ * mutex held.
+ */
+static int sstore_snapshot_has(struct sstore * device, struct blob * blob) {
+    return device->snapshots && blob->version <= device->snapshots->version;
+}
+
+/*
+ * copy up to size bytes of the blob snapshot has at index, starting offset
+ * bytes into it, to the user's data buffer, like sstore_do_read().  Returns
+ * the number of bytes copied, or -ENODATA if the index was empty when the
+ * snapshot was taken (there's no waiting for a blob, since the snapshot is
+ * never going to get one).  Doesn't need the device's mutex.
+ */
+ssize_t sstore_snapshot_read(struct sstore * device,
+                struct sstore_snapshot * snapshot, int index, int offset,
+                                            int size, char __user * data) {
+    struct blob * blob;         //the blob in the index now
+    struct sstore_kept * kept;  //what the snapshot kept of the index, if any
+    ktime_t start = ktime_get();
+
+    if (index > max_blobs || index <= 0 || offset < 0 || size < 0)
+        return -EINVAL;
+
+    rcu_read_lock();
+    blob = sstore_index->lookup(device, index);
+    //the index before the kept tree (see above)
+    smp_rmb();
+    kept = radix_tree_lookup(&snapshot->kept, index);
+    if (kept)
+        blob = kept->blob;
+    else if (blob && blob->version > snapshot->version)
+        blob = NULL;
+    /*
+     * the snapshot's blob can't be down to no references: if it's still in
+     * the index, it's the index's, and if it isn't, the snapshot has one
+     */
+    if (blob && !atomic_inc_not_zero(&blob->refs))
+        blob = NULL;
+    rcu_read_unlock();
+    if (!blob)
+        return -ENODATA;
+
+    return sstore_copy_out(device, blob, offset, size, data, start);
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * KEYS.  Besides its indices, a device can hold blobs under keys: any 1 up to
+ * SSTORE_KEY_MAX bytes.  They're kept in a chained hash table of their own
+ * (struct sstore_key_table), made with SSTORE_KEY_BUCKETS buckets on the
+ * first keyed write and doubled whenever there are more keys than buckets,
+ * so finding a key takes a chain of about one key, however many there are.
+ * A device holds at most max_blobs keys, the same as indices.
+ *
+ * Doubling the table doesn't move every key at once.  The new table takes
+ * over as the one new keys go in, and each keyed write or delete after that
+ * moves the keys of SSTORE_KEY_REHASH more buckets of the old table into it,
+ * so no one write pays for the whole table.  Until they've all moved, lookups
+ * look in the old table and then the new one.
+ *
+ * Key reads are lockless, like index reads: the key is looked up under
+ * rcu_read_lock(), and the reader takes a reference to its blob.  A key being
+ * moved is put on its new chain before its old chain is emptied, and readers
+ * look in the old table first, so they find it in one or the other.  Two
+ * things have to wait for a grace period, so that no reader is still walking
+ * the tables as they were: keys don't start moving until every reader knows
+ * there's a new table, and a table the keys moved out of isn't freed (and its
+ * links aren't used by the next table) until nobody can be walking it.
+ * keys_quiet is 0 while one of those grace periods is being waited for (by
+ * call_rcu(), so nobody sleeps on it), and until it's over the moving, or the
+ * next doubling, just waits its turn.
+ */
+#define SSTORE_KEY_BUCKETS 16   //buckets in a device's first key table
+#define SSTORE_KEY_REHASH 4     //old buckets moved by each write or delete
+
+u32 sstore_key_hash(const char * key, unsigned int size) {
+    return jhash(key, size, 0);
+}
+
+//a key table of buckets (a power of two) empty buckets, chained through link
+static struct sstore_key_table * sstore_key_table_alloc(unsigned int buckets,
+                                                                int link) {
+    struct sstore_key_table * table;
+    size_t size = sizeof (struct sstore_key_table) +
+                                    buckets * sizeof (struct sstore_key *);
+
+    if (size > PAGE_SIZE)
+        table = vmalloc(size);
+    else
+        table = kmalloc(size, GFP_KERNEL);
+    if (!table)
+        return NULL;
+    memset(table, 0, size);
+    table->mask = buckets - 1;
+    table->link = link;
+    return table;
+}
+
+static void sstore_key_table_free(struct sstore_key_table * table) {
+    if (!table)
+        return;
+    if (sizeof (struct sstore_key_table) +
+                (table->mask + 1) * sizeof (struct sstore_key *) > PAGE_SIZE)
+        vfree(table);
+    else
+        kfree(table);
+}
+
+//called by RCU once no reader can be walking the tables from before a switch
+static void sstore_keys_quiet_rcu(struct rcu_head * head) {
+    struct sstore * device = container_of(head, struct sstore, keys_rcu);
+
+    atomic_set(&device->keys_quiet, 1);
+}
+
+//the tables just changed, so wait for a grace period (see above)
+static void sstore_keys_switched(struct sstore * device) {
+    atomic_set(&device->keys_quiet, 0);
+    call_rcu(&device->keys_rcu, sstore_keys_quiet_rcu);
+}
+
+/*
+ * make the first key table, move the next SSTORE_KEY_REHASH buckets of keys
+ * out of the old table, or start doubling the table if it's too full, as the
+ * case may be.  Called by keyed writes and deletes, with the mutex held.
+ * Returns 0 or -ENOMEM (only for the first table: a table that can't be
+ * doubled just gets longer chains until it can).
+ */
+static int sstore_keys_rehash(struct sstore * device) {
+    struct sstore_key_table * table = device->keys;
+    struct sstore_key_table * old = device->old_keys;
+    struct sstore_key * key;
+    struct sstore_key ** slot;
+    int i = 0;
+
+    if (!table) {
+        table = sstore_key_table_alloc(SSTORE_KEY_BUCKETS, 0);
+        if (!table)
+            return -ENOMEM;
+        rcu_assign_pointer(device->keys, table);
+        return 0;
+    }
+    if (!atomic_read(&device->keys_quiet))
+        return 0;
+
+    if (old) {
+        for (i = 0; i < SSTORE_KEY_REHASH && device->rehash_bucket <= old->mask;
+                                                ++i, ++device->rehash_bucket) {
+            //onto the new chains (the old links stay as they are)...
+            key = old->buckets[device->rehash_bucket];
+            for (; key; key = key->next[old->link]) {
+                slot = &table->buckets[key->hash & table->mask];
+                key->next[table->link] = *slot;
+                rcu_assign_pointer(*slot, key);
+            }
+            //...then off of the old one
+            rcu_assign_pointer(old->buckets[device->rehash_bucket], NULL);
+        }
+        if (device->rehash_bucket > old->mask) {
+            rcu_assign_pointer(device->old_keys, NULL);
+            device->retired_keys = old;
+            sstore_keys_switched(device);
+        }
+        return 0;
+    }
+
+    //a grace period has gone by since the last table was emptied
+    sstore_key_table_free(device->retired_keys);
+    device->retired_keys = NULL;
+
+    if (device->key_count <= table->mask + 1)
+        return 0;
+    table = sstore_key_table_alloc((table->mask + 1) * 2, !table->link);
+    if (!table)
+        return 0;
+    device->rehash_bucket = 0;
+    //old_keys first, so a reader that sees the new table sees the old one too
+    rcu_assign_pointer(device->old_keys, device->keys);
+    rcu_assign_pointer(device->keys, table);
+    sstore_keys_switched(device);
+    return 0;
+}
+
+/*
+ * find key in one table.  If slot isn't NULL, *slot is set to the link that
+ * points to it.  Called under rcu_read_lock() or with the mutex held.
+ */
+static struct sstore_key * sstore_key_find(struct sstore_key_table * table,
+                                const char * key, unsigned int size, u32 hash,
+                                                struct sstore_key *** slot) {
+    struct sstore_key ** link = &table->buckets[hash & table->mask];
+    struct sstore_key * entry;
+
+    while ((entry = rcu_dereference(*link))) {
+        if (entry->hash == hash && entry->size == size &&
+                                            !memcmp(entry->key, key, size)) {
+            if (slot)
+                *slot = link;
+            return entry;
+        }
+        link = &entry->next[table->link];
+    }
+    return NULL;
+}
+
+/*
+ * find key in the device's tables (the old one first, see above), or return
+ * NULL.  *table is set to the table it's in, if table isn't NULL.
+ */
+static struct sstore_key * sstore_key_lookup(struct sstore * device,
+                                const char * key, unsigned int size, u32 hash,
+                struct sstore_key *** slot, struct sstore_key_table ** table) {
+    struct sstore_key_table * keys;
+    struct sstore_key_table * old;
+    struct sstore_key * entry = NULL;
+
+    keys = rcu_dereference(device->keys);
+    if (!keys)
+        return NULL;
+    //pairs with old_keys being set before keys in sstore_keys_rehash()
+    smp_rmb();
+    old = rcu_dereference(device->old_keys);
+
+    if (old)
+        entry = sstore_key_find(old, key, size, hash, slot);
+    if (entry) {
+        if (table)
+            *table = old;
+        return entry;
+    }
+    entry = sstore_key_find(keys, key, size, hash, slot);
+    if (entry && table)
+        *table = keys;
+    return entry;
+}
+
+/*
+ * look up key's blob without the mutex and take a reference to it (the same
+ * way as sstore_blob_get()).  Returns NULL if there's no such key.
+ */
+static struct blob * sstore_key_get(struct sstore * device, const char * key,
+                                                unsigned int size, u32 hash) {
+    struct sstore_key * entry;
+    struct blob * blob;
+
+    for (;;) {
+        rcu_read_lock();
+        entry = sstore_key_lookup(device, key, size, hash, NULL, NULL);
+        blob = entry ? rcu_dereference(entry->blob) : NULL;
+        if (!blob || atomic_inc_not_zero(&blob->refs)) {
+            rcu_read_unlock();
+            return blob;
+        }
+        rcu_read_unlock();
+
+        //replaced, deleted or being overwritten in place (see there)
+        cpu_relax();
+        cond_resched();
+    }
+}
+
+//called by RCU once no lockless lookup can still be looking at the key
+static void sstore_key_free_rcu(struct rcu_head * head) {
+    kfree(container_of(head, struct sstore_key, rcu));
+}
+
+/*
+ * delete every key and free the tables.  The tables are taken away from
+ * lockless readers first, and freed (along with the keys) once they're done
+ * with them.  A grace period being waited for by keys_rcu still gets to finish
+ * (the next table just can't be doubled until it does).
+ */
+static void sstore_keys_clear(struct sstore * device) {
+    struct sstore_key_table * tables[2] = { device->old_keys, device->keys };
+    struct sstore_key * key;
+    struct sstore_key * next;
+    unsigned int i = 0;
+    int t = 0;
+
+    if (!device->keys)
+        return;
+    rcu_assign_pointer(device->keys, NULL);
+    rcu_assign_pointer(device->old_keys, NULL);
+    synchronize_rcu();
+
+    for (t = 0; t < 2; ++t) {
+        if (!tables[t])
+            continue;
+        for (i = 0; i <= tables[t]->mask; ++i) {
+            for (key = tables[t]->buckets[i]; key; key = next) {
+                next = key->next[tables[t]->link];
+                sstore_blob_put(key->blob);
+                kfree(key);
+            }
+        }
+        sstore_key_table_free(tables[t]);
+    }
+    sstore_key_table_free(device->retired_keys);
+    device->retired_keys = NULL;
+    device->key_count = 0;
+}
+
+/*
+ * copy up to size bytes of the blob stored under key to the user's data
+ * buffer.  Returns the number of bytes copied, or -ENOENT if there's no such
+ * key.  Doesn't need the mutex (see above).
+ */
+ssize_t sstore_key_read(struct sstore * device, const char * key,
+            unsigned int key_size, u32 hash, int size, char __user * data) {
+    struct blob * blob;
+    ktime_t start = ktime_get();
+
+    if (!key_size || key_size > SSTORE_KEY_MAX || size < 0)
+        return -EINVAL;
+
+    blob = sstore_key_get(device, key, key_size, hash);
+    if (!blob)
+        return -ENOENT;
+
+    return sstore_copy_out(device, blob, 0, size, data, start);
+}
+
+/*
+ * store size bytes of the user's data (max_size at most) under key, replacing
+ * (or overwriting in place) whatever was there.  Returns the number of bytes
+ * written, or -ENOSPC if it's a new key and the device has max_blobs keys.
+ */
+ssize_t sstore_key_write(struct sstore * device, const char * key,
+        unsigned int key_size, u32 hash, int size, const char __user * data) {
+    struct sstore_key_table * table;
+    struct sstore_key ** slot;
+    struct sstore_key * entry;
+    struct blob * blob = NULL;
+    struct blob * old_blob;
+    int error = 0;
+    ktime_t start = ktime_get();
+
+    if (!key_size || key_size > SSTORE_KEY_MAX || size <= 0)
+        return -EINVAL;
+    if (size > max_size)
+        size = max_size;
+
+    error = sstore_keys_rehash(device);
+    if (error)
+        return error;
+
+    entry = sstore_key_lookup(device, key, key_size, hash, NULL, NULL);
+    if (!entry && device->key_count >= max_blobs)
+        return -ENOSPC;
+    //compressed or not, and shared or not, the same as sstore_do_write()
+    error = sstore_blob_compress(device, size, data, &blob);
+    if (!error)
+        error = sstore_blob_share(device, size, data, &blob);
+    if (!error)
+        error = sstore_make_room(device, 0, sstore_blob_need(blob, size),
+                        entry ? sstore_blob_bytes(device, entry->blob) : 0);
+    if (error) {
+        if (blob)
+            sstore_blob_discard(device, blob);
+        return error;
+    }
+
+    if (entry) {
+        //an existing key: the same as writing to an index that has a blob
+        error = blob ? 1 : sstore_overwrite(device, entry->blob, size, data);
+        if (error < 0)
+            return error;
+        if (error) {
+            error = blob ? 0 : sstore_blob_new(device, size, data, &blob);
+            if (error)
+                return error;
+            old_blob = entry->blob;
+            rcu_assign_pointer(entry->blob, blob);
+            sstore_charge(device, blob);
+            sstore_uncharge(device, old_blob);
+            sstore_blob_put(old_blob);
+        }
+    } else {
+        entry = kmalloc(sizeof (struct sstore_key) + key_size, GFP_KERNEL);
+        if (!entry) {
+            if (blob)
+                sstore_blob_discard(device, blob);
+            return -ENOMEM;
+        }
+        atomic_long_inc(&sstore_allocs.general);
+        if (!blob)
+            error = sstore_blob_new(device, size, data, &blob);
+        if (error) {
+            kfree(entry);
+            return error;
+        }
+        entry->blob = blob;
+        sstore_charge(device, blob);
+        entry->hash = hash;
+        entry->size = key_size;
+        memcpy(entry->key, key, key_size);
+
+        //new keys always go in the new table
+        table = device->keys;
+        slot = &table->buckets[hash & table->mask];
+        entry->next[table->link] = *slot;
+        rcu_assign_pointer(*slot, entry);
+        ++device->key_count;
+    }
+
+    sstore_stat_time(device, SSTORE_OP_WRITE, start);
+    sstore_stat_add(device, SSTORE_BYTES_IN, size);
+    return size;
+}
+
+/*
+ * delete the blob stored under key.  Returns 0, or -ENOENT if there's no such
+ * key.
+ */
+int sstore_key_delete(struct sstore * device, const char * key,
+                                            unsigned int key_size, u32 hash) {
+    struct sstore_key_table * table;
+    struct sstore_key ** slot;
+    struct sstore_key * entry;
+    int error = 0;
+    ktime_t start = ktime_get();
+
+    if (!key_size || key_size > SSTORE_KEY_MAX)
+        return -EINVAL;
+    if (!device->keys)
+        return -ENOENT;
+
+    error = sstore_keys_rehash(device);
+    if (error)
+        return error;
+
+    entry = sstore_key_lookup(device, key, key_size, hash, &slot, &table);
+    if (!entry)
+        return -ENOENT;
+
+    //readers walking past it keep going through its own link
+    rcu_assign_pointer(*slot, entry->next[table->link]);
+    --device->key_count;
+    sstore_uncharge(device, entry->blob);
+    sstore_blob_put(entry->blob);
+    call_rcu(&entry->rcu, sstore_key_free_rcu);
+
+    sstore_stat_time(device, SSTORE_OP_DELETE, start);
+    return 0;
+}
@@ -0,0 +1,473 @@
+/*
+ * (C) COPYRIGHT 2009 Tyler Hayes - tgh@pdx.edu
+ *
+ * sstore_core.h
+ */
+
+/*
+ * The blob store itself: the blob index, where blobs are allocated from,
+ * readers waiting for blobs, and reading, writing and deleting them
+ * (sstore_core.c).  The driver (sstore_main.c) is the file operations, /proc
+ * files and module setup around it.  The core only uses kernel primitives
+ * that sstore_shim.h can stand in for, so it also builds as a plain user space
+ * library when __KERNEL__ isn't defined (see bench_core.c).
+ */
+
+#ifndef _SSTORE_CORE_H
+#define _SSTORE_CORE_H
+
+#ifdef __KERNEL__
+#include <linux/cache.h>        /* for ____cacheline_aligned_in_smp */
+#include <linux/semaphore.h>    /* for a mutual exclusion semaphore */
+#include <linux/wait.h>         /* for a wait queue */
+#include <linux/rcupdate.h>     /* for struct rcu_head */
+#include <asm/atomic.h>         /* for atomic_t counters */
+#include <linux/radix-tree.h>   /* for the "radix" blob index backend */
+#include <linux/percpu.h>       /* for the per-CPU stats */
+#include <linux/ktime.h>        /* for ktime_t */
+#include <linux/types.h>        /* for u32 key hashes */
+#else
+#include "sstore_shim.h"        /* user space stand-ins for all of those */
+#endif
+#include "sstore.h"
+
+//----------------------------------------------------------------------------
+
+/*
+ * readers waiting for a blob sleep on one of these many wait queues, picked by
+ * hashing the index they're waiting on (see struct sstore_wait_bucket below).
+ */
+#define SSTORE_WAIT_BITS 6
+#define SSTORE_WAIT_BUCKETS (1 << SSTORE_WAIT_BITS)
+
+/*
+ * the operations timed for /proc/sstore/stats (see struct sstore_cpu_stats),
+ * and the counters kept alongside them.
+ */
+enum sstore_op {
+    SSTORE_OP_READ,         //copying a blob out
+    SSTORE_OP_WRITE,        //writing a blob (with the mutex held)
+    SSTORE_OP_DELETE,       //deleting a blob (with the mutex held)
+    SSTORE_OP_WAIT,         //a read blocked waiting for a blob
+    SSTORE_OP_LOCK,         //waiting for the device's mutex
+    SSTORE_OP_PACK,         //compressing a blob's data
+    SSTORE_OP_UNPACK,       //decompressing it
+    SSTORE_OPS
+};
+enum sstore_counter {
+    SSTORE_BYTES_IN,        //bytes written
+    SSTORE_BYTES_OUT,       //bytes read
+    SSTORE_WAKEUPS,         //wait buckets woken up by writes
+    SSTORE_RESTARTS,        //-ERESTARTSYS returns (signals while waiting)
+    SSTORE_UNCHANGED,       //conditional reads that found nothing new
+    SSTORE_CONFLICTS,       //conditional writes that found another version
+    SSTORE_EVICTIONS,       //blobs evicted to stay within the byte budget
+    SSTORE_RECLAIMS,        //blobs evicted for the kernel (see sstore_evict())
+    SSTORE_PACKED_IN,       //bytes of data compressed
+    SSTORE_PACKED_OUT,      //bytes they were compressed to
+    SSTORE_INCOMPRESSIBLE,  //writes that were left uncompressed after trying
+    SSTORE_SHARE_HITS,      //writes whose data another blob already had
+    SSTORE_SHARE_MISSES,    //writes of data no other blob had
+    SSTORE_COUNTERS
+};
+//latency histogram buckets: bucket n counts times of 2^(n-1) up to 2^n ns
+#define SSTORE_HIST_BUCKETS 36
+
+//the biggest blob that gets compressed (see COMPRESSION in sstore_core.c)
+#define SSTORE_COMPRESS_MAX (64 * 1024)
+//the most a read copies without a reference to the blob (see struct blob)
+#define SSTORE_QUICK_READ PAGE_SIZE
+
+//----------------------------------------------------------------------------
+
+/*
+ * STRUCT DEFINITIONS
+ */
+
+/*
+ * the device will be storing an index of these, keyed by blob index.
+ *
+ * While anyone is reading a blob, its data is never changed.  A write to an
+ * index whose blob is being read puts a whole new blob there instead, and a
+ * delete just takes the blob out.  That's what lets read() look blobs up and
+ * copy them without taking the device's mutex: the lookup is done under
+ * rcu_read_lock(), and the reader then holds a reference to the blob while it
+ * copies, so the blob isn't freed or changed out from under it.  The index
+ * holds one reference, and the blob is freed (after an RCU grace period, since
+ * lockless lookups may still be looking at it) when the last reference is
+ * dropped.  When the index's reference is the only one, a write can overwrite
+ * the blob's data in place instead, by holding the count at zero (so new
+ * readers wait) while it copies.
+ *
+ * Reads of up to SSTORE_QUICK_READ bytes don't take a reference at all (see
+ * sstore_read_quick() in sstore_core.c), so that readers of the same blob on
+ * different CPUs don't all write to its reference count.  They copy while
+ * still under rcu_read_lock(), and use the count and the version like a
+ * seqlock: if the count was at zero, or the version changed, by the time the
+ * copy is done, an overwrite may have been going on, and it's read again
+ * the usual way.
+ */
+struct blob {
+    int index;              //index number of the blob (0 if it's under a key)
+    u32 hash;               //of its data, if it's shared (see SHARING)
+    u64 version;            //which write of the device put this data here
+    char * junk;            //the data that the blob holds, if it fits a page
+    char *** chunks;        //or the pages it's in (see sstore_blob_data())
+    unsigned int size;      //bytes of data (junk is '\0' terminated too)
+    unsigned int capacity;  //bytes junk (or chunks) has room for
+    //bytes junk (or chunks) holds if the data is compressed, 0 if it isn't
+    unsigned int stored;
+    //read or written since the clock hand last went by (see EVICTION)
+    int referenced;
+    atomic_t refs;          //references to the blob (see above)
+    /*
+     * the blob junk and chunks really belong to, if the data is shared with
+     * other blobs that have the same (see SHARING in sstore_core.c), or NULL
+     * if they're the blob's own.  A blob sharing data has a reference to it.
+     */
+    struct blob * shared;
+    struct rcu_head rcu;    //for freeing the blob after a grace period
+};
+
+
+/*
+ * data shared by the blobs that have it (see SHARING in sstore_core.c).  These
+ * are chained off a device's shares table, and only used with its mutex held.
+ */
+struct sstore_share {
+    struct sstore_share * next;     //the next share in the chain
+    struct blob * blob;     //the data (a blob that isn't in the index)
+    u32 hash;               //sstore_blob_hash() of it
+    unsigned int users;     //blobs in the index, or under keys, sharing it
+};
+
+
+/*
+ * a point-in-time view of a device's indices (see SNAPSHOTS in sstore_core.c).
+ * Taking one just notes the device's version.  After that, the first time an
+ * index changes, the blob it had (or that it had none) is kept in the
+ * snapshot's kept tree, so the snapshot can still read it.  Snapshots are
+ * taken and dropped, and kept blobs are added, with the device's mutex held.
+ */
+struct sstore_snapshot {
+    struct sstore_snapshot * next;  //the device's next (older) snapshot
+    u64 version;            //the device's version when it was taken
+    struct radix_tree_root kept;    //struct sstore_kepts, by index
+    struct sstore_kept * kept_list; //the same ones, for dropping them all
+};
+
+//what an index had when a snapshot was taken, kept from when it changed
+struct sstore_kept {
+    struct sstore_kept * next;      //the snapshot's next kept index
+    unsigned int index;
+    struct blob * blob;     //the blob it had (a reference), or NULL for none
+};
+
+
+/*
+ * a blob stored under a key instead of an index (see KEYS in sstore_core.c).
+ * Keys are chained off the buckets of a struct sstore_key_table.  When the
+ * table is grown, each key is moved from its chain in the old table to one in
+ * the new table while lockless readers may still be walking the old one, so
+ * a key has a link for each: the tables take turns using next[0] and next[1].
+ */
+struct sstore_key {
+    struct sstore_key * next[2];    //the next key in the chain (see above)
+    struct blob * blob;     //the key's blob (replaced by writes, like an index)
+    u32 hash;               //sstore_key_hash() of the key
+    unsigned int size;      //bytes of key
+    struct rcu_head rcu;    //for freeing the key after a grace period
+    char key[];             //the key itself
+};
+
+//a device's hash table of keys
+struct sstore_key_table {
+    unsigned int mask;      //the number of buckets (a power of two) - 1
+    int link;               //which of next[] the chains go through
+    struct sstore_key * buckets[];
+};
+
+
+/*
+ * a wait queue for readers blocked on any of the indices that hash to it.  A
+ * write only wakes up the bucket of the index it wrote, instead of every
+ * reader of the device waking up to find out it wasn't their index.  Readers
+ * of indices that share a bucket still wake each other up, which is counted
+ * as a spurious wakeup.
+ */
+struct sstore_wait_bucket {
+    wait_queue_head_t queue;
+    atomic_t waiters;       //number of readers sleeping on this bucket
+};
+
+
+struct sstore;
+
+/*
+ * the blob index operations.  The blobs of a device used to hang off of a
+ * singly linked list, so getting to blob n meant walking the n - 1 blobs in
+ * front of it.  Now they live in an index-addressed structure, and which
+ * structure that is gets picked at load time with the index_backend module
+ * parameter.  Each backend fills in one of these tables of function pointers
+ * (the same trick as struct file_operations).  Every one of these is called
+ * with the device's mutex held, except that lookup is also called under just
+ * rcu_read_lock(), so backends have to publish blobs with
+ * rcu_assign_pointer().
+ */
+struct sstore_index_ops {
+    const char * name;      //what to pass as index_backend to get this one
+    //set up the backend for a device (called once from init)
+    int (*init)(struct sstore * device);
+    //tear the backend down (called from exit, after the blobs are freed)
+    void (*destroy)(struct sstore * device);
+    //return the blob at the given index, or NULL if there isn't one
+    struct blob * (*lookup)(struct sstore * device, unsigned int index);
+    /*
+     * put a blob at the given index.  Whatever was there before is handed back
+     * in *old (NULL if the slot was empty).  Returns 0 or a negative errno.
+     */
+    int (*store)(struct sstore * device, unsigned int index, struct blob * blob,
+            struct blob ** old);
+    //take the blob at the given index out and return it (NULL if none)
+    struct blob * (*erase)(struct sstore * device, unsigned int index);
+    /*
+     * return the first blob at or after *index, and set *index to its index.
+     * Returns NULL when there are no more blobs.
+     */
+    struct blob * (*next)(struct sstore * device, unsigned int * index);
+};
+
+
+/*
+ * one CPU's share of a device's stats.  Every CPU only ever adds to its own
+ * (with preemption off), so keeping them costs no locks, atomics or cache
+ * lines bouncing between CPUs; reading the stats file adds them all up.
+ */
+struct sstore_cpu_stats {
+    unsigned long ops[SSTORE_OPS];          //operations finished
+    u64 nsecs[SSTORE_OPS];                  //how long they took in all
+    unsigned long hist[SSTORE_OPS][SSTORE_HIST_BUCKETS];
+    unsigned long count[SSTORE_COUNTERS];
+};
+
+
+/*
+ * the device structure.  This is one whole blob store, with its own mutex,
+ * index and wait buckets.  The driver gives each device one of these, or
+ * splits the device's indices over several of them (shards, see sstore_main.c)
+ * so writes to different shards don't wait on each other's mutex.  Each one
+ * starts on a cache line of its own, so shards side by side in an array don't
+ * share any.
+ */
+struct sstore {
+    /*
+     * the highest index that has been written to.  Every index from 1 up to
+     * this one counts as a blob (ones that were never written to just have no
+     * data), the same as when the blobs were all allocated in a list.
+     */
+    unsigned int blob_count;
+    /*
+     * these are the heads of the wait queues, one per bucket of indices.
+     * wait_queue_head_t is a typedef for struct __wait_queue_head (see
+     * linux/wait.h).  These queues are used in the read() function of
+     * sstore_main.c.
+     */
+    struct sstore_wait_bucket wait_buckets[SSTORE_WAIT_BUCKETS];
+    atomic_t waiters;               //readers sleeping on any bucket
+    /*
+     * readers that would have been woken up by a write to some other index
+     * back when there was only one wait queue, but weren't (only changed with
+     * the mutex held).
+     */
+    unsigned long wakeups_avoided;
+    atomic_t spurious_wakeups;      //readers woken up for another index
+    /*
+     * indices watched by open files for poll() (see struct sstore_file in
+     * sstore_main.c).  Each one also counts as a waiter on its bucket, so
+     * writes wake up pollers.
+     */
+    atomic_t watches;
+    //microseconds readers busy-poll for now (see sstore_spin_for_blob())
+    atomic_t spin_usecs;
+    atomic_t spin_hits;             //spins that found their blob
+    atomic_t spin_misses;           //spins that gave up and went to sleep
+    atomic_t timeouts;              //timed reads that ran out of time
+    struct sstore_cpu_stats * stats;    //per-CPU (from alloc_percpu())
+    /*
+     * keyed blobs (see KEYS in sstore_core.c).  keys is the hash table that
+     * new keys go in.  While it's being grown, old_keys is the table the keys
+     * are being moved out of (rehash_bucket is the next bucket to move), and
+     * once they all are, it's retired_keys until it can be freed.
+     */
+    struct sstore_key_table * keys;
+    struct sstore_key_table * old_keys;
+    struct sstore_key_table * retired_keys;
+    unsigned int rehash_bucket;
+    unsigned int key_count;         //keys in the tables
+    atomic_t keys_quiet;            //no grace period being waited for
+    struct rcu_head keys_rcu;       //for waiting for it
+    struct blob ** blob_table;      //"table" backend: blob pointers by index
+    struct radix_tree_root blob_tree;   //"radix" backend
+    unsigned int seek_index;    //index of the last used blob (0 if none)
+    /*
+     * the version given to the data of the last write (see VERSIONS in
+     * sstore_core.c).  It's never reset, not even when the device is cleared.
+     */
+    u64 version;
+    /*
+     * bytes of blob data (what the blobs have room for, not just what they
+     * hold) in the index and under keys, and how many there can be (0 for no
+     * limit).  Going over budget evicts blobs (see EVICTION in
+     * sstore_core.c), starting at the index clock_hand is on.
+     */
+    unsigned long bytes;
+    unsigned long budget;
+    unsigned int clock_hand;
+    /*
+     * writes of at least compress_min bytes (and at most SSTORE_COMPRESS_MAX)
+     * are compressed, 0 for none.  A write copies the data into compress_in
+     * and compresses it into compress_out, with compress_work as LZO's work
+     * memory (all only allocated once compression is turned on, see
+     * sstore_set_compression()).
+     */
+    unsigned int compress_min;
+    unsigned char * compress_in;
+    unsigned char * compress_out;
+    void * compress_work;
+    /*
+     * data written to the device that's shared by every blob with the same
+     * (see SHARING in sstore_core.c), in a hash table of share_mask + 1
+     * buckets (NULL if the device doesn't share data).  shared_bytes is the
+     * bytes of data that sharing saves: only one of the blobs sharing data
+     * counts in bytes, and the rest count here.
+     */
+    struct sstore_share ** shares;
+    unsigned int share_mask;
+    unsigned int share_count;       //shares in the table
+    unsigned long shared_bytes;
+    /*
+     * snapshots of the device (see SNAPSHOTS in sstore_core.c), newest first,
+     * and how many indices they've kept between them.
+     */
+    struct sstore_snapshot * snapshots;
+    unsigned int snapshot_count;
+    unsigned long kept_count;
+    struct semaphore mutex;     //semaphore for mutal exclusion
+    /*
+     * held by mmap() while it maps a blob, and by an append while it decides
+     * whether it can add to the page a blob's data ends in, in place (see
+     * sstore_append_fill() in sstore_core.c).  Nothing that holds it faults.
+     */
+    struct semaphore map_mutex;
+    /*
+     * whether deleting a blob moves every blob after it down by one index.
+     * Shards of a device don't, since their indices are spread over all of
+     * the shards (see sstore_main.c).
+     */
+    int renumber;
+} ____cacheline_aligned_in_smp;
+
+
+//allocation counters for /proc/sstore/stats
+struct sstore_alloc_stats {
+    atomic_long_t blobs;        //struct blobs from sstore_blob_cache
+    atomic_long_t junk;         //blob data from the size class caches
+    atomic_long_t pool_hits;    //blob data from pages in the page pool
+    atomic_long_t pool_misses;  //blob data from the page allocator
+    atomic_long_t general;      //kmalloc()s (batches, open files, keys, shares)
+    atomic_long_t in_place;     //overwrites that reused the blob and its data
+};
+
+//----------------------------------------------------------------------------
+
+/*
+ * GLOBALS (defined in sstore_core.c)
+ */
+
+//module parameters (see sstore_core.c)
+extern unsigned int max_blobs;
+extern unsigned int max_size;
+extern char * index_backend;
+extern unsigned int pool_pages;
+extern unsigned int spin_usecs;
+extern unsigned long max_bytes;
+extern unsigned int compress_min;
+extern int dedup;
+
+//the blob index backend all of the devices use (picked by index_backend)
+extern struct sstore_index_ops * sstore_index;
+extern struct sstore_alloc_stats sstore_allocs;
+
+//----------------------------------------------------------------------------
+
+/*
+ * FUNCTIONS.  Writing and deleting (and clearing a device) must be done with
+ * the device's mutex held, reading doesn't need it (but doesn't mind it
+ * either).  Data pointers are user space pointers, keys are kernel pointers.
+ */
+
+//pick the index backend and create the allocation caches (once, at load)
+int sstore_core_init(void);
+//free everything sstore_core_init() set up (once, at unload)
+void sstore_core_exit(void);
+//set up a device's blob index, mutex and wait buckets
+int sstore_device_init(struct sstore * device);
+//tear down a device's blob index (its blobs must be cleared already)
+void sstore_device_destroy(struct sstore * device);
+//delete every blob and key of a device (on the last close, or to clear it)
+void sstore_device_clear(struct sstore * device);
+//take the device's mutex (timing the wait).  0 or -ERESTARTSYS
+int sstore_lock(struct sstore * device);
+//add every CPU's stats of a device to total
+void sstore_stats_sum(struct sstore * device, struct sstore_cpu_stats * total);
+//compress writes of at least threshold bytes (0 for none).  0 or -ENOMEM
+int sstore_set_compression(struct sstore * device, unsigned int threshold);
+//take a snapshot of the device's indices (NULL if there's no memory for it)
+struct sstore_snapshot * sstore_snapshot_take(struct sstore * device);
+//drop a snapshot, letting go of the blobs it kept
+void sstore_snapshot_drop(struct sstore * device,
+        struct sstore_snapshot * snapshot);
+
+int sstore_blob_ready(struct sstore * device, unsigned int index);
+struct blob * sstore_blob_get(struct sstore * device, unsigned int index);
+void sstore_blob_put(struct blob * blob);
+char * sstore_blob_data(struct blob * blob, unsigned int offset,
+        unsigned int end, unsigned int * length);
+unsigned int sstore_blob_size(struct blob * blob);
+struct blob * sstore_blob_expand(struct blob * blob);
+struct sstore_wait_bucket * sstore_wait_bucket(struct sstore * device,
+        unsigned int index);
+int sstore_wait_for_blob(struct sstore * device, unsigned int index,
+        unsigned int offset, long * timeout);
+
+ssize_t sstore_do_read(struct sstore * device, int index, int offset,
+        int size, char __user * data);
+ssize_t sstore_read_blob(struct sstore * device, int index, int offset,
+        int size, char __user * data, long timeout, unsigned int spin);
+ssize_t sstore_tail_blob(struct sstore * device, int index, int offset,
+        int size, char __user * data, long timeout);
+ssize_t sstore_do_write(struct sstore * device, int index, int size,
+        const char __user * data);
+ssize_t sstore_do_append(struct sstore * device, int index, int size,
+        const char __user * data);
+ssize_t sstore_do_write_if(struct sstore * device, int index, int size,
+        const char __user * data, u64 * version);
+ssize_t sstore_do_read_if(struct sstore * device, int index, int size,
+        char __user * data, u64 * version);
+int sstore_do_delete(struct sstore * device, unsigned long index);
+int sstore_do_punch(struct sstore * device, unsigned long first,
+        unsigned long last);
+ssize_t sstore_snapshot_read(struct sstore * device,
+        struct sstore_snapshot * snapshot, int index, int offset, int size,
+        char __user * data);
+unsigned long sstore_evict(struct sstore * device, unsigned long bytes);
+
+u32 sstore_key_hash(const char * key, unsigned int size);
+ssize_t sstore_key_read(struct sstore * device, const char * key,
+        unsigned int key_size, u32 hash, int size, char __user * data);
+ssize_t sstore_key_write(struct sstore * device, const char * key,
+        unsigned int key_size, u32 hash, int size, const char __user * data);
+int sstore_key_delete(struct sstore * device, const char * key,
+        unsigned int key_size, u32 hash);
+
+#endif
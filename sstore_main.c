@@ -0,0 +1,2424 @@
+/*
+ * sstore_main.c - the most useful device driver ever!
+ *
+ * COPYRIGHT (C) 2009 Tyler Hayes - tgh@pdx.edu
+ *
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>  /* for module_param(), so that the module can
+                                 * take arguments from the command line when
+                                 * using insmod */
+#include <linux/fs.h>           /* for struct file, struct file_operations,
+                                 * register_chrdev_region(),
+                                 * alloc_chrdev_region() */
+#include <linux/types.h>        /* for dev_t (represents device numbers),
+                                 * ssize_t, size_t, loff_t types */
+#include <linux/kdev_t.h>       /* for MKDEV(), MAJOR(), and MINOR() macros */
+#include <linux/cdev.h>         /* for the cdev struct */
+#include <linux/device.h>       /* for class_create() and device_create(), so
+                                 * udev makes the /dev files */
+#include <linux/err.h>          /* for IS_ERR() and PTR_ERR() */
+#include <linux/sched.h>        /* for current process info */
+#include <linux/uaccess.h>      /* for copy_to_user() and copy_from_user() */
+#include <linux/proc_fs.h>      /* for use of the /proc file system */
+#include <linux/seq_file.h>     /* for the /proc/sstore files */
+#include <linux/math64.h>       /* for div64_u64() and div_u64_rem() */
+#include <linux/slab.h>         /* for kmalloc() and kfree() */
+#include <linux/poll.h>         /* for poll_wait() and the POLL* flags */
+#include <linux/bitops.h>       /* for the bitmap of watched indices */
+#include <linux/mm.h>           /* for struct vm_area_struct, vm_insert_page()
+                                 * and the page allocator, and the shrinker */
+#include "sstore_core.h"        /* the blob store (struct sstore, struct blob,
+                                   reading, writing and deleting blobs), and
+                                   sstore.h for SSTORE_MAJOR,
+                                   SSTORE_DEVICE_COUNT and the ioctls */
+
+
+/*
+ * a device (/dev/sstore0, /dev/sstore1, ...).  Its blobs are kept in one or
+ * more shards, each of them a whole blob store of its own (a struct sstore,
+ * with its own mutex, index and wait buckets).  See SHARDS below.
+ */
+struct sstore_dev {
+    struct sstore * shards;     //the shards parameter's worth of them
+    /*
+     * fd_count keeps track of how many open file descriptors in user space are
+     * associated with the device represented by an instance of this struct.
+     * This is done so that the release function in the driver can shut down
+     * the device on the last close. (See "Linux Device Drivers" 3rd Ed. pg. 59)
+     */
+    unsigned int fd_count;
+    struct semaphore mutex;     //for fd_count
+    struct cdev cdev;
+};
+
+
+/*
+ * what each open file of a device has of its own (it's the file's
+ * private_data).  Indices the file watches (see SSTORE_IOCTL_WATCH in
+ * sstore.h) are bits in watching, which isn't allocated until the first watch
+ * since it takes max_blobs bits.  bucket_watches counts them by wait bucket
+ * (the buckets of shard 0, then shard 1, and so on), so poll() knows which
+ * buckets' wait queues to wait on.  snapshots is NULL until the file takes a
+ * snapshot of the device (see SNAPSHOT IOCTL), then it's one per shard.
+ */
+struct sstore_file {
+    struct sstore_dev * dev;
+    unsigned long * watching;
+    struct sstore_snapshot ** snapshots;
+    atomic_t bucket_watches[];
+};
+
+
+/*
+ * Function prototypes
+ */
+static int sstore_init(void);
+static struct sstore * sstore_shard(struct sstore_dev * dev, int index,
+        int * shard_index);
+static unsigned int sstore_dev_index(struct sstore_dev * dev,
+        struct sstore * shard, unsigned int index);
+static unsigned int sstore_dev_blob_count(struct sstore_dev * dev);
+static int sstore_lock_shards(struct sstore_dev * dev);
+static void sstore_unlock_shards(struct sstore_dev * dev);
+static void sstore_shard_range(struct sstore_dev * dev, struct sstore * shard,
+        unsigned long first, unsigned long last, unsigned long * shard_first,
+        unsigned long * shard_last);
+int sstore_open(struct inode * i_node, struct file * file);
+static void * sstore_data_find(struct seq_file * seq, loff_t * pos);
+static void * sstore_data_start(struct seq_file * seq, loff_t * pos);
+static void * sstore_data_next(struct seq_file * seq, void * v, loff_t * pos);
+static void sstore_data_stop(struct seq_file * seq, void * v);
+static int sstore_data_show(struct seq_file * seq, void * v);
+static int sstore_data_show_binary(struct seq_file * seq, void * v);
+struct sstore_data_iter;
+static int sstore_seq_write(struct seq_file * seq, const void * data,
+        size_t size);
+static int sstore_data_open(struct inode * inode, struct file * file);
+static int sstore_data_open_binary(struct inode * inode, struct file * file);
+static int sstore_data_release(struct inode * inode, struct file * file);
+static u32 sstore_data_pieces(void);
+static int sstore_data_hold(struct sstore_data_iter * iter,
+        struct sstore_dev * dev, unsigned int index, unsigned int piece);
+struct sstore_image_iter;
+static int sstore_image_open(struct inode * inode, struct file * file);
+static int sstore_image_next(struct sstore_image_iter * iter);
+static ssize_t sstore_image_read(struct file * file, char __user * user,
+        size_t size, loff_t * offset);
+static int sstore_image_release(struct inode * inode, struct file * file);
+static void * sstore_stats_start(struct seq_file * seq, loff_t * pos);
+static void * sstore_stats_next(struct seq_file * seq, void * v, loff_t * pos);
+static void sstore_stats_stop(struct seq_file * seq, void * v);
+static int sstore_stats_show(struct seq_file * seq, void * v);
+static int sstore_stats_open(struct inode * inode, struct file * file);
+ssize_t sstore_read(struct file * file, char __user * user, size_t size,
+        loff_t * offset);
+ssize_t sstore_write(struct file * file, const char __user * user,
+        size_t size, loff_t * offset);
+static long sstore_timeout(struct file * file);
+static ssize_t sstore_file_read(struct sstore_file * file,
+        struct sstore * shard, int index, int offset, int size,
+        char __user * data, long timeout, unsigned int spin);
+static long sstore_ioctl_batch(struct sstore_dev * dev,
+        struct sstore_batch __user * arg);
+static long sstore_ioctl_key(struct sstore_dev * dev, unsigned int command,
+        struct sstore_key_op __user * arg);
+static long sstore_ioctl_delete_range(struct sstore_dev * dev,
+        struct sstore_delete_range __user * arg);
+static long sstore_ioctl_clear(struct sstore_dev * dev);
+static long sstore_ioctl_compress(struct sstore_dev * dev,
+        unsigned long threshold);
+static long sstore_ioctl_versioned(struct sstore_dev * dev,
+        unsigned int command, struct sstore_versioned __user * arg);
+static long sstore_ioctl_restore(struct sstore_dev * dev,
+        struct sstore_restore __user * arg);
+static long sstore_ioctl_snapshot(struct sstore_file * file);
+static void sstore_snapshots_drop(struct sstore_file * file);
+static int sstore_bucket_slot(struct sstore_file * file,
+        struct sstore * shard, unsigned int index);
+static int sstore_watch(struct sstore_file * file, unsigned long index);
+static int sstore_unwatch(struct sstore_file * file, unsigned long index);
+static long sstore_ioctl_ready(struct sstore_file * file,
+        struct sstore_ready __user * arg);
+long sstore_ioctl(struct file * file, unsigned int ui, unsigned long ul);
+unsigned int sstore_poll(struct file * file, poll_table * wait);
+int sstore_mmap(struct file * file, struct vm_area_struct * vma);
+int sstore_release(struct inode * i_node, struct file * file);
+static unsigned long sstore_cached_pages(void);
+static int sstore_shrink(int nr_to_scan, gfp_t gfp_mask);
+static void sstore_cleanup_and_exit(void);
+
+/*
+ * Global variables
+ */
+//major and minor numbers
+unsigned int sstore_major = SSTORE_MAJOR;
+unsigned int sstore_minor = SSTORE_MINOR;
+//for an array of sstore devices
+struct sstore_dev * sstore_dev_array;
+//the device class, so that udev makes the /dev files
+struct class * sstore_class;
+//used for creating a /proc directory (used in init() and cleanup_and_exit())
+struct proc_dir_entry * sstore;
+//whether sstore_shrinker has been registered (see RETENTION)
+int sstore_shrinking = 0;
+
+/*
+ * Module Parameters -- S_IRUGO is a permissions mask that means this parameter
+ * can be read by the world, but cannot be changed.  The ones for the store
+ * itself (max_blobs, max_size, index_backend, pool_pages, spin_usecs,
+ * max_bytes, compress_min and dedup) are in sstore_core.c.
+ */
+module_param(sstore_major, uint, S_IRUGO);
+module_param(sstore_minor, uint, S_IRUGO);
+//how many devices there are (/dev/sstore0 up to /dev/sstore<device_count - 1>)
+unsigned int device_count = SSTORE_DEVICE_COUNT;
+module_param(device_count, uint, S_IRUGO);
+//how many shards each device's indices are spread over (see SHARDS below)
+unsigned int shards = 1;
+module_param(shards, uint, S_IRUGO);
+/*
+ * whether a device keeps its blobs after the last close (see RETENTION
+ * below), instead of freeing them.
+ */
+int retain = 0;
+module_param(retain, bool, S_IRUGO);
+
+/*
+ * the /proc files are seq_files (see "Linux Device Drivers" 3rd Ed. pg. 87),
+ * so they aren't limited to one page of output: the seq_file code calls
+ * start() and then show() and next() for each record (a device for stats, a
+ * blob for data), as many times as the reader needs.
+ */
+static struct seq_operations sstore_data_seq_ops = {
+    .start = sstore_data_start,
+    .next = sstore_data_next,
+    .stop = sstore_data_stop,
+    .show = sstore_data_show
+};
+
+static struct seq_operations sstore_data_binary_seq_ops = {
+    .start = sstore_data_start,
+    .next = sstore_data_next,
+    .stop = sstore_data_stop,
+    .show = sstore_data_show_binary
+};
+
+static struct file_operations sstore_data_fops = {
+    .owner = THIS_MODULE,
+    .open = sstore_data_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = sstore_data_release
+};
+
+static struct file_operations sstore_data_binary_fops = {
+    .owner = THIS_MODULE,
+    .open = sstore_data_open_binary,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = sstore_data_release
+};
+
+//image<N> isn't a seq_file (see PROC: sstore/image<N> files)
+static struct file_operations sstore_image_fops = {
+    .owner = THIS_MODULE,
+    .open = sstore_image_open,
+    .read = sstore_image_read,
+    .llseek = no_llseek,
+    .release = sstore_image_release
+};
+
+static struct seq_operations sstore_stats_seq_ops = {
+    .start = sstore_stats_start,
+    .next = sstore_stats_next,
+    .stop = sstore_stats_stop,
+    .show = sstore_stats_show
+};
+
+//lets the kernel evict retained blobs when it's short on memory
+static struct shrinker sstore_shrinker = {
+    .shrink = sstore_shrink,
+    .seeks = DEFAULT_SEEKS
+};
+
+static struct file_operations sstore_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = sstore_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = seq_release
+};
+
+//what the stats file calls each timed operation
+static const char * sstore_op_names[SSTORE_OPS] = {
+    [SSTORE_OP_READ] = "read",
+    [SSTORE_OP_WRITE] = "write",
+    [SSTORE_OP_DELETE] = "delete",
+    [SSTORE_OP_WAIT] = "blocked",
+    [SSTORE_OP_LOCK] = "lock wait",
+    [SSTORE_OP_PACK] = "compress",
+    [SSTORE_OP_UNPACK] = "decompress"
+};
+
+/*
+ * FOPS (file operations). This struct is a collection of function pointers
+ * that point to a char driver's methods.
+ */
+struct file_operations sstore_fops = {
+    .owner = THIS_MODULE,
+    .read = sstore_read,
+    .write = sstore_write,
+    .unlocked_ioctl = sstore_ioctl,
+    .mmap = sstore_mmap,
+    .poll = sstore_poll,
+    .open = sstore_open,
+    .release = sstore_release
+};
+
+
+/*
+ * INIT
+ */
+static int __init sstore_init(void) {
+    int result = 0; //the return status of this function
+    int i = 0; //your standard for-loop variable
+    int j = 0; //and its friend, for the shards of each device
+    int error = 0;  //to catch any errors returned from certain function calls
+    dev_t device_num = 0; //the device number (holds major and minor number)
+    struct sstore_dev * dev;    //the device being set up
+    struct device * node;       //its /dev file
+    char name[16];              //the name of its /proc/sstore/image<N> file
+
+
+    //DEBUG OUTPUT
+    PDEBUG("\nIn sstore_init()");
+    PDEBUG("\nmax_blobs = %d, max_size = %d", max_blobs, max_size);
+
+    if (!device_count || !shards) {
+        printk(KERN_ALERT "device_count and shards must be at least 1: sstore");
+        return -EINVAL;
+    }
+
+    //pick the blob index backend and create the caches blobs come from
+    error = sstore_core_init();
+    if (error)
+        return error;
+
+    /*
+     * Get a range of minor numbers and register a region for devices.
+     * 
+     * When sstore_major is not 0 (when it is explicitly given a number by a
+     * programmer), the sstore_major and sstore_minor numbers are given to the
+     * MKDEV macro:
+     * MKDEV(ma,mi)	((ma)<<8 | (mi)), which stores these numbers into a
+     * 32-bit unsigned integer type (device_num) by dividing the bits up into a
+     * major number section and a minor number section.  device_num is then used
+     * to register the device with register_chrdev_region().  Otherwise,
+     * the kernel is used to get a number dynamically by sending the address
+     * of the device_num variable through the alloc_chrdev_region() function
+     * in the else clause. 
+     */
+    if (sstore_major) {
+        device_num = MKDEV(sstore_major, sstore_minor);
+        result = register_chrdev_region(device_num, device_count, "sstore");
+    } else {
+        result = alloc_chrdev_region(&device_num, sstore_minor,
+                device_count, "sstore");
+        sstore_major = MAJOR(device_num);
+    }
+
+    //check result of registration
+    if (result < 0) {
+        printk(KERN_ALERT "Major number %d not found: sstore", sstore_major);
+        sstore_core_exit();
+        return result;
+    }
+
+    //allocate space for the devices (an array of sstore_dev structs)
+    sstore_dev_array = kmalloc(device_count * sizeof (struct sstore_dev),
+            GFP_KERNEL);
+    //check that the allocation was successful, if not, exit gracefully
+    if (!sstore_dev_array) {
+        sstore_cleanup_and_exit();
+        return -ENOMEM;
+    }
+    //clean the array to null values
+    memset(sstore_dev_array, 0, device_count * sizeof (struct sstore_dev));
+
+    //the class the devices belong to (their /dev files are made for it)
+    sstore_class = class_create(THIS_MODULE, "sstore");
+    if (IS_ERR(sstore_class)) {
+        error = PTR_ERR(sstore_class);
+        sstore_class = NULL;
+        sstore_cleanup_and_exit();
+        return error;
+    }
+
+    //initialize each sstore device in the array
+    for (i = 0; i < device_count; ++i) {
+        dev = &sstore_dev_array[i];
+        sema_init(&dev->mutex, 1);
+        //the shards (each one cache line aligned, see struct sstore)
+        dev->shards = kmalloc(shards * sizeof (struct sstore), GFP_KERNEL);
+        if (!dev->shards) {
+            sstore_cleanup_and_exit();
+            return -ENOMEM;
+        }
+        memset(dev->shards, 0, shards * sizeof (struct sstore));
+        /*
+         * set the counts to 0, and set up the mutex lock, the wait queues for
+         * blocking i/o in read, and the blob index of each shard
+         */
+        for (j = 0; j < shards; ++j) {
+            error = sstore_device_init(&dev->shards[j]);
+            if (error)
+                break;
+            dev->shards[j].renumber = (shards == 1);
+            //max_bytes is for the whole device
+            dev->shards[j].budget = DIV_ROUND_UP(max_bytes, shards);
+        }
+        if (error) {
+            //only the ones before j were set up
+            while (j--)
+                sstore_device_destroy(&dev->shards[j]);
+            kfree(dev->shards);
+            dev->shards = NULL;
+            sstore_cleanup_and_exit();
+            return error;
+        }
+        //initialize char device structure
+        cdev_init(&dev->cdev, &sstore_fops);
+        dev->cdev.owner = THIS_MODULE;
+        dev->cdev.ops = &sstore_fops;
+        device_num = MKDEV(sstore_major, sstore_minor + i);
+        //notify the kernel of this device--upon success, device is now "live"
+        error = cdev_add(&dev->cdev, device_num, 1);
+        if (error) {
+            printk(KERN_ALERT "Error %d adding device sstore%d", error, i);
+            sstore_cleanup_and_exit();
+            return error;
+        }
+        //have udev make /dev/sstore<i>
+        node = device_create(sstore_class, NULL, device_num, NULL,
+                                                                "sstore%d", i);
+        if (IS_ERR(node))
+            printk(KERN_WARNING "Error %ld making /dev/sstore%d: sstore",
+                                                            PTR_ERR(node), i);
+    }
+
+    /*
+     * create /proc files.  The data file keeps a record of the data stored in
+     * the device's blob list (and data.bin is the same thing in binary).  The
+     * stats file gives statistics of the device, such as a count of open
+     * device file descriptors.
+     */
+    sstore = proc_mkdir("sstore", NULL);
+    proc_create("data", 0, sstore, &sstore_data_fops);
+    proc_create("data.bin", 0, sstore, &sstore_data_binary_fops);
+    proc_create("stats", 0, sstore, &sstore_stats_fops);
+    //and an image<N> file for each device, to save it with
+    for (i = 0; i < device_count; ++i) {
+        sprintf(name, "image%d", i);
+        proc_create_data(name, 0, sstore, &sstore_image_fops,
+                                                        &sstore_dev_array[i]);
+    }
+
+    //blobs kept after the last close can be given back to the kernel
+    if (retain) {
+        register_shrinker(&sstore_shrinker);
+        sstore_shrinking = 1;
+    }
+
+    //successful return
+    return 0;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * OPEN - this funciton is called when the device is opened in userspace (when
+ * the "file" /dev/sstore0 or /dev/sstore1 is opened, for example)
+ */
+
+int sstore_open(struct inode * inode, struct file * filp) {
+    struct sstore_dev * dev;
+    struct sstore_file * file;  //what this open file has of its own
+    int i = 0;
+
+    //DEBUG OUPUT
+    PDEBUG("\nIn sstore_open()");
+
+    //check that current process has root priveleges
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    //identify which device is being opened
+    dev = container_of(inode->i_cdev, struct sstore_dev, cdev);
+
+    file = kmalloc(sizeof (struct sstore_file) +
+                shards * SSTORE_WAIT_BUCKETS * sizeof (atomic_t), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    atomic_long_inc(&sstore_allocs.general);
+    file->dev = dev;
+    file->watching = NULL;
+    file->snapshots = NULL;
+    for (i = 0; i < shards * SSTORE_WAIT_BUCKETS; ++i)
+        atomic_set(&file->bucket_watches[i], 0);
+
+    //acquire mutex lock
+    if (down_interruptible(&dev->mutex)) {
+        kfree(file);
+        return -ERESTARTSYS;
+    }
+
+    ++dev->fd_count;
+    //DEBUG OUTPUT
+    PDEBUG("\nopen count in open = %d", dev->fd_count);
+    /*
+     * store this file's sstore_file struct in the private_data field so that
+     * calls to read, write, ioctl and poll--which will pass in the same file
+     * struct pointer--can get to the device (and the indices it watches).
+     */
+    filp->private_data = file;
+
+    //release mutex lock
+    up(&dev->mutex);
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * SHARDS.
+ *
+ * Every write (and delete) takes the mutex of the store it goes to, so with
+ * one store per device, writers on different CPUs all line up behind one
+ * semaphore.  The shards parameter spreads each device's indices over that
+ * many stores instead, each with a mutex of its own: index i lives in shard
+ * (i - 1) % shards, as index (i - 1) / shards + 1 there.  Neighbouring indices
+ * land in different shards, so writers working through a range of indices
+ * don't all hit the same one.  Reads never took a mutex, so they don't care.
+ *
+ * The catch is deleting.  A delete renumbers every blob after it, and with
+ * shards those are spread over every shard, so with more than one shard a
+ * delete just empties the index instead (see renumber in struct sstore).
+ * Batches take every shard's mutex (in order), since their descriptors can go
+ * anywhere.
+ */
+
+/*
+ * the shard that index of dev is in, or NULL if the index is out of range.
+ * *shard_index is set to the index in the shard.
+ */
+static struct sstore * sstore_shard(struct sstore_dev * dev, int index,
+                                                        int * shard_index) {
+    if (index > max_blobs || index <= 0)
+        return NULL;
+    *shard_index = (index - 1) / shards + 1;
+    return &dev->shards[(index - 1) % shards];
+}
+
+//the other way around: the index of dev that index of shard is
+static unsigned int sstore_dev_index(struct sstore_dev * dev,
+                                struct sstore * shard, unsigned int index) {
+    return (index - 1) * shards + (shard - dev->shards) + 1;
+}
+
+//the highest index written to on any shard of dev (the device's blob_count)
+static unsigned int sstore_dev_blob_count(struct sstore_dev * dev) {
+    unsigned int count = 0;
+    unsigned int blob_count = 0;
+    int i = 0;
+
+    for (i = 0; i < shards; ++i) {
+        blob_count = dev->shards[i].blob_count;
+        if (blob_count)
+            count = max(count,
+                        sstore_dev_index(dev, &dev->shards[i], blob_count));
+    }
+    return count;
+}
+
+//take the mutex of every shard of dev, in order.  0 or -ERESTARTSYS
+static int sstore_lock_shards(struct sstore_dev * dev) {
+    int locked = 0;     //shards whose mutex we hold
+
+    for (locked = 0; locked < shards; ++locked) {
+        if (sstore_lock(&dev->shards[locked]))
+            break;
+    }
+    if (locked == shards)
+        return 0;
+    while (locked--)
+        up(&dev->shards[locked].mutex);
+    return -ERESTARTSYS;
+}
+
+static void sstore_unlock_shards(struct sstore_dev * dev) {
+    int i = 0;
+
+    for (i = 0; i < shards; ++i)
+        up(&dev->shards[i].mutex);
+}
+
+/*
+ * the indices of shard that the device's indices first up to (not including)
+ * last map to: *shard_first up to (not including) *shard_last, which is an
+ * empty range if there aren't any.  Index i of the device is index
+ * (i - 1) / shards + 1 of shard (i - 1) % shards, so for shard k they're the
+ * ones from the first i >= first with (i - 1) % shards == k.
+ */
+static void sstore_shard_range(struct sstore_dev * dev, struct sstore * shard,
+        unsigned long first, unsigned long last, unsigned long * shard_first,
+                                                unsigned long * shard_last) {
+    unsigned long k = shard - dev->shards;
+
+    *shard_first = (first - 1 + shards - 1 - k) / shards + 1;
+    *shard_last = (last - 1 + shards - 1 - k) / shards + 1;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * PROC: sstore/data and sstore/data.bin files.
+ *
+ * These output the contents of every device's blob list.  Each index gets
+ * several records of the seq_file: the head (which device and blob, and for
+ * data.bin the size), then the blob's data SSTORE_DATA_PIECE bytes at a time,
+ * one piece per record.  A seq_file has to fit each record in its buffer all
+ * at once, growing the buffer until it does, so with a whole blob per record
+ * a big blob meant a buffer as big as it (a high order allocation that could
+ * fail); a piece always fits in the page it starts with.  The position in the
+ * file is the device, index and piece of the next record to output: each
+ * index has sstore_data_pieces() of them, each device (max_blobs + 1) times
+ * that, and index 0 is the device's own ("has no data").  The last record,
+ * after all the devices, is the allocation counts.  The seq_file code only
+ * asks for as many records as fit in what the reader wants, and picks up
+ * again at the next one on the next read(), so a huge store can be dumped a
+ * chunk at a time.
+ *
+ * No device's mutex is ever taken.  Each blob is looked up and held on to
+ * the same way read() does it (see sstore_blob_get()), so dumping the store
+ * doesn't hold up readers or writers at all.  The blob is held from the head
+ * of its record to its last piece (see sstore_data_hold()), so all of its
+ * pieces are of the same data.  The catch is that the dump isn't a snapshot:
+ * blobs written or deleted while it's going on may or may not be in it (but
+ * each blob that is in it is all there, as of some moment).
+ *
+ * data is text, the way this file has always been.  data.bin is for programs:
+ * it's just the blobs that have data, each one a struct sstore_dump_record
+ * (see sstore.h) followed by the blob's data, '\0's and all.
+ */
+#define SSTORE_DATA_PIECE (PAGE_SIZE / 2)  //blob data per record
+
+struct sstore_data_iter {
+    int binary;             //whether this is data.bin
+    struct sstore_dev * dev;    //the record's device (NULL for allocations)
+    unsigned int index;     //the blob index of the record (0 for the device)
+    unsigned int piece;     //which piece of the blob's record (0 for its head)
+    /*
+     * the blob being output (decompressed, with a reference), held from the
+     * head of its record to the end of its data, and whose it is.  size is
+     * how much of its data the record has.
+     */
+    struct blob * blob;
+    struct sstore_dev * blob_dev;
+    unsigned int blob_index;
+    unsigned int size;
+};
+
+static int sstore_data_open(struct inode * inode, struct file * file) {
+    struct sstore_data_iter * iter;
+
+    iter = seq_open_private(file, &sstore_data_seq_ops,
+                                            sizeof (struct sstore_data_iter));
+    return iter ? 0 : -ENOMEM;
+}
+
+static int sstore_data_open_binary(struct inode * inode, struct file * file) {
+    struct sstore_data_iter * iter;
+
+    iter = seq_open_private(file, &sstore_data_binary_seq_ops,
+                                            sizeof (struct sstore_data_iter));
+    if (!iter)
+        return -ENOMEM;
+    iter->binary = 1;
+    return 0;
+}
+
+static int sstore_data_release(struct inode * inode, struct file * file) {
+    struct seq_file * seq = file->private_data;
+    struct sstore_data_iter * iter = seq->private;
+
+    if (iter->blob)
+        sstore_blob_put(iter->blob);
+    return seq_release_private(inode, file);
+}
+
+//records for each index: the head of its record, then its data in pieces
+static u32 sstore_data_pieces(void) {
+    return DIV_ROUND_UP(max_size, SSTORE_DATA_PIECE) + 1;
+}
+
+/*
+ * have iter hold the blob at index of dev (or nothing, if there's no blob
+ * there) for piece of its record.  The head of a record (piece 0) always gets
+ * the blob there now, and the pieces after it keep the one the head was of,
+ * so a record is all of one blob, as of one moment, even though it's output
+ * over several show()s.  (A piece whose head wasn't just output, after an
+ * lseek(), gets the blob there now too.)  Returns 0 or -ENOMEM.
+ */
+static int sstore_data_hold(struct sstore_data_iter * iter,
+        struct sstore_dev * dev, unsigned int index, unsigned int piece) {
+    struct sstore * shard;  //the shard the index is in
+    int shard_index = 0;    //and its index there
+
+    if (piece && iter->blob_dev == dev && iter->blob_index == index)
+        return 0;
+    if (iter->blob)
+        sstore_blob_put(iter->blob);
+    iter->blob_dev = dev;
+    iter->blob_index = index;
+    shard = sstore_shard(dev, index, &shard_index);
+    iter->blob = shard ? sstore_blob_get(shard, shard_index) : NULL;
+    //compressed data has to be decompressed to be output
+    if (iter->blob && !(iter->blob = sstore_blob_expand(iter->blob))) {
+        iter->blob_dev = NULL;
+        return -ENOMEM;
+    }
+    iter->size = iter->blob ? sstore_blob_size(iter->blob) : 0;
+    return 0;
+}
+
+/*
+ * point the iterator at the record at *pos, or the first one after it that
+ * there's anything to output for (moving *pos along), or return NULL at the
+ * end of the file.  Indices past a device's blob_count are skipped in one go,
+ * and so are the pieces past the end of a blob's data.  data.bin skips
+ * everything but blobs with data.
+ */
+static void * sstore_data_find(struct seq_file * seq, loff_t * pos) {
+    struct sstore_data_iter * iter = seq->private;
+    struct sstore_dev * dev;
+    u32 pieces = sstore_data_pieces();  //records per index
+    u64 stride = (u64) (max_blobs + 1) * pieces;    //records per device
+    u64 record = 0;         //the record of the device *pos is
+    u32 piece = 0;
+    u32 index = 0;
+    u64 i = 0;
+    int error = 0;
+
+    for (;;) {
+        i = div64_u64(*pos, stride);
+        record = *pos - i * stride;
+        index = div_u64_rem(record, pieces, &piece);
+        //the allocation counts come after the last device (text only)
+        if (i == device_count && !record && !iter->binary) {
+            iter->dev = NULL;
+            return iter;
+        }
+        if (i >= device_count)
+            return NULL;
+
+        dev = &sstore_dev_array[i];
+        //(it's fine if blob_count changes while we look, see above)
+        if (index > sstore_dev_blob_count(dev)) {
+            *pos = (i + 1) * stride;
+            continue;
+        }
+        //the device's own record is one piece, and only in data
+        if (!index && (piece || iter->binary)) {
+            *pos = i * stride + pieces;
+            continue;
+        }
+
+        if (index) {
+            error = sstore_data_hold(iter, dev, index, piece);
+            if (error)
+                return ERR_PTR(error);
+            if ((!iter->blob && (piece || iter->binary)) || (piece > 1 &&
+                        (piece - 1) * SSTORE_DATA_PIECE >= iter->size)) {
+                *pos = i * stride + (u64) (index + 1) * pieces;
+                //there could be a lot of empty ones
+                cond_resched();
+                continue;
+            }
+        }
+
+        iter->dev = dev;
+        iter->index = index;
+        iter->piece = piece;
+        return iter;
+    }
+}
+
+static void * sstore_data_start(struct seq_file * seq, loff_t * pos) {
+    return sstore_data_find(seq, pos);
+}
+
+static void * sstore_data_next(struct seq_file * seq, void * v, loff_t * pos) {
+    ++*pos;
+    return sstore_data_find(seq, pos);
+}
+
+static void sstore_data_stop(struct seq_file * seq, void * v) {
+}
+
+static int sstore_data_show(struct seq_file * seq, void * v) {
+    struct sstore_data_iter * iter = v;
+    struct sstore_dev * dev = iter->dev;
+    unsigned int offset = 0;    //how much of the blob's data has been output
+    unsigned int end = 0;       //where this piece of it ends
+    unsigned int length = 0;    //bytes in the current chunk of it
+    char * data;                //where they are
+    unsigned int blob_count = 0;
+    int i = 0;
+
+    //output where blobs and their data have been allocated from
+    if (!dev) {
+        seq_printf(seq, "\nAllocations: %ld blob(s) from cache - ",
+                                    atomic_long_read(&sstore_allocs.blobs));
+        seq_printf(seq, "%ld data from size classes - ",
+                                    atomic_long_read(&sstore_allocs.junk));
+        seq_printf(seq, "%ld data from page pool - ",
+                                atomic_long_read(&sstore_allocs.pool_hits));
+        seq_printf(seq, "%ld data from page allocator - ",
+                                atomic_long_read(&sstore_allocs.pool_misses));
+        seq_printf(seq, "%ld general (kmalloc) - ",
+                                    atomic_long_read(&sstore_allocs.general));
+        seq_printf(seq, "%ld overwrite(s) in place\n",
+                                atomic_long_read(&sstore_allocs.in_place));
+        return 0;
+    }
+
+    i = dev - sstore_dev_array;
+    blob_count = sstore_dev_blob_count(dev);
+    //output "no data" message if nothing has been written to the device
+    if (!iter->index) {
+        if (!blob_count)
+            seq_printf(seq, "\nSstore Device %i has no data.\n", i);
+        return 0;
+    }
+
+    if (!iter->piece) {
+        seq_printf(seq, "\nSstore Device No. = %i", i);
+        seq_printf(seq, " - Blob No. = %i", iter->index);
+        seq_printf(seq, " - Data = ");
+        if (iter->blob) {
+            seq_printf(seq, "\"");
+            return 0;
+        }
+        seq_printf(seq, "NO DATA");
+    } else {
+        //the data is binary, so only as much of it as there is, by the chunk
+        offset = (iter->piece - 1) * SSTORE_DATA_PIECE;
+        end = min(offset + SSTORE_DATA_PIECE, iter->size);
+        for (; offset < end; offset += length) {
+            data = sstore_blob_data(iter->blob, offset, end, &length);
+            seq_printf(seq, "%.*s", (int) length, data);
+        }
+        if (end < iter->size)
+            return 0;
+        seq_printf(seq, "\"");
+    }
+    //output a newline for readablilty after the device's last blob
+    if (iter->index >= blob_count)
+        seq_printf(seq, "\n");
+
+    return 0;
+}
+
+static int sstore_data_show_binary(struct seq_file * seq, void * v) {
+    struct sstore_data_iter * iter = v;
+    struct sstore_dump_record record;
+    unsigned int offset = 0;    //how much of the blob has been written out
+    unsigned int end = 0;       //where this piece of it ends
+    unsigned int length = 0;    //bytes in the current chunk of it
+    char * data;                //where they are
+    int error = 0;
+
+    if (!iter->piece) {
+        record.device = iter->dev - sstore_dev_array;
+        record.index = iter->index;
+        record.size = iter->size;
+        sstore_seq_write(seq, &record, sizeof (struct sstore_dump_record));
+        return 0;
+    }
+
+    offset = (iter->piece - 1) * SSTORE_DATA_PIECE;
+    end = min(offset + SSTORE_DATA_PIECE, iter->size);
+    for (; !error && offset < end; offset += length) {
+        data = sstore_blob_data(iter->blob, offset, end, &length);
+        error = sstore_seq_write(seq, data, length);
+    }
+
+    return 0;
+}
+
+/*
+ * put size bytes of binary data in the seq_file's buffer (seq_printf() stops
+ * at the first '\0').  Returns 0, or -1 if it doesn't fit, in which case the
+ * buffer is marked full the same way seq_printf() does it, so the seq_file
+ * code gets a bigger buffer and calls show() again.
+ */
+static int sstore_seq_write(struct seq_file * seq, const void * data,
+                                                            size_t size) {
+    if (seq->count + size < seq->size) {
+        memcpy(seq->buf + seq->count, data, size);
+        seq->count += size;
+        return 0;
+    }
+    seq->count = seq->size;
+    return -1;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * PROC: sstore/image<N> files.
+ *
+ * These output an image of device N (see struct sstore_image_header in
+ * sstore.h) for saving it, to be loaded back with SSTORE_IOCTL_RESTORE.  They
+ * aren't seq_files, since a seq_file has to fit a whole record in its buffer,
+ * and a blob can be megabytes: read() copies straight from the blobs to the
+ * reader, a chunk at a time, and picks up where it left off on the next
+ * read(), in the middle of a blob if it has to.
+ *
+ * No mutex is taken, the same as data.bin.  The blob being output is held on
+ * to (with a reference, like read() does) from its record header to the end of
+ * its data, however many read()s that takes, so each record is of one blob as
+ * of one moment: a write to its index meanwhile puts a new blob there instead
+ * of changing this one, and an append can't change the size already given.
+ */
+struct sstore_image_iter {
+    struct sstore_dev * dev;    //the device the image is of
+    unsigned int index;         //index of the last blob looked at
+    char head[sizeof (struct sstore_image_header)]; //header being output
+    unsigned int head_size;     //bytes in head
+    unsigned int head_done;     //bytes of it already output
+    struct blob * blob;         //the blob whose data is being output
+    unsigned int size;          //bytes of it in its record
+    unsigned int done;          //bytes of it already output
+    int ended;                  //whether the end record has been made
+};
+
+static int sstore_image_open(struct inode * inode, struct file * file) {
+    struct sstore_image_iter * iter;
+    struct sstore_image_header header;
+
+    iter = kzalloc(sizeof (struct sstore_image_iter), GFP_KERNEL);
+    if (!iter)
+        return -ENOMEM;
+    atomic_long_inc(&sstore_allocs.general);
+    iter->dev = PDE(inode)->data;
+
+    //the image header comes first
+    header.magic = SSTORE_IMAGE_MAGIC;
+    header.format = SSTORE_IMAGE_FORMAT;
+    header.max_blobs = max_blobs;
+    header.max_size = max_size;
+    memcpy(iter->head, &header, sizeof (struct sstore_image_header));
+    iter->head_size = sizeof (struct sstore_image_header);
+
+    file->private_data = iter;
+    return 0;
+}
+
+/*
+ * move on to the record of the next blob with data after iter->index (taking
+ * a reference to it, and decompressing it if it's compressed), or the end
+ * record if there are no more.  Returns 0, 1 when the end record is already
+ * out, or -ENOMEM.
+ */
+static int sstore_image_next(struct sstore_image_iter * iter) {
+    struct sstore_image_record record;
+    struct sstore * shard;      //the shard an index is in
+    int shard_index = 0;        //and its index there
+    unsigned int blob_count = sstore_dev_blob_count(iter->dev);
+
+    if (iter->blob)
+        sstore_blob_put(iter->blob);
+    iter->blob = NULL;
+    iter->size = 0;
+    iter->done = 0;
+    if (iter->ended)
+        return 1;
+
+    while (!iter->blob && iter->index < blob_count) {
+        ++iter->index;
+        shard = sstore_shard(iter->dev, iter->index, &shard_index);
+        iter->blob = shard ? sstore_blob_get(shard, shard_index) : NULL;
+        if (iter->blob && !(iter->blob = sstore_blob_expand(iter->blob))) {
+            //so the next read tries this one again
+            --iter->index;
+            return -ENOMEM;
+        }
+        //there could be a lot of empty ones
+        if (!(iter->index % 1024))
+            cond_resched();
+    }
+
+    if (iter->blob) {
+        iter->size = sstore_blob_size(iter->blob);
+        record.index = iter->index;
+        record.size = iter->size;
+    } else {
+        record.index = 0;
+        record.size = 0;
+        iter->ended = 1;
+    }
+    memcpy(iter->head, &record, sizeof (struct sstore_image_record));
+    iter->head_size = sizeof (struct sstore_image_record);
+    iter->head_done = 0;
+    return 0;
+}
+
+static ssize_t sstore_image_read(struct file * file, char __user * user,
+                                            size_t size, loff_t * offset) {
+    struct sstore_image_iter * iter = file->private_data;
+    size_t copied = 0;          //bytes given to the reader so far
+    unsigned int length = 0;    //bytes to copy this time around
+    char * data;                //where they are
+    int error = 0;
+
+    while (copied < size) {
+        if (iter->head_done < iter->head_size) {
+            //what's left of a header
+            data = iter->head + iter->head_done;
+            length = iter->head_size - iter->head_done;
+        } else if (iter->done < iter->size) {
+            //what's left of the blob, a chunk at a time
+            data = sstore_blob_data(iter->blob, iter->done, iter->size,
+                                                                    &length);
+        } else if ((error = sstore_image_next(iter))) {
+            if (error < 0 && !copied)
+                return error;
+            break;
+        } else
+            continue;
+
+        length = min((size_t) length, size - copied);
+        if (copy_to_user(user + copied, data, length))
+            return copied ? copied : -EFAULT;
+        if (iter->head_done < iter->head_size)
+            iter->head_done += length;
+        else
+            iter->done += length;
+        copied += length;
+    }
+
+    *offset += copied;
+    return copied;
+}
+
+static int sstore_image_release(struct inode * inode, struct file * file) {
+    struct sstore_image_iter * iter = file->private_data;
+
+    if (iter->blob)
+        sstore_blob_put(iter->blob);
+    kfree(iter);
+    return 0;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * PROC: sstore/stats file.
+ *
+ * This file outputs statistics of each device, such as a count of open
+ * device file descriptors, how many reads, writes and deletes it has done and
+ * how many bytes they moved, and a log2 histogram of how long each kind of
+ * operation (and waiting for blobs, and for the mutex) took.  The operation
+ * stats are kept per CPU (see struct sstore_cpu_stats in sstore_core.h) and
+ * added up here, over all of the device's shards.  Each device is one step of
+ * the seq_file, with a line for each of its shards.
+ */
+static int sstore_stats_open(struct inode * inode, struct file * file) {
+    return seq_open(file, &sstore_stats_seq_ops);
+}
+
+static void * sstore_stats_start(struct seq_file * seq, loff_t * pos) {
+    if (*pos >= device_count)
+        return NULL;
+    return &sstore_dev_array[*pos];
+}
+
+static void * sstore_stats_next(struct seq_file * seq, void * v, loff_t * pos) {
+    ++*pos;
+    return sstore_stats_start(seq, pos);
+}
+
+static void sstore_stats_stop(struct seq_file * seq, void * v) {
+}
+
+static int sstore_stats_show(struct seq_file * seq, void * v) {
+    struct sstore_dev * dev = v;
+    struct sstore * shard;
+    struct sstore_cpu_stats * total;    //every CPU's stats added up
+    unsigned long ratio = 0;            //how well compression did
+    unsigned long shares = 0;           //writes that went through sharing
+    int op = 0;
+    int i = 0;
+
+    //it's too big for the stack
+    total = kmalloc(sizeof (struct sstore_cpu_stats), GFP_KERNEL);
+    if (!total)
+        return -ENOMEM;
+    memset(total, 0, sizeof (struct sstore_cpu_stats));
+    for (i = 0; i < shards; ++i)
+        sstore_stats_sum(&dev->shards[i], total);
+
+    //acquire mutex lock on device
+    if (down_interruptible(&dev->mutex)) {
+        kfree(total);
+        return -ERESTARTSYS;
+    }
+    //output number of open file descriptors for device
+    seq_printf(seq, "\nSstore Device %i: ", (int) (dev - sstore_dev_array));
+    seq_printf(seq, "%i open store(s) - ", dev->fd_count);
+    //release mutex lock
+    up(&dev->mutex);
+    //output number of blobs in the device's blob list
+    seq_printf(seq, "%i blobs - %i shard(s)\n", sstore_dev_blob_count(dev),
+                                                                    shards);
+
+    for (i = 0; i < shards; ++i) {
+        shard = &dev->shards[i];
+        //acquire mutex lock on shard
+        if (down_interruptible(&shard->mutex)) {
+            kfree(total);
+            return -ERESTARTSYS;
+        }
+        seq_printf(seq, "  shard %i: %i blobs - ", i, shard->blob_count);
+        //output how much data it holds, and how much it's allowed
+        seq_printf(seq, "%lu byte(s) of data", shard->bytes);
+        if (shard->budget)
+            seq_printf(seq, " (budget %lu)", shard->budget);
+        seq_printf(seq, " - ");
+        //output whether it compresses
+        if (shard->compress_min)
+            seq_printf(seq, "compressing blobs of %u+ bytes - ",
+                                                        shard->compress_min);
+        //output the snapshots, and how many indices they've had to keep
+        if (shard->snapshots)
+            seq_printf(seq, "%u snapshot(s) keeping %lu index(es) - ",
+                                shard->snapshot_count, shard->kept_count);
+        //output how much data is shared, and how much that saves
+        if (shard->shares)
+            seq_printf(seq, "%u piece(s) of shared data, saving %lu "
+                            "byte(s) - ",
+                                shard->share_count, shard->shared_bytes);
+        //output the keys, and how big their table is
+        if (shard->keys)
+            seq_printf(seq, "%u key(s) in %u buckets%s - ", shard->key_count,
+                            shard->keys->mask + 1,
+                            shard->old_keys ? " (growing)" : "");
+        //output the index (of the device) of the last blob used
+        if (shard->seek_index)
+            seq_printf(seq, "seek pointer is at index %i",
+                            sstore_dev_index(dev, shard, shard->seek_index));
+        else
+            seq_printf(seq, "seek pointer is NULL");
+        //release mutex lock
+        up(&shard->mutex);
+
+        //output how well the wait buckets are keeping readers asleep
+        seq_printf(seq, " - %i reader(s) waiting",
+                atomic_read(&shard->waiters) - atomic_read(&shard->watches));
+        seq_printf(seq, " - %i index(es) watched",
+                                            atomic_read(&shard->watches));
+        seq_printf(seq, " - %lu wakeups avoided", shard->wakeups_avoided);
+        seq_printf(seq, " - %i spurious wakeups",
+                                        atomic_read(&shard->spurious_wakeups));
+        //output how timed reads are doing
+        seq_printf(seq, " - %i timeouts", atomic_read(&shard->timeouts));
+        seq_printf(seq, " - spins: %i hits, %i misses, %ius now\n",
+                    atomic_read(&shard->spin_hits),
+                    atomic_read(&shard->spin_misses),
+                    atomic_read(&shard->spin_usecs));
+    }
+
+    //output the operation counters
+    seq_printf(seq, "  %lu read(s), %lu write(s), %lu delete(s), "
+                    "%lu blocked read(s)\n",
+                    total->ops[SSTORE_OP_READ], total->ops[SSTORE_OP_WRITE],
+                    total->ops[SSTORE_OP_DELETE], total->ops[SSTORE_OP_WAIT]);
+    seq_printf(seq, "  %lu byte(s) in, %lu byte(s) out, %lu wakeup(s), "
+                    "%lu restart(s)\n",
+                    total->count[SSTORE_BYTES_IN],
+                    total->count[SSTORE_BYTES_OUT],
+                    total->count[SSTORE_WAKEUPS],
+                    total->count[SSTORE_RESTARTS]);
+    seq_printf(seq, "  %lu unchanged conditional read(s), "
+                    "%lu conflicting conditional write(s)\n",
+                    total->count[SSTORE_UNCHANGED],
+                    total->count[SSTORE_CONFLICTS]);
+    seq_printf(seq, "  %lu blob(s) evicted for the budget, "
+                    "%lu for the kernel\n",
+                    total->count[SSTORE_EVICTIONS],
+                    total->count[SSTORE_RECLAIMS]);
+    //the ratio is in hundredths, since there's no floating point in here
+    ratio = total->count[SSTORE_PACKED_OUT] ?
+                    total->count[SSTORE_PACKED_IN] * 100 /
+                    total->count[SSTORE_PACKED_OUT] : 0;
+    seq_printf(seq, "  %lu byte(s) compressed to %lu (ratio %lu.%02lu), "
+                    "%lu incompressible write(s)\n",
+                    total->count[SSTORE_PACKED_IN],
+                    total->count[SSTORE_PACKED_OUT], ratio / 100, ratio % 100,
+                    total->count[SSTORE_INCOMPRESSIBLE]);
+    shares = total->count[SSTORE_SHARE_HITS] +
+                                        total->count[SSTORE_SHARE_MISSES];
+    seq_printf(seq, "  %lu write(s) shared data already there, %lu didn't "
+                    "(hit rate %lu%%)\n",
+                    total->count[SSTORE_SHARE_HITS],
+                    total->count[SSTORE_SHARE_MISSES],
+                    shares ? total->count[SSTORE_SHARE_HITS] * 100 / shares :
+                                                                        0UL);
+
+    //output a histogram of each kind of operation that has happened
+    for (op = 0; op < SSTORE_OPS; ++op) {
+        if (!total->ops[op])
+            continue;
+        seq_printf(seq, "  %s latency (ns): %lu op(s), average %llu\n",
+                sstore_op_names[op], total->ops[op],
+                (unsigned long long) div64_u64(total->nsecs[op],
+                                                            total->ops[op]));
+        for (i = 0; i < SSTORE_HIST_BUCKETS; ++i) {
+            if (!total->hist[op][i])
+                continue;
+            //bucket i starts at 2^(i-1) nanoseconds (0 is just 0)
+            seq_printf(seq, "    >= %-12llu %lu\n",
+                                        i ? 1ULL << (i - 1) : 0ULL,
+                                        total->hist[op][i]);
+        }
+    }
+
+    kfree(total);
+    return 0;
+}
+
+//---------------------------------------------------------------------------
+
+
+/*
+ * how long reads of the file wait for a blob: not at all if it was opened
+ * with O_NONBLOCK, otherwise for as long as it takes.
+ */
+static long sstore_timeout(struct file * filp) {
+    return (filp->f_flags & O_NONBLOCK) ? 0 : MAX_SCHEDULE_TIMEOUT;
+}
+
+/*
+ * read part of the blob at index of shard for read() and the range reads:
+ * from the file's snapshot, if it has one (see SNAPSHOT IOCTL), which never
+ * waits, otherwise like sstore_read_blob() does.
+ *
+ * The snapshot pointer is published with rcu_assign_pointer() while other
+ * threads may be reading the file, so it's picked up under rcu_read_lock().
+ * The lock isn't held for the read itself (which can sleep copying to the
+ * user): once a file has snapshots, they stay until it's released, and
+ * nobody can be reading it by then.
+ */
+static ssize_t sstore_file_read(struct sstore_file * file,
+                struct sstore * shard, int index, int offset, int size,
+                char __user * data, long timeout, unsigned int spin) {
+    struct sstore_snapshot ** snapshots;
+
+    rcu_read_lock();
+    snapshots = rcu_dereference(file->snapshots);
+    rcu_read_unlock();
+
+    if (snapshots)
+        return sstore_snapshot_read(shard, snapshots[shard - file->dev->shards],
+                                                index, offset, size, data);
+    return sstore_read_blob(shard, index, offset, size, data, timeout, spin);
+}
+
+/*
+ * READ.  The loff_t * file_position and size_t count arguments are ignored.
+ *
+ * This function will return data to the user even if there wasn't enough to
+ * satisfy the amount requested.  In that case, all of the data in the blob
+ * will be copied back to user.  If there is no data at all to be read, or if
+ * there is no blob at the desired index, then it will wait (sleep) until data
+ * is available there--unless the file was opened with O_NONBLOCK, in which
+ * case it returns -EAGAIN instead.
+ */
+ssize_t sstore_read(struct file * filp, char __user * buffer, size_t count,
+                                                    loff_t * file_position) {
+    struct sstore_file * file = filp->private_data;
+    struct sstore * shard;      //the shard of the device the index is in
+    int index = 0;              //and its index there
+    struct user_buffer u_buf;   //char __user * buffer gets copied into here
+    int error = 0;              //used for detecting error return values
+    ssize_t bytes_read = 0;     //the amount actually read (sent back to user)
+
+
+    //DEBUG OUTPUT
+    PDEBUG("\nIn sstore read()");
+
+    /*
+     * copy contents of user buffer (a struct of the same form) into u_buf
+     * struct.  It's small enough to live on the stack, so there's nothing to
+     * allocate.
+     */
+    error = copy_from_user(&u_buf, buffer, sizeof (struct user_buffer));
+    if (error) {
+        //DEBUG OUTPUT
+        PDEBUG("\nError in copying buffer from user in read()\n");
+        return -EFAULT;
+    }
+    //DEBUG OUTPUT
+    PDEBUG("\nrequested index in read = %d", u_buf.index);
+    //DEBUG OUTPUT
+    PDEBUG("\nrequested size of data in read = %d", u_buf.size);
+
+    shard = sstore_shard(file->dev, u_buf.index, &index);
+    if (!shard)
+        return -EINVAL;
+
+    //read the blob, waiting for one if there isn't one yet (see sstore_core.c)
+    bytes_read = sstore_file_read(file, shard, index, 0, u_buf.size,
+                                        u_buf.data, sstore_timeout(filp), 0);
+
+    //tell the user how many bytes were read (or the error)
+    return bytes_read;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * WRITE.  The loff_t * file_position and size_t count arguments are ignored.
+ *
+ * This function will store a new blob at the given index (as long as the index
+ * is not beyond max_blobs of course).  If there is data already in a blob at
+ * the given index, that blob is replaced by a new blob with the data to be
+ * written, and the previous blob is freed.  The data can be anything (it
+ * doesn't have to be a '\0' terminated string), the blob remembers its size.
+ */
+ssize_t sstore_write(struct file * filp, const char __user * buffer,
+                                        size_t count, loff_t * file_position) {
+    struct sstore_file * file = filp->private_data;
+    struct sstore * shard;      //the shard of the device the index is in
+    int index = 0;              //and its index there
+    struct user_buffer u_buf;   //char __user * buffer get copied into here
+    int error = 0;              //used for detecting error return values
+    ssize_t bytes_written = 0;  //the amount actually written
+
+
+    //DEBUG OUTPUT
+    PDEBUG("\nIn sstore write()");
+
+    /*
+     * copy contents of user buffer (a struct of the same form) into u_buf
+     * struct.  It's small enough to live on the stack, so there's nothing to
+     * allocate.
+     */
+    error = copy_from_user(&u_buf, buffer, sizeof (struct user_buffer));
+    if (error) {
+        //DEBUG OUTPUT
+        PDEBUG("\nError in copying buffer from user in write()\n");
+        return -EFAULT;
+    }
+    //DEBUG OUTPUT
+    PDEBUG("\nrequested index in write = %d", u_buf.index);
+    //DEBUG OUTPUT
+    PDEBUG("\nrequested size of data in write = %d", u_buf.size);
+
+    shard = sstore_shard(file->dev, u_buf.index, &index);
+    if (!shard)
+        return -EINVAL;
+
+    //acquire mutex lock (of just that shard)
+    if (sstore_lock(shard))
+        return -ERESTARTSYS;
+
+    bytes_written = sstore_do_write(shard, index, u_buf.size, u_buf.data);
+
+    //release mutex lock
+    up(&shard->mutex);
+
+    //return the number of bytes written to the user (or the error)
+    return bytes_written;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * BATCH IOCTL.
+ *
+ * Runs every descriptor of a struct sstore_batch (see sstore.h) with one trip
+ * into the driver, one kmalloc() of the descriptors and one acquisition of the
+ * device's mutex (of each of its shards, in order, since the descriptors can
+ * go to any of them), instead of one of each per blob.  The status of each
+ * descriptor is what read(), write() or ioctl() delete would have returned for
+ * it, except that a read of an index with no blob gives -EAGAIN instead of
+ * waiting (we'd be waiting with the mutex held).  One descriptor failing
+ * doesn't stop the others from running.
+ */
+static long sstore_ioctl_batch(struct sstore_dev * dev,
+                                        struct sstore_batch __user * arg) {
+    struct sstore_batch batch;      //the user's batch header
+    struct sstore_batch_op * ops;   //the descriptors, copied in from the user
+    int * status;                   //the status of each descriptor
+    struct sstore * shard;          //the shard a descriptor's index is in
+    int index = 0;                  //and its index there
+    unsigned int i = 0;
+    long error = 0;
+
+    if (copy_from_user(&batch, arg, sizeof (struct sstore_batch)))
+        return -EFAULT;
+    if (batch.count == 0)
+        return 0;
+    if (batch.count > SSTORE_BATCH_MAX)
+        return -EINVAL;
+
+    //one allocation for both the descriptors and their status
+    atomic_long_inc(&sstore_allocs.general);
+    ops = kmalloc(batch.count * (sizeof (struct sstore_batch_op) + sizeof (int)),
+                                                                GFP_KERNEL);
+    if (!ops)
+        return -ENOMEM;
+    status = (int *) (ops + batch.count);
+    if (copy_from_user(ops, batch.ops,
+                            batch.count * sizeof (struct sstore_batch_op))) {
+        kfree(ops);
+        return -EFAULT;
+    }
+
+    //acquire mutex locks
+    if (sstore_lock_shards(dev)) {
+        kfree(ops);
+        return -ERESTARTSYS;
+    }
+
+    for (i = 0; i < batch.count; ++i) {
+        shard = sstore_shard(dev, ops[i].index, &index);
+        if (!shard) {
+            status[i] = -EINVAL;
+            continue;
+        }
+        switch (ops[i].op) {
+            case SSTORE_BATCH_READ:
+                status[i] = sstore_do_read(shard, index, 0, ops[i].size,
+                                                                ops[i].data);
+                break;
+            case SSTORE_BATCH_WRITE:
+                status[i] = sstore_do_write(shard, index, ops[i].size,
+                                                                ops[i].data);
+                break;
+            case SSTORE_BATCH_DELETE:
+                status[i] = sstore_do_delete(shard, index);
+                break;
+            case SSTORE_BATCH_PUNCH:
+                status[i] = sstore_do_punch(shard, index, index + 1);
+                break;
+            default:
+                status[i] = -EINVAL;
+        }
+    }
+
+    //release mutex locks
+    sstore_unlock_shards(dev);
+
+    if (copy_to_user(batch.status, status, batch.count * sizeof (int)))
+        error = -EFAULT;
+    kfree(ops);
+
+    return error;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * KEY IOCTLS.
+ *
+ * SSTORE_IOCTL_KEY_READ, SSTORE_IOCTL_KEY_WRITE and SSTORE_IOCTL_KEY_DELETE
+ * (see struct sstore_key_op in sstore.h).  The key is copied in and hashed
+ * once, and the hash picks both the shard and, in there, the bucket of the
+ * shard's key table (see KEYS in sstore_core.c).  The shard comes from the
+ * top bits of the hash and the bucket from the bottom ones, so the keys of a
+ * shard still spread over all of its buckets.  Reads don't take a mutex,
+ * writes and deletes take the shard's.
+ */
+static long sstore_ioctl_key(struct sstore_dev * dev, unsigned int command,
+                                            struct sstore_key_op __user * arg) {
+    struct sstore_key_op op;        //the user's key operation
+    char key[SSTORE_KEY_MAX];       //the key, copied in
+    struct sstore * shard;          //the shard the key is in
+    u32 hash = 0;
+    long error = 0;
+
+    if (copy_from_user(&op, arg, sizeof (struct sstore_key_op)))
+        return -EFAULT;
+    if (!op.key_size || op.key_size > SSTORE_KEY_MAX)
+        return -EINVAL;
+    if (copy_from_user(key, op.key, op.key_size))
+        return -EFAULT;
+    hash = sstore_key_hash(key, op.key_size);
+    shard = &dev->shards[((u64) hash * shards) >> 32];
+
+    if (command == SSTORE_IOCTL_KEY_READ)
+        return sstore_key_read(shard, key, op.key_size, hash, op.size,
+                                                                    op.data);
+
+    //acquire mutex lock
+    if (sstore_lock(shard))
+        return -ERESTARTSYS;
+
+    if (command == SSTORE_IOCTL_KEY_WRITE)
+        error = sstore_key_write(shard, key, op.key_size, hash, op.size,
+                                                                    op.data);
+    else
+        error = sstore_key_delete(shard, key, op.key_size, hash);
+
+    //release mutex lock
+    up(&shard->mutex);
+
+    return error;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * RANGE DELETE and CLEAR IOCTLS.
+ *
+ * SSTORE_IOCTL_DELETE_RANGE punches holes at a range of indices (see
+ * sstore_do_punch() in sstore_core.c), a shard at a time, so it costs the size
+ * of the range and nothing more.  It's not all done at once: a reader can see
+ * some of the range deleted and some not yet.  SSTORE_IOCTL_CLEAR deletes
+ * every blob and key of the device, with every shard's mutex held.
+ */
+static long sstore_ioctl_delete_range(struct sstore_dev * dev,
+                                    struct sstore_delete_range __user * arg) {
+    struct sstore_delete_range range;   //the user's range
+    struct sstore * shard;
+    unsigned long first = 0;    //the range, in the shard's indices
+    unsigned long last = 0;
+    int i = 0;
+    int error = 0;
+
+    if (copy_from_user(&range, arg, sizeof (struct sstore_delete_range)))
+        return -EFAULT;
+    if (range.first <= 0 || range.last <= range.first ||
+                                                range.last > max_blobs + 1)
+        return -EINVAL;
+
+    for (i = 0; i < shards && !error; ++i) {
+        shard = &dev->shards[i];
+        sstore_shard_range(dev, shard, range.first, range.last, &first, &last);
+        if (first >= last)
+            continue;
+        //acquire mutex lock
+        if (sstore_lock(shard))
+            return -ERESTARTSYS;
+        error = sstore_do_punch(shard, first, last);
+        //release mutex lock
+        up(&shard->mutex);
+    }
+
+    return error;
+}
+
+static long sstore_ioctl_clear(struct sstore_dev * dev) {
+    int i = 0;
+
+    //acquire mutex locks
+    if (sstore_lock_shards(dev))
+        return -ERESTARTSYS;
+
+    /*
+     * a clear doesn't keep anything for snapshots, so not while there are
+     * any (every snapshot is of every shard, so shard 0 has them all)
+     */
+    if (dev->shards[0].snapshots) {
+        sstore_unlock_shards(dev);
+        return -EBUSY;
+    }
+    for (i = 0; i < shards; ++i)
+        sstore_device_clear(&dev->shards[i]);
+
+    //release mutex locks
+    sstore_unlock_shards(dev);
+
+    return 0;
+}
+
+/*
+ * SSTORE_IOCTL_COMPRESS.  Sets the size from which every shard of the device
+ * compresses what's written to it (see COMPRESSION in sstore_core.c), with
+ * all of their mutexes held so a write can't be halfway through with the old
+ * one.  Thresholds over SSTORE_COMPRESS_MAX would never compress anything, so
+ * they're turned away.
+ */
+static long sstore_ioctl_compress(struct sstore_dev * dev,
+                                            unsigned long threshold) {
+    long error = 0;
+    int i = 0;
+
+    if (threshold > SSTORE_COMPRESS_MAX)
+        return -EINVAL;
+
+    //acquire mutex locks
+    if (sstore_lock_shards(dev))
+        return -ERESTARTSYS;
+
+    for (i = 0; i < shards && !error; ++i)
+        error = sstore_set_compression(&dev->shards[i], threshold);
+
+    //release mutex locks
+    sstore_unlock_shards(dev);
+
+    return error;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * VERSIONED IOCTLS.
+ *
+ * SSTORE_IOCTL_WRITE_IF and SSTORE_IOCTL_READ_IF_CHANGED (see struct
+ * sstore_versioned in sstore.h, and VERSIONS in sstore_core.c).  The
+ * conditional write checks the version and writes with the shard's mutex
+ * held, so nothing can get written in between.  The conditional read doesn't
+ * take it, and when the blob hasn't changed all it costs is the lookup.
+ */
+static long sstore_ioctl_versioned(struct sstore_dev * dev,
+                unsigned int command, struct sstore_versioned __user * arg) {
+    struct sstore_versioned op;     //the user's versioned operation
+    struct sstore * shard;          //the shard the index is in
+    int index = 0;                  //and its index there
+    u64 version = 0;
+    long result = 0;
+
+    if (copy_from_user(&op, arg, sizeof (struct sstore_versioned)))
+        return -EFAULT;
+    shard = sstore_shard(dev, op.buffer.index, &index);
+    if (!shard)
+        return -EINVAL;
+    version = op.version;
+
+    if (command == SSTORE_IOCTL_READ_IF_CHANGED)
+        result = sstore_do_read_if(shard, index, op.buffer.size,
+                                                    op.buffer.data, &version);
+    else {
+        //acquire mutex lock
+        if (sstore_lock(shard))
+            return -ERESTARTSYS;
+
+        result = sstore_do_write_if(shard, index, op.buffer.size,
+                                                    op.buffer.data, &version);
+
+        //release mutex lock
+        up(&shard->mutex);
+    }
+
+    //let the caller know which version it has now (or which one is there)
+    op.version = version;
+    if (copy_to_user(&arg->version, &op.version, sizeof (op.version)))
+        return -EFAULT;
+    return result;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * RESTORE IOCTL.
+ *
+ * SSTORE_IOCTL_RESTORE loads an image from /proc/sstore/image<N> back into a
+ * device (see struct sstore_restore in sstore.h).  Every shard's mutex is
+ * taken once for the whole image, instead of once a write, and each blob is
+ * copied straight from the image into its new blob, so restoring runs about
+ * as fast as the data can be copied.
+ */
+static long sstore_ioctl_restore(struct sstore_dev * dev,
+                                        struct sstore_restore __user * arg) {
+    struct sstore_restore restore;          //the user's image
+    struct sstore_image_header header;
+    struct sstore_image_record record;
+    const char __user * image;  //the next record of the image
+    unsigned long left = 0;     //bytes of the image from there on
+    struct sstore * shard;      //the shard a blob goes in
+    int index = 0;              //and its index there
+    long restored = 0;          //blobs restored
+    long error = 0;
+
+    if (copy_from_user(&restore, arg, sizeof (struct sstore_restore)))
+        return -EFAULT;
+    if (restore.size < sizeof (struct sstore_image_header))
+        return -EINVAL;
+    if (copy_from_user(&header, restore.image,
+                                        sizeof (struct sstore_image_header)))
+        return -EFAULT;
+    if (header.magic != SSTORE_IMAGE_MAGIC ||
+                                        header.format != SSTORE_IMAGE_FORMAT)
+        return -EINVAL;
+    image = restore.image + sizeof (struct sstore_image_header);
+    left = restore.size - sizeof (struct sstore_image_header);
+
+    //acquire mutex locks
+    if (sstore_lock_shards(dev))
+        return -ERESTARTSYS;
+
+    while (left && !error) {
+        if (left < sizeof (struct sstore_image_record)) {
+            error = -EINVAL;
+            break;
+        }
+        if (copy_from_user(&record, image,
+                                        sizeof (struct sstore_image_record))) {
+            error = -EFAULT;
+            break;
+        }
+        image += sizeof (struct sstore_image_record);
+        left -= sizeof (struct sstore_image_record);
+        //the end of the image
+        if (!record.index)
+            break;
+
+        shard = sstore_shard(dev, record.index, &index);
+        if (!shard || !record.size || record.size > max_size ||
+                                                        record.size > left) {
+            error = -EINVAL;
+            break;
+        }
+        error = sstore_do_write(shard, index, record.size, image);
+        if (error >= 0) {
+            error = 0;
+            ++restored;
+        }
+        image += record.size;
+        left -= record.size;
+    }
+
+    //release mutex locks
+    sstore_unlock_shards(dev);
+
+    return error ? error : restored;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * SNAPSHOT IOCTL.
+ *
+ * SSTORE_IOCTL_SNAPSHOT takes a snapshot of the device for the file (see
+ * SNAPSHOTS in sstore_core.c).  From then on, read(), SSTORE_IOCTL_READ_RANGE
+ * and SSTORE_IOCTL_READ_TIMED through the file read the device's indices as
+ * they were at that moment, while writes (through this file or any other) go
+ * on changing the device.  Every shard's mutex is held while their snapshots
+ * are taken, so they're all of the same moment, but that's only as long as it
+ * takes to note each shard's version.  The file keeps its snapshot until it's
+ * closed, so nothing reading through it can have it dropped out from under
+ * it.  A file that already has one gets -EBUSY (open the device again for a
+ * newer one).
+ */
+static long sstore_ioctl_snapshot(struct sstore_file * file) {
+    struct sstore_dev * dev = file->dev;
+    struct sstore_snapshot ** snapshots;    //one for each shard
+    int taken = 0;              //shards snapshots have been taken of
+    long error = 0;
+
+    snapshots = kmalloc(shards * sizeof (struct sstore_snapshot *),
+                                                                GFP_KERNEL);
+    if (!snapshots)
+        return -ENOMEM;
+    atomic_long_inc(&sstore_allocs.general);
+
+    //acquire mutex locks
+    if (sstore_lock_shards(dev)) {
+        kfree(snapshots);
+        return -ERESTARTSYS;
+    }
+
+    if (file->snapshots)
+        error = -EBUSY;
+    while (!error && taken < shards) {
+        snapshots[taken] = sstore_snapshot_take(&dev->shards[taken]);
+        if (snapshots[taken])
+            ++taken;
+        else
+            error = -ENOMEM;
+    }
+    if (error) {
+        while (taken--)
+            sstore_snapshot_drop(&dev->shards[taken], snapshots[taken]);
+        kfree(snapshots);
+    } else {
+        //the snapshots have to be there before reads of the file find them
+        rcu_assign_pointer(file->snapshots, snapshots);
+    }
+
+    //release mutex locks
+    sstore_unlock_shards(dev);
+
+    return error;
+}
+
+//drop the file's snapshot of every shard (when it's closed)
+static void sstore_snapshots_drop(struct sstore_file * file) {
+    struct sstore * shard;
+    int i = 0;
+
+    for (i = 0; i < shards; ++i) {
+        shard = &file->dev->shards[i];
+        //acquire mutex lock
+        down(&shard->mutex);
+        sstore_snapshot_drop(shard, file->snapshots[i]);
+        //release mutex lock
+        up(&shard->mutex);
+    }
+    kfree(file->snapshots);
+    file->snapshots = NULL;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * IOCTL.
+ *
+ * SSTORE_IOCTL_DELETE deletes a blob at an index specified by arg,
+ * SSTORE_IOCTL_BATCH runs a batch of reads, writes and deletes (arg points to
+ * a struct sstore_batch), SSTORE_IOCTL_READ_RANGE reads part of a blob (arg
+ * points to a struct sstore_range, and it returns what read() would),
+ * SSTORE_IOCTL_READ_TIMED does the same but gives up after a while (arg points
+ * to a struct sstore_timed_read), and SSTORE_IOCTL_WATCH, SSTORE_IOCTL_UNWATCH
+ * and SSTORE_IOCTL_READY are for poll() (see WATCHES below).  The
+ * SSTORE_IOCTL_KEY_ ones read, write and delete blobs by key (see KEY IOCTLS
+ * above).  SSTORE_IOCTL_PUNCH deletes the blob at index arg without moving
+ * the ones after it, SSTORE_IOCTL_DELETE_RANGE does that for a range of
+ * indices (arg points to a struct sstore_delete_range), and SSTORE_IOCTL_CLEAR
+ * deletes everything (see RANGE DELETE and CLEAR IOCTLS above).
+ * SSTORE_IOCTL_WRITE_IF and SSTORE_IOCTL_READ_IF_CHANGED write or read a blob
+ * depending on its version (see VERSIONED IOCTLS above).  SSTORE_IOCTL_APPEND
+ * adds to the end of a blob (arg points to a struct user_buffer), and
+ * SSTORE_IOCTL_TAIL reads what's past an offset of it, waiting for more if
+ * there isn't any (arg points to a struct sstore_range).  SSTORE_IOCTL_RESTORE
+ * loads a device image back in (see RESTORE IOCTL above), and
+ * SSTORE_IOCTL_SNAPSHOT has the file's reads see the device as it is now from
+ * then on (see SNAPSHOT IOCTL above).  This is an
+ * unlocked_ioctl, so unlike the old ioctl method it isn't called with the big
+ * kernel lock held--the mutex of the shard (or shards) an index is in is all
+ * the locking needed, and batches on different devices (or with reads going
+ * on) don't have to wait on each other.
+ */
+long sstore_ioctl(struct file * filp, unsigned int command,
+                                                        unsigned long arg) {
+    struct sstore_file * file = filp->private_data;
+    struct sstore * shard;          //the shard of the device an index is in
+    int index = 0;                  //and its index there
+    struct sstore_range range;      //the user's range, for READ_RANGE and TAIL
+    struct user_buffer buffer;      //the user's data, for APPEND
+    struct sstore_timed_read timed; //the user's timed read, for READ_TIMED
+    long timeout = 0;               //READ_TIMED's timeout, in jiffies
+    int error = 0;                  //used for detecting error return values
+
+
+    //DEBUG OUTPUT
+    PDEBUG("\nIn sstore ioctl()");
+
+    /*
+     * check validity of command sent in by user.
+     * -ENOTTY means "Inappropriate I/O control operation." (see "Linux Device
+     * Drivers" 3rd Ed. p.140)
+     */
+	if (_IOC_TYPE(command) != SSTORE_IOCTL_MAGIC) return -ENOTTY;
+	if (_IOC_NR(command) > SSTORE_IOCTL_MAX) return -ENOTTY;
+
+    switch (command) {
+        case SSTORE_IOCTL_DELETE:
+            if (arg > max_blobs || arg <= 0)
+                return -EINVAL;
+            shard = sstore_shard(file->dev, arg, &index);
+
+            //acquire mutex lock
+            if (sstore_lock(shard))
+                return -ERESTARTSYS;
+
+            error = sstore_do_delete(shard, index);
+
+            //release mutex lock
+            up(&shard->mutex);
+
+            return error;
+
+        case SSTORE_IOCTL_BATCH:
+            return sstore_ioctl_batch(file->dev,
+                                    (struct sstore_batch __user *) arg);
+
+        case SSTORE_IOCTL_READ_RANGE:
+            if (copy_from_user(&range, (struct sstore_range __user *) arg,
+                                                sizeof (struct sstore_range)))
+                return -EFAULT;
+            shard = sstore_shard(file->dev, range.index, &index);
+            if (!shard)
+                return -EINVAL;
+            return sstore_file_read(file, shard, index, range.offset,
+                        range.size, range.data, sstore_timeout(filp), 0);
+
+        case SSTORE_IOCTL_READ_TIMED:
+            if (copy_from_user(&timed, (struct sstore_timed_read __user *) arg,
+                                            sizeof (struct sstore_timed_read)))
+                return -EFAULT;
+            if (timed.timeout_ms < 0)
+                timeout = MAX_SCHEDULE_TIMEOUT;
+            else
+                timeout = msecs_to_jiffies(timed.timeout_ms);
+            shard = sstore_shard(file->dev, timed.range.index, &index);
+            if (!shard)
+                return -EINVAL;
+            return sstore_file_read(file, shard, index, timed.range.offset,
+                        timed.range.size, timed.range.data, timeout,
+                        timed.spin_us);
+
+        case SSTORE_IOCTL_WATCH:
+            if (arg > max_blobs || arg <= 0)
+                return -EINVAL;
+            return sstore_watch(file, arg);
+
+        case SSTORE_IOCTL_UNWATCH:
+            if (arg > max_blobs || arg <= 0)
+                return -EINVAL;
+            return sstore_unwatch(file, arg);
+
+        case SSTORE_IOCTL_READY:
+            return sstore_ioctl_ready(file, (struct sstore_ready __user *) arg);
+
+        case SSTORE_IOCTL_PUNCH:
+            if (arg > max_blobs || arg <= 0)
+                return -EINVAL;
+            shard = sstore_shard(file->dev, arg, &index);
+
+            //acquire mutex lock
+            if (sstore_lock(shard))
+                return -ERESTARTSYS;
+
+            error = sstore_do_punch(shard, index, index + 1);
+
+            //release mutex lock
+            up(&shard->mutex);
+
+            return error;
+
+        case SSTORE_IOCTL_DELETE_RANGE:
+            return sstore_ioctl_delete_range(file->dev,
+                                    (struct sstore_delete_range __user *) arg);
+
+        case SSTORE_IOCTL_CLEAR:
+            return sstore_ioctl_clear(file->dev);
+
+        case SSTORE_IOCTL_COMPRESS:
+            return sstore_ioctl_compress(file->dev, arg);
+
+        case SSTORE_IOCTL_SNAPSHOT:
+            return sstore_ioctl_snapshot(file);
+
+        case SSTORE_IOCTL_KEY_READ:
+        case SSTORE_IOCTL_KEY_WRITE:
+        case SSTORE_IOCTL_KEY_DELETE:
+            return sstore_ioctl_key(file->dev, command,
+                                        (struct sstore_key_op __user *) arg);
+
+        case SSTORE_IOCTL_WRITE_IF:
+        case SSTORE_IOCTL_READ_IF_CHANGED:
+            return sstore_ioctl_versioned(file->dev, command,
+                                    (struct sstore_versioned __user *) arg);
+
+        case SSTORE_IOCTL_APPEND:
+            if (copy_from_user(&buffer, (struct user_buffer __user *) arg,
+                                                sizeof (struct user_buffer)))
+                return -EFAULT;
+            shard = sstore_shard(file->dev, buffer.index, &index);
+            if (!shard)
+                return -EINVAL;
+
+            //acquire mutex lock
+            if (sstore_lock(shard))
+                return -ERESTARTSYS;
+
+            error = sstore_do_append(shard, index, buffer.size, buffer.data);
+
+            //release mutex lock
+            up(&shard->mutex);
+
+            return error;
+
+        case SSTORE_IOCTL_RESTORE:
+            return sstore_ioctl_restore(file->dev,
+                                        (struct sstore_restore __user *) arg);
+
+        case SSTORE_IOCTL_TAIL:
+            if (copy_from_user(&range, (struct sstore_range __user *) arg,
+                                                sizeof (struct sstore_range)))
+                return -EFAULT;
+            shard = sstore_shard(file->dev, range.index, &index);
+            if (!shard)
+                return -EINVAL;
+            return sstore_tail_blob(shard, index, range.offset, range.size,
+                                        range.data, sstore_timeout(filp));
+
+        /*
+         * the only way this could be entered is if a command was removed from
+         * sstore.h and the subsequent commands were not updated, thus a gap
+         * in the command numbers.
+         */
+        default:
+            return -EINVAL;
+    }
+
+    //return success
+    return 0;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * WATCHES and POLL.
+ *
+ * A file watching an index counts as one more waiter on the index's wait
+ * bucket for as long as it watches it, so a write to the index wakes up the
+ * bucket the same as it would for a reader blocked in read().  poll() waits on
+ * the bucket of every index the file watches (poll_wait() just adds it to the
+ * bucket's wait queue, it doesn't sleep), and says the file is readable if any
+ * of them has a blob.  None of this takes the device's mutex.
+ *
+ * The watched indices are the device's, but the buckets (and their counts)
+ * belong to the shard each index is in.  bucket_watches has a slot for every
+ * bucket of every shard, shard by shard (see sstore_bucket_slot()).
+ */
+
+//the slot of file->bucket_watches for the bucket of index of shard
+static int sstore_bucket_slot(struct sstore_file * file,
+                        struct sstore * shard, unsigned int index) {
+    struct sstore_wait_bucket * bucket = sstore_wait_bucket(shard, index);
+
+    return (shard - file->dev->shards) * SSTORE_WAIT_BUCKETS +
+                                                (bucket - shard->wait_buckets);
+}
+
+/*
+ * start watching index.  The bitmap of watched indices is allocated on the
+ * first watch; if two threads race to do it, the one that loses frees its own.
+ */
+static int sstore_watch(struct sstore_file * file, unsigned long index) {
+    struct sstore * shard;
+    int shard_index = 0;
+    struct sstore_wait_bucket * bucket;
+    unsigned long * watching;
+
+    shard = sstore_shard(file->dev, index, &shard_index);
+    if (!shard)
+        return -EINVAL;
+    bucket = sstore_wait_bucket(shard, shard_index);
+
+    if (!file->watching) {
+        watching = kzalloc(BITS_TO_LONGS(max_blobs + 1) * sizeof (long),
+                                                                GFP_KERNEL);
+        if (!watching)
+            return -ENOMEM;
+        if (cmpxchg(&file->watching, NULL, watching))
+            kfree(watching);
+        else
+            atomic_long_inc(&sstore_allocs.general);
+    }
+
+    //already watching it
+    if (test_and_set_bit(index, file->watching))
+        return 0;
+
+    atomic_inc(&file->bucket_watches[sstore_bucket_slot(file, shard,
+                                                                shard_index)]);
+    atomic_inc(&bucket->waiters);
+    atomic_inc(&shard->waiters);
+    atomic_inc(&shard->watches);
+    //pairs with the barrier writers have before looking for waiters
+    smp_mb__after_atomic_inc();
+
+    return 0;
+}
+
+//stop watching index (it's fine if it wasn't being watched)
+static int sstore_unwatch(struct sstore_file * file, unsigned long index) {
+    struct sstore * shard;
+    int shard_index = 0;
+    struct sstore_wait_bucket * bucket;
+
+    shard = sstore_shard(file->dev, index, &shard_index);
+    if (!shard || !file->watching || !test_and_clear_bit(index, file->watching))
+        return 0;
+    bucket = sstore_wait_bucket(shard, shard_index);
+
+    atomic_dec(&shard->watches);
+    atomic_dec(&shard->waiters);
+    atomic_dec(&bucket->waiters);
+    atomic_dec(&file->bucket_watches[sstore_bucket_slot(file, shard,
+                                                                shard_index)]);
+
+    return 0;
+}
+
+/*
+ * SSTORE_IOCTL_READY: hand back up to ready.count watched indices that have
+ * blobs, and stop watching them.  Returns how many there were.
+ */
+static long sstore_ioctl_ready(struct sstore_file * file,
+                                        struct sstore_ready __user * arg) {
+    struct sstore_ready ready;
+    struct sstore * shard;
+    int shard_index = 0;
+    unsigned long index = 0;
+    int found = 0;
+
+    if (copy_from_user(&ready, arg, sizeof (struct sstore_ready)))
+        return -EFAULT;
+    if (!file->watching)
+        return 0;
+
+    for_each_bit(index, file->watching, max_blobs + 1) {
+        if (found == ready.count)
+            break;
+        shard = sstore_shard(file->dev, index, &shard_index);
+        if (!sstore_blob_ready(shard, shard_index))
+            continue;
+        if (put_user(index, &ready.indices[found]))
+            return found ? found : -EFAULT;
+        sstore_unwatch(file, index);
+        ++found;
+    }
+
+    return found;
+}
+
+/*
+ * POLL.  Writing never blocks, so the file is always writable.
+ */
+unsigned int sstore_poll(struct file * filp, poll_table * wait) {
+    struct sstore_file * file = filp->private_data;
+    struct sstore * shard;
+    int shard_index = 0;
+    unsigned int mask = POLLOUT | POLLWRNORM;
+    unsigned long index = 0;
+    int i = 0;
+
+    for (i = 0; i < shards * SSTORE_WAIT_BUCKETS; ++i) {
+        if (atomic_read(&file->bucket_watches[i]))
+            poll_wait(filp, &file->dev->shards[i / SSTORE_WAIT_BUCKETS]
+                            .wait_buckets[i % SSTORE_WAIT_BUCKETS].queue, wait);
+    }
+
+    if (!file->watching)
+        return mask;
+
+    for_each_bit(index, file->watching, max_blobs + 1) {
+        shard = sstore_shard(file->dev, index, &shard_index);
+        if (sstore_blob_ready(shard, shard_index)) {
+            mask |= POLLIN | POLLRDNORM;
+            break;
+        }
+    }
+
+    return mask;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * MMAP.
+ *
+ * Maps the blob at the index given as the page offset (so pass index *
+ * page size as the offset to mmap()) read only into the caller, so it can be
+ * read with no copy, no system call and no lock at all.  The mapping is of
+ * the blob as it is at the time of the mmap(): a blob whose pages are mapped
+ * is never overwritten in place (see sstore_overwrite()), so later writes to
+ * the index put new blobs there and the mapping keeps showing the old one.
+ * The pages of the old one stay around until they are unmapped.
+ *
+ * Blobs bigger than half a page are already in pages of their own (a page, or
+ * a page per chunk, see ALLOCATION in sstore_core.c), and those pages are what
+ * get mapped.  Smaller blobs share their slab page with other kernel data, so
+ * they get copied into a page of their own first, once, here.
+ *
+ * The device's mutex isn't taken.  mmap() is called with the caller's mmap_sem
+ * held, and write() holds the mutex while copying from user space (which can
+ * take mmap_sem), so taking it here could deadlock.  Blobs are looked up the
+ * same way read() does instead.  The shard's map_mutex is held while the blob
+ * is mapped, so an append can't add to a page of it at the same time (see
+ * sstore_append_fill() in sstore_core.c): nothing holding that faults.
+ */
+int sstore_mmap(struct file * filp, struct vm_area_struct * vma) {
+    struct sstore_file * file = filp->private_data;
+    struct sstore * shard;      //the shard of the device the index is in
+    int shard_index = 0;        //and its index there
+    struct blob * blob;         //the blob being mapped
+    unsigned long index = vma->vm_pgoff;
+    unsigned long length = vma->vm_end - vma->vm_start;
+    unsigned long i = 0;
+    unsigned int size = 0;      //bytes of data the blob has
+    char * copy = NULL;         //a page for a small blob's data
+    char * page;                //the page being mapped
+    unsigned int chunk = 0;     //bytes in it (unused)
+    int error = 0;
+
+
+    //DEBUG OUTPUT
+    PDEBUG("\nIn sstore mmap()");
+
+    if (index > max_blobs || index <= 0)
+        return -EINVAL;
+    //the mapping is read only, and can't be mprotect()ed to be writable
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vma->vm_flags &= ~VM_MAYWRITE;
+
+    shard = sstore_shard(file->dev, index, &shard_index);
+    //acquire map lock (see sstore_append_fill())
+    if (down_interruptible(&shard->map_mutex))
+        return -ERESTARTSYS;
+    blob = sstore_blob_get(shard, shard_index);
+    if (!blob) {
+        up(&shard->map_mutex);
+        return -ENODATA;
+    }
+    //a compressed blob is mapped decompressed, as a copy of its own
+    blob = sstore_blob_expand(blob);
+    if (!blob) {
+        up(&shard->map_mutex);
+        return -ENOMEM;
+    }
+    size = sstore_blob_size(blob);
+
+    //get the blob's data into a page of its own if it isn't already
+    if (blob->capacity <= PAGE_SIZE / 2) {
+        copy = (char *) __get_free_pages(GFP_KERNEL | __GFP_ZERO, 0);
+        if (!copy) {
+            sstore_blob_put(blob);
+            up(&shard->map_mutex);
+            return -ENOMEM;
+        }
+        memcpy(copy, blob->junk, size);
+    }
+
+    //map the pages (each one gets a reference, dropped on munmap())
+    if (length > PAGE_ALIGN(size))
+        error = -EINVAL;
+    for (i = 0; !error && i < length; i += PAGE_SIZE) {
+        page = copy ? copy : sstore_blob_data(blob, i, size, &chunk);
+        error = vm_insert_page(vma, vma->vm_start + i, virt_to_page(page));
+    }
+
+    //the mapping has its own references now
+    if (copy)
+        free_pages((unsigned long) copy, 0);
+    sstore_blob_put(blob);
+    //release map lock
+    up(&shard->map_mutex);
+
+    return error;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * RELEASE.
+ */
+int sstore_release(struct inode * inode, struct file * filp) {
+    struct sstore_file * file = filp->private_data;
+    struct sstore_dev * dev;
+    unsigned long index = 0;
+    int i = 0;
+
+    //DEBUG OUTPUT
+    PDEBUG("\nIn sstore_release");
+
+    //identify which device is being closed
+    dev = container_of(inode->i_cdev, struct sstore_dev, cdev);
+
+    //stop watching everything this file watched, and free it
+    if (file->watching) {
+        for_each_bit(index, file->watching, max_blobs + 1)
+            sstore_unwatch(file, index);
+        kfree(file->watching);
+    }
+    //let go of the blobs its snapshot kept
+    if (file->snapshots)
+        sstore_snapshots_drop(file);
+    kfree(file);
+
+    //acquire mutex lock
+    if (down_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+
+    if (dev->fd_count) {
+        //decrement the number of open file descriptors
+        --dev->fd_count;
+        //DEBUG OUTPUT
+        PDEBUG("\nopen count in release = %d", dev->fd_count);
+        /*
+         * free the blobs when this is the last close (nobody can write now),
+         * unless they're being kept for the next open (see RETENTION)
+         */
+        if (dev->fd_count == 0 && !retain) {
+            for (i = 0; i < shards; ++i) {
+                down(&dev->shards[i].mutex);
+                sstore_device_clear(&dev->shards[i]);
+                up(&dev->shards[i].mutex);
+            }
+        }
+    }
+
+    //release mutex lock
+    up(&dev->mutex);
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * RETENTION.  With the retain parameter set, a device keeps its blobs after
+ * the last close, so a client that opens it, reads and goes away doesn't
+ * wipe it out for the next one: the device is a cache that lives as long as
+ * the module does.  What keeps it from growing without bound is max_bytes
+ * (see EVICTION in sstore_core.c), and the kernel can take memory back from
+ * it too, through a shrinker.  When memory is short, the kernel asks each
+ * shrinker how much it could free, and then to free some of it.  Ours counts
+ * blob data in pages, and frees it by evicting blobs nobody has used lately,
+ * from every shard in proportion to how much it holds.  A shard whose mutex
+ * is taken is skipped: its writer may be the one allocating the memory the
+ * kernel is trying to find, and waiting on it would deadlock.  So is a shard
+ * with a snapshot (see SNAPSHOTS in sstore_core.c): evicting a blob there
+ * means the snapshot has to keep it, which takes allocating memory with
+ * GFP_KERNEL, which could come right back into reclaim.  And nothing is
+ * evicted for an allocation that can't call into filesystems (no __GFP_FS),
+ * the same as the kernel's own caches do, since the allocation could have
+ * been made from under one of our locks.
+ */
+
+//pages of blob data held by every shard of every device
+static unsigned long sstore_cached_pages(void) {
+    unsigned long pages = 0;
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < device_count; ++i) {
+        for (j = 0; j < shards; ++j)
+            pages += ACCESS_ONCE(sstore_dev_array[i].shards[j].bytes) >>
+                                                                PAGE_SHIFT;
+    }
+    return pages;
+}
+
+/*
+ * the shrinker.  Evicts about nr_to_scan pages of blob data (none when it's
+ * 0), and returns how many pages are left, or -1 if it can't evict anything
+ * for this allocation.
+ */
+static int sstore_shrink(int nr_to_scan, gfp_t gfp_mask) {
+    struct sstore * shard;
+    unsigned long total = sstore_cached_pages();
+    unsigned long share = 0;    //pages for one shard to free
+    int i = 0;
+    int j = 0;
+
+    if (!nr_to_scan || !total)
+        return min(total, (unsigned long) INT_MAX);
+    if (!(gfp_mask & __GFP_FS))
+        return -1;
+
+    for (i = 0; i < device_count; ++i) {
+        for (j = 0; j < shards; ++j) {
+            shard = &sstore_dev_array[i].shards[j];
+            share = DIV_ROUND_UP(nr_to_scan *
+                    (ACCESS_ONCE(shard->bytes) >> PAGE_SHIFT), total);
+            //acquire mutex lock (if nobody has it)
+            if (!share || down_trylock(&shard->mutex))
+                continue;
+            if (!shard->snapshots)
+                sstore_evict(shard, share << PAGE_SHIFT);
+            //release mutex lock
+            up(&shard->mutex);
+        }
+    }
+
+    return min(sstore_cached_pages(), (unsigned long) INT_MAX);
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * EXIT.
+ */
+static void sstore_cleanup_and_exit(void) {
+    struct sstore_dev * dev;
+    char name[16];              //the name of a /proc/sstore/image<N> file
+    int i = 0;
+    int j = 0;
+    dev_t device_num = MKDEV(sstore_major, sstore_minor);
+
+    //DEBUG OUPUT
+    PDEBUG("In sstore_exit\n");
+
+    //the shrinker looks at the devices, so it goes first
+    if (sstore_shrinking)
+        unregister_shrinker(&sstore_shrinker);
+    sstore_shrinking = 0;
+
+    //free the allocated devices
+    if (sstore_dev_array) {
+        for (i = 0; i < device_count; ++i) {
+            dev = &sstore_dev_array[i];
+            //the ones after a device that failed to set up never were
+            if (!dev->shards)
+                break;
+            device_destroy(sstore_class, MKDEV(sstore_major, sstore_minor + i));
+            cdev_del(&dev->cdev);
+            //retained blobs are still there
+            for (j = 0; j < shards; ++j) {
+                sstore_device_clear(&dev->shards[j]);
+                sstore_device_destroy(&dev->shards[j]);
+            }
+            kfree(dev->shards);
+        }
+        kfree(sstore_dev_array);
+    }
+    if (sstore_class)
+        class_destroy(sstore_class);
+
+    /*
+     * free the blob and blob data caches (after letting any blobs still
+     * waiting on a grace period be freed)
+     */
+    sstore_core_exit();
+
+    //remove /proc files
+    remove_proc_entry("data", sstore);
+    remove_proc_entry("data.bin", sstore);
+    remove_proc_entry("stats", sstore);
+    for (i = 0; i < device_count; ++i) {
+        sprintf(name, "image%d", i);
+        remove_proc_entry(name, sstore);
+    }
+    remove_proc_entry("sstore", NULL);
+
+    /* 
+     * Unregister devices (there is guaranteed to be registered devices here 
+     * since init() takes care of registration failure)--in other words, free
+     * the region of device numbers so the kernel can reuse them.
+     */
+    unregister_chrdev_region(device_num, device_count);
+}
+
+//---------------------------------------------------------------------------
+
+
+//tells kernel which functions run when driver is loaded/removed
+module_init(sstore_init);
+module_exit(sstore_cleanup_and_exit);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_AUTHOR("Tyler Hayes");
@@ -0,0 +1,574 @@
+/*
+ * sstore_shim.c - the kernel primitives of sstore_shim.h, for running the
+ * store core in user space
+ *
+ * COPYRIGHT (C) 2009 Tyler Hayes - tgh@pdx.edu
+ *
+ */
+
+#include "sstore_shim.h"
+
+
+/*
+ * RCU.
+ *
+ * Readers hold sstore_shim_rcu_lock for reading.  call_rcu() puts callbacks on
+ * a list, and once SSTORE_SHIM_RCU_BATCH of them are waiting, the list is
+ * taken off and the lock is taken for writing--once that happens, every reader
+ * that could have seen what the callbacks are about to free is gone--and the
+ * callbacks are run.  Waiting for readers once per batch instead of once per
+ * callback keeps writers from lining up behind readers on every free.  The
+ * lock prefers writers, otherwise a steady stream of readers would keep a
+ * grace period from ever ending.
+ */
+#define SSTORE_SHIM_RCU_BATCH 64
+
+pthread_rwlock_t sstore_shim_rcu_lock;
+static pthread_once_t sstore_shim_rcu_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t sstore_shim_rcu_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rcu_head * sstore_shim_rcu_list;
+static unsigned int sstore_shim_rcu_count;
+
+//set up the lock (it can't be statically initialized to prefer writers)
+static void sstore_shim_rcu_init(void) {
+    pthread_rwlockattr_t attr;
+
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&sstore_shim_rcu_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+//run every callback queued so far, after waiting out the readers
+static void sstore_shim_rcu_flush(void) {
+    struct rcu_head * list;
+    struct rcu_head * next;
+
+    pthread_mutex_lock(&sstore_shim_rcu_list_lock);
+    list = sstore_shim_rcu_list;
+    sstore_shim_rcu_list = NULL;
+    sstore_shim_rcu_count = 0;
+    pthread_mutex_unlock(&sstore_shim_rcu_list_lock);
+
+    synchronize_rcu();
+    for (; list; list = next) {
+        next = list->next;
+        list->func(list);
+    }
+}
+
+void call_rcu(struct rcu_head * head, void (*func)(struct rcu_head * head)) {
+    unsigned int count = 0;
+
+    head->func = func;
+    pthread_mutex_lock(&sstore_shim_rcu_list_lock);
+    head->next = sstore_shim_rcu_list;
+    sstore_shim_rcu_list = head;
+    count = ++sstore_shim_rcu_count;
+    pthread_mutex_unlock(&sstore_shim_rcu_list_lock);
+
+    if (count >= SSTORE_SHIM_RCU_BATCH)
+        sstore_shim_rcu_flush();
+}
+
+/*
+ * wait for every reader that's already in a read side critical section.  Must
+ * not be called from one (the lock isn't recursive).
+ */
+void synchronize_rcu(void) {
+    pthread_once(&sstore_shim_rcu_once, sstore_shim_rcu_init);
+    pthread_rwlock_wrlock(&sstore_shim_rcu_lock);
+    pthread_rwlock_unlock(&sstore_shim_rcu_lock);
+}
+
+void rcu_barrier(void) {
+    sstore_shim_rcu_flush();
+}
+
+/*
+ * rcu_read_lock() can be the first thing to touch the lock, so it has to be
+ * set up before main() runs.
+ */
+static void __attribute__((constructor)) sstore_shim_init(void) {
+    pthread_once(&sstore_shim_rcu_once, sstore_shim_rcu_init);
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * WAIT QUEUES.
+ */
+void init_waitqueue_head(wait_queue_head_t * queue) {
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    queue->wakeups = 0;
+}
+
+/*
+ * the wait a thread is getting ready for, so that schedule() knows what to
+ * sleep on (the kernel knows that from the task's state).
+ */
+static __thread wait_queue_t * sstore_shim_wait;
+
+void prepare_to_wait(wait_queue_head_t * queue, wait_queue_t * wait,
+                                                                int state) {
+    pthread_mutex_lock(&queue->lock);
+    wait->queue = queue;
+    wait->wakeups = queue->wakeups;
+    pthread_mutex_unlock(&queue->lock);
+    sstore_shim_wait = wait;
+}
+
+void finish_wait(wait_queue_head_t * queue, wait_queue_t * wait) {
+    sstore_shim_wait = NULL;
+    wait->queue = NULL;
+}
+
+//sleep until the queue being waited on is woken up
+void schedule(void) {
+    wait_queue_t * wait = sstore_shim_wait;
+
+    if (!wait || !wait->queue) {
+        sched_yield();
+        return;
+    }
+    pthread_mutex_lock(&wait->queue->lock);
+    while (wait->queue->wakeups == wait->wakeups)
+        pthread_cond_wait(&wait->queue->cond, &wait->queue->lock);
+    pthread_mutex_unlock(&wait->queue->lock);
+}
+
+/*
+ * sleep until the queue is woken up or timeout jiffies (milliseconds) go by.
+ * Returns the jiffies that were left, or 0 if it timed out.
+ */
+long schedule_timeout(long timeout) {
+    wait_queue_t * wait = sstore_shim_wait;
+    struct timespec deadline;
+    struct timespec now;
+    long left = 0;
+    int error = 0;
+
+    if (timeout == MAX_SCHEDULE_TIMEOUT) {
+        schedule();
+        return timeout;
+    }
+    if (!wait || !wait->queue) {
+        sched_yield();
+        return timeout;
+    }
+
+    //condition variables time out by the real time clock
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&wait->queue->lock);
+    while (wait->queue->wakeups == wait->wakeups && error != ETIMEDOUT)
+        error = pthread_cond_timedwait(&wait->queue->cond, &wait->queue->lock,
+                                                                    &deadline);
+    pthread_mutex_unlock(&wait->queue->lock);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    left = (deadline.tv_sec - now.tv_sec) * 1000 +
+                                (deadline.tv_nsec - now.tv_nsec) / 1000000;
+    return left > 0 ? left : 0;
+}
+
+void wake_up_interruptible(wait_queue_head_t * queue) {
+    pthread_mutex_lock(&queue->lock);
+    ++queue->wakeups;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * MEMORY.
+ */
+struct kmem_cache * kmem_cache_create(const char * name, size_t size,
+                size_t align, unsigned long flags, void (*ctor)(void * object)) {
+    struct kmem_cache * cache = malloc(sizeof (struct kmem_cache));
+
+    if (cache)
+        cache->size = size;
+    return cache;
+}
+
+void kmem_cache_destroy(struct kmem_cache * cache) {
+    free(cache);
+}
+
+/*
+ * allocate 2^order pages, plus one in front of them for their struct page.
+ * Returns the address of the first of the 2^order pages, or 0.
+ */
+unsigned long __get_free_pages(gfp_t flags, unsigned int order) {
+    struct page * page;
+    void * memory;
+
+    if (posix_memalign(&memory, PAGE_SIZE, (PAGE_SIZE << order) + PAGE_SIZE))
+        return 0;
+    page = memory;
+    atomic_set(&page->_count, 1);
+    if (flags & __GFP_ZERO)
+        memset(page_address(page), 0, PAGE_SIZE << order);
+    return (unsigned long) page_address(page);
+}
+
+void __free_pages(struct page * page, unsigned int order) {
+    free(page);
+}
+
+//NR_CPUS zeroed copies, each starting on a cache line of its own
+void * sstore_shim_alloc_percpu(size_t size) {
+    void * copies = NULL;
+    size_t stride = sstore_shim_percpu_stride(size);
+
+    if (posix_memalign(&copies, SSTORE_SHIM_CACHE_LINE, NR_CPUS * stride))
+        return NULL;
+    memset(copies, 0, NR_CPUS * stride);
+    return copies;
+}
+
+/*
+ * the "CPU" whose copy of per-CPU data is ours: each thread gets the next one
+ * the first time it asks (see the top of sstore_shim.h)
+ */
+int get_cpu(void) {
+    static int threads = 0;
+    static __thread int cpu = -1;
+
+    if (cpu < 0)
+        cpu = __atomic_fetch_add(&threads, 1, __ATOMIC_RELAXED) % NR_CPUS;
+    return cpu;
+}
+
+//---------------------------------------------------------------------------
+
+/*
+ * LZO.
+ *
+ * Not the kernel's format, just something simple with the same calls: a
+ * byte below 0x80 is followed by that many plus one bytes of data as they
+ * are, and a byte from 0x80 up says to copy its low 7 bits plus 4 bytes from
+ * the two byte (little endian) distance back that follows it.  Matches are
+ * found with a hash table of where each 4 bytes were last seen, which is the
+ * work memory.
+ */
+#define SSTORE_SHIM_LZO_BITS 14
+#define SSTORE_SHIM_LZO_LITERALS 128    //the most data bytes one byte covers
+#define SSTORE_SHIM_LZO_MATCH 131       //the longest match
+
+static unsigned int sstore_shim_lzo_hash(const unsigned char * p) {
+    u32 bytes = p[0] | (p[1] << 8) | (p[2] << 16) | ((u32) p[3] << 24);
+
+    return (bytes * 2654435761U) >> (32 - SSTORE_SHIM_LZO_BITS);
+}
+
+//put out the bytes from start up to end as they are
+static unsigned char * sstore_shim_lzo_literals(unsigned char * out,
+                    const unsigned char * start, const unsigned char * end) {
+    size_t length = 0;
+
+    for (; start < end; start += length) {
+        length = min((size_t) (end - start), (size_t) SSTORE_SHIM_LZO_LITERALS);
+        *out++ = length - 1;
+        memcpy(out, start, length);
+        out += length;
+    }
+    return out;
+}
+
+int lzo1x_1_compress(const unsigned char * src, size_t src_len,
+                unsigned char * dst, size_t * dst_len, void * wrkmem) {
+    const unsigned char ** table = wrkmem;
+    const unsigned char * in = src;
+    const unsigned char * end = src + src_len;
+    const unsigned char * literals = src;   //not put out yet from here on
+    const unsigned char * match;
+    unsigned char * out = dst;
+    unsigned int hash = 0;
+    size_t length = 0;
+
+    memset(table, 0, (1 << SSTORE_SHIM_LZO_BITS) * sizeof (char *));
+    while (end - in >= 4) {
+        hash = sstore_shim_lzo_hash(in);
+        match = table[hash];
+        table[hash] = in;
+        if (!match || in - match > 0xffff || memcmp(match, in, 4)) {
+            ++in;
+            continue;
+        }
+        for (length = 4; in + length < end && length < SSTORE_SHIM_LZO_MATCH &&
+                                        match[length] == in[length]; ++length)
+            ;
+        out = sstore_shim_lzo_literals(out, literals, in);
+        *out++ = 0x80 | (length - 4);
+        *out++ = (in - match) & 0xff;
+        *out++ = (in - match) >> 8;
+        in += length;
+        literals = in;
+    }
+    out = sstore_shim_lzo_literals(out, literals, end);
+
+    *dst_len = out - dst;
+    return LZO_E_OK;
+}
+
+int lzo1x_decompress_safe(const unsigned char * src, size_t src_len,
+                                unsigned char * dst, size_t * dst_len) {
+    const unsigned char * in = src;
+    const unsigned char * end = src + src_len;
+    unsigned char * out = dst;
+    unsigned char * out_end = dst + *dst_len;
+    size_t length = 0;
+    size_t distance = 0;
+
+    while (in < end) {
+        if (*in < 0x80) {
+            length = *in++ + 1;
+            if (length > (size_t) (end - in))
+                return LZO_E_INPUT_OVERRUN;
+            if (length > (size_t) (out_end - out))
+                return LZO_E_OUTPUT_OVERRUN;
+            memcpy(out, in, length);
+            in += length;
+            out += length;
+            continue;
+        }
+        if (end - in < 3)
+            return LZO_E_INPUT_OVERRUN;
+        length = (in[0] & 0x7f) + 4;
+        distance = in[1] | (in[2] << 8);
+        in += 3;
+        if (!distance || distance > (size_t) (out - dst))
+            return LZO_E_LOOKBEHIND_OVERRUN;
+        if (length > (size_t) (out_end - out))
+            return LZO_E_OUTPUT_OVERRUN;
+        //byte by byte, since the match can run into what it's making
+        for (; length; --length, ++out)
+            *out = out[-distance];
+    }
+
+    *dst_len = out - dst;
+    return LZO_E_OK;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * RADIX TREE.
+ *
+ * The tree is as tall as the highest index in it needs.  A taller tree is made
+ * by putting a new root above the old one, which lookups can't tell from the
+ * old tree for the indices it held.  Nodes that empty out are taken out of the
+ * tree and freed after a grace period, and the tree never gets shorter (except
+ * by emptying out completely).
+ */
+
+//the highest index a tree of the given height can hold
+static unsigned long sstore_shim_radix_maxindex(unsigned int height) {
+    unsigned int shift = height * RADIX_TREE_MAP_SHIFT;
+
+    if (shift >= sizeof (unsigned long) * 8)
+        return ~0UL;
+    return (1UL << shift) - 1;
+}
+
+static struct radix_tree_node * sstore_shim_radix_node(unsigned int height) {
+    struct radix_tree_node * node = calloc(1,
+                                        sizeof (struct radix_tree_node));
+
+    if (node)
+        node->height = height;
+    return node;
+}
+
+static void sstore_shim_radix_node_free(struct rcu_head * head) {
+    free(container_of(head, struct radix_tree_node, rcu_head));
+}
+
+void ** radix_tree_lookup_slot(struct radix_tree_root * root,
+                                                        unsigned long index) {
+    struct radix_tree_node * node = rcu_dereference(root->rnode);
+    unsigned int height = 0;
+    unsigned int shift = 0;
+    void ** slot;
+
+    if (!node)
+        return NULL;
+    height = node->height;
+    if (index > sstore_shim_radix_maxindex(height))
+        return NULL;
+
+    shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+    for (;;) {
+        slot = &node->slots[(index >> shift) & RADIX_TREE_MAP_MASK];
+        if (!rcu_dereference(*slot))
+            return NULL;
+        if (--height == 0)
+            return slot;
+        node = rcu_dereference(*slot);
+        shift -= RADIX_TREE_MAP_SHIFT;
+    }
+}
+
+void * radix_tree_lookup(struct radix_tree_root * root, unsigned long index) {
+    void ** slot = radix_tree_lookup_slot(root, index);
+
+    return slot ? rcu_dereference(*slot) : NULL;
+}
+
+int radix_tree_insert(struct radix_tree_root * root, unsigned long index,
+                                                                void * item) {
+    struct radix_tree_node * node = root->rnode;
+    struct radix_tree_node * child;
+    unsigned int height = 1;
+    unsigned int shift = 0;
+    unsigned int offset = 0;
+
+    //make the tree tall enough for the index
+    while (index > sstore_shim_radix_maxindex(height))
+        ++height;
+    if (!node) {
+        node = sstore_shim_radix_node(height);
+        if (!node)
+            return -ENOMEM;
+        rcu_assign_pointer(root->rnode, node);
+    }
+    while (node->height < height) {
+        child = sstore_shim_radix_node(node->height + 1);
+        if (!child)
+            return -ENOMEM;
+        child->slots[0] = node;
+        child->count = 1;
+        rcu_assign_pointer(root->rnode, child);
+        node = child;
+    }
+
+    //walk down to the bottom, adding nodes where there aren't any
+    height = node->height;
+    shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+    for (; height > 1; --height, shift -= RADIX_TREE_MAP_SHIFT) {
+        offset = (index >> shift) & RADIX_TREE_MAP_MASK;
+        child = node->slots[offset];
+        if (!child) {
+            child = sstore_shim_radix_node(height - 1);
+            if (!child)
+                return -ENOMEM;
+            rcu_assign_pointer(node->slots[offset], child);
+            ++node->count;
+        }
+        node = child;
+    }
+
+    offset = index & RADIX_TREE_MAP_MASK;
+    if (node->slots[offset])
+        return -EEXIST;
+    rcu_assign_pointer(node->slots[offset], item);
+    ++node->count;
+    return 0;
+}
+
+void * radix_tree_delete(struct radix_tree_root * root, unsigned long index) {
+    struct radix_tree_node * path[sizeof (unsigned long) * 8 /
+                                                    RADIX_TREE_MAP_SHIFT + 1];
+    unsigned int offsets[sizeof (unsigned long) * 8 /
+                                                    RADIX_TREE_MAP_SHIFT + 1];
+    struct radix_tree_node * node = root->rnode;
+    int height = 0;
+    unsigned int shift = 0;
+    int level = 0;
+    void * item = NULL;
+
+    if (!node || index > sstore_shim_radix_maxindex(node->height))
+        return NULL;
+
+    //remember the way down, to clean up empty nodes on the way back up
+    height = node->height;
+    shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+    for (level = 0; level < height; ++level) {
+        path[level] = node;
+        offsets[level] = (index >> shift) & RADIX_TREE_MAP_MASK;
+        item = node->slots[offsets[level]];
+        if (!item)
+            return NULL;
+        node = item;
+        shift -= RADIX_TREE_MAP_SHIFT;
+    }
+
+    //item is what was in the bottom node's slot
+    for (level = height - 1; level >= 0; --level) {
+        rcu_assign_pointer(path[level]->slots[offsets[level]], NULL);
+        if (--path[level]->count)
+            break;
+    }
+    if (level < 0)
+        rcu_assign_pointer(root->rnode, NULL);
+    //the nodes under the one that didn't empty out aren't in the tree anymore
+    for (++level; level < height; ++level)
+        call_rcu(&path[level]->rcu_head, sstore_shim_radix_node_free);
+    return item;
+}
+
+/*
+ * find the first item at or after *index under node (of the given height), and
+ * set *index to where it is.  Returns NULL if there are none.
+ */
+static void * sstore_shim_radix_next(struct radix_tree_node * node,
+                                    unsigned int height, unsigned long * index) {
+    unsigned int shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+    unsigned long span = 1UL << shift;      //indices under each slot
+    unsigned long base = *index & ~(sstore_shim_radix_maxindex(height));
+    unsigned int offset = (*index >> shift) & RADIX_TREE_MAP_MASK;
+    unsigned long start = 0;
+    void * slot;
+    void * item;
+
+    for (; offset < RADIX_TREE_MAP_SIZE; ++offset) {
+        slot = rcu_dereference(node->slots[offset]);
+        if (!slot)
+            continue;
+        start = base + offset * span;
+        if (start < *index)
+            start = *index;
+        if (height == 1) {
+            *index = start;
+            return slot;
+        }
+        item = sstore_shim_radix_next(slot, height - 1, &start);
+        if (item) {
+            *index = start;
+            return item;
+        }
+    }
+    return NULL;
+}
+
+unsigned int radix_tree_gang_lookup(struct radix_tree_root * root,
+        void ** results, unsigned long first_index, unsigned int max_items) {
+    struct radix_tree_node * node = rcu_dereference(root->rnode);
+    unsigned long index = first_index;
+    unsigned int found = 0;
+    void * item;
+
+    if (!node)
+        return 0;
+    while (found < max_items && index <= sstore_shim_radix_maxindex(
+                                                            node->height)) {
+        item = sstore_shim_radix_next(node, node->height, &index);
+        if (!item)
+            break;
+        results[found++] = item;
+        if (index == ~0UL)
+            break;
+        ++index;
+    }
+    return found;
+}
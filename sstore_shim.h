@@ -0,0 +1,536 @@
+/*
+ * sstore_shim.h - just enough of the kernel for sstore_core.c in user space
+ *
+ * COPYRIGHT (C) 2009 Tyler Hayes - tgh@pdx.edu
+ *
+ */
+
+/*
+ * sstore_core.c holds the blob store itself (the index backends, allocation,
+ * waiting, and reading, writing and deleting blobs), and only talks to the
+ * kernel through the handful of kernel primitives stood in for here.  When it
+ * is compiled without __KERNEL__ (see the bench_core target in the Makefile),
+ * sstore_core.h includes this file instead of the kernel headers, and the
+ * whole store runs as a plain user space library on top of pthreads.  That
+ * way the store can be benchmarked and profiled (see bench_core.c) without
+ * loading the module.
+ *
+ * These are stand-ins, not copies of the kernel's versions, so they only do
+ * what the core needs:
+ *
+ *  - RCU is a reader/writer lock.  rcu_read_lock() takes it for reading, and
+ *    call_rcu() queues the callback until enough are queued (or rcu_barrier()
+ *    is called), then takes the lock for writing once--which waits for every
+ *    reader that might still see the old pointers--and runs them all.
+ *  - wait queues are a mutex, a condition variable and a count of wakeups.
+ *    signal_pending() is always false, there are no signals to wait on, and
+ *    a jiffy is a millisecond.
+ *  - slab caches and vmalloc() are malloc().  Pages are malloc()ed too, with
+ *    their struct page in front of them, so virt_to_page() only works on the
+ *    address of the first page of an allocation (which is all the core uses
+ *    it for).  Nothing maps them, so page_count() is always 1.
+ *  - the radix tree is a small one of our own (in sstore_shim.c), grown the
+ *    same way as the kernel's and read the same way under RCU.
+ *  - user space pointers are just pointers, so copy_to_user() and friends are
+ *    memcpy().
+ *  - per-CPU data is an array of NR_CPUS copies, one cache line apart.
+ *    Threads can't be kept from being moved between CPUs in user space, so
+ *    get_cpu() doesn't say which CPU a thread is on, it gives each thread a
+ *    copy of its own (the first NR_CPUS threads, anyway), which is what
+ *    keeping preemption off buys the core in the kernel.
+ *  - LZO is a small LZ77 compressor of our own behind the same calls as
+ *    lib/lzo's.  It doesn't make the same bytes, just fewer of them.
+ */
+
+#ifndef _SSTORE_SHIM_H
+#define _SSTORE_SHIM_H
+
+#ifdef __KERNEL__
+#error "sstore_shim.h is only for building the store core in user space"
+#endif
+
+//for pthread_rwlockattr_setkind_np()
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+//----------------------------------------------------------------------------
+
+/*
+ * MISC.
+ */
+#define __user
+#define __init
+#define __exit
+#define KERN_ALERT ""
+#define KERN_WARNING ""
+#define KERN_DEBUG ""
+#define printk(fmt, args...) fprintf(stderr, fmt, ## args)
+#define PDEBUG(fmt, args...)
+//the kernel's "restart the system call after the signal" errno
+#define ERESTARTSYS 512
+
+#define ARRAY_SIZE(a) (sizeof (a) / sizeof ((a)[0]))
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+#define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+#define cpu_relax() __asm__ __volatile__("" : : : "memory")
+#define cond_resched() sched_yield()
+#define need_resched() 0
+
+//----------------------------------------------------------------------------
+
+/*
+ * ATOMICS AND BARRIERS (gcc's __atomic builtins, all sequentially consistent
+ * like the kernel's value-returning atomics)
+ */
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define ACCESS_ONCE(x) (*(volatile typeof(x) *) &(x))
+
+typedef unsigned char u8;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+typedef long long s64;
+
+typedef struct { int counter; } atomic_t;
+typedef struct { long counter; } atomic_long_t;
+
+#define ATOMIC_INIT(i) { (i) }
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_inc(v) __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec(v) __atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_add(i, v) __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_sub(i, v) __atomic_sub_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_dec_and_test(v) (atomic_dec(v) == 0)
+
+static inline int atomic_cmpxchg(atomic_t * v, int old, int new) {
+    __atomic_compare_exchange_n(&v->counter, &old, new, 0, __ATOMIC_SEQ_CST,
+                                                            __ATOMIC_SEQ_CST);
+    return old;
+}
+
+//add one unless the count is zero.  Returns non-zero if it was added
+static inline int atomic_inc_not_zero(atomic_t * v) {
+    int old = atomic_read(v);
+
+    while (old) {
+        if (__atomic_compare_exchange_n(&v->counter, &old, old + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return 1;
+    }
+    return 0;
+}
+
+#define atomic_long_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_long_set(v, i) \
+    __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_inc(v) \
+    __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_RELAXED)
+#define atomic_long_dec(v) \
+    __atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_RELAXED)
+#define atomic_long_add(i, v) \
+    __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_RELAXED)
+
+//----------------------------------------------------------------------------
+
+/*
+ * LOCKS.  The device's mutex is a struct semaphore in the driver, and the page
+ * pool's lock is a spinlock taken with bottom halves disabled.  There's no
+ * difference between any of them here.
+ */
+struct semaphore {
+    pthread_mutex_t lock;
+};
+
+static inline void sema_init(struct semaphore * sem, int val) {
+    pthread_mutex_init(&sem->lock, NULL);
+}
+
+static inline int down_interruptible(struct semaphore * sem) {
+    pthread_mutex_lock(&sem->lock);
+    return 0;
+}
+
+static inline void down(struct semaphore * sem) {
+    pthread_mutex_lock(&sem->lock);
+}
+
+static inline void up(struct semaphore * sem) {
+    pthread_mutex_unlock(&sem->lock);
+}
+
+typedef pthread_mutex_t spinlock_t;
+#define DEFINE_SPINLOCK(x) spinlock_t x = PTHREAD_MUTEX_INITIALIZER
+#define spin_lock_init(x) pthread_mutex_init((x), NULL)
+#define spin_lock(x) pthread_mutex_lock(x)
+#define spin_unlock(x) pthread_mutex_unlock(x)
+#define spin_lock_bh(x) pthread_mutex_lock(x)
+#define spin_unlock_bh(x) pthread_mutex_unlock(x)
+
+//----------------------------------------------------------------------------
+
+/*
+ * LISTS (the bits of linux/list.h the page pool uses)
+ */
+struct list_head {
+    struct list_head * next;
+    struct list_head * prev;
+};
+
+#define LIST_HEAD(name) struct list_head name = { &(name), &(name) }
+
+static inline void INIT_LIST_HEAD(struct list_head * list) {
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void list_add(struct list_head * new, struct list_head * head) {
+    new->next = head->next;
+    new->prev = head;
+    head->next->prev = new;
+    head->next = new;
+}
+
+static inline void list_add_tail(struct list_head * new,
+                                                    struct list_head * head) {
+    list_add(new, head->prev);
+}
+
+static inline void list_del(struct list_head * entry) {
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+static inline int list_empty(const struct list_head * head) {
+    return head->next == head;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+
+//----------------------------------------------------------------------------
+
+/*
+ * RCU.  See the top of this file.
+ */
+struct rcu_head {
+    struct rcu_head * next;
+    void (*func)(struct rcu_head * head);
+};
+
+extern pthread_rwlock_t sstore_shim_rcu_lock;
+
+#define rcu_read_lock() pthread_rwlock_rdlock(&sstore_shim_rcu_lock)
+#define rcu_read_unlock() pthread_rwlock_unlock(&sstore_shim_rcu_lock)
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void call_rcu(struct rcu_head * head, void (*func)(struct rcu_head * head));
+void synchronize_rcu(void);
+void rcu_barrier(void);
+
+//----------------------------------------------------------------------------
+
+/*
+ * WAIT QUEUES.  A waiter remembers how many wakeups the queue had seen when it
+ * got ready to wait, and schedule() sleeps until there's been another one, so
+ * a wakeup between prepare_to_wait() and schedule() isn't lost.
+ */
+#define TASK_RUNNING 0
+#define TASK_INTERRUPTIBLE 1
+#define current NULL
+#define signal_pending(task) 0
+
+#define HZ 1000
+#define MAX_SCHEDULE_TIMEOUT LONG_MAX
+#define msecs_to_jiffies(ms) ((long) (ms))
+
+//ktime_t is just nanoseconds
+typedef long long ktime_t;
+
+static inline ktime_t ktime_get(void) {
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+#define ktime_sub(later, earlier) ((later) - (earlier))
+#define ktime_to_ns(time) (time)
+#define ktime_us_delta(later, earlier) (((later) - (earlier)) / 1000)
+
+typedef struct __wait_queue_head {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned long wakeups;
+} wait_queue_head_t;
+
+typedef struct __wait_queue {
+    wait_queue_head_t * queue;
+    unsigned long wakeups;      //the queue's wakeups as of prepare_to_wait()
+} wait_queue_t;
+
+#define DEFINE_WAIT(name) wait_queue_t name = { NULL, 0 }
+
+void init_waitqueue_head(wait_queue_head_t * queue);
+void prepare_to_wait(wait_queue_head_t * queue, wait_queue_t * wait,
+        int state);
+void finish_wait(wait_queue_head_t * queue, wait_queue_t * wait);
+void schedule(void);
+long schedule_timeout(long timeout);
+void wake_up_interruptible(wait_queue_head_t * queue);
+#define wake_up_interruptible_all(queue) wake_up_interruptible(queue)
+
+//----------------------------------------------------------------------------
+
+/*
+ * MEMORY.
+ */
+typedef unsigned int gfp_t;
+#define GFP_KERNEL 0x0u
+#define GFP_ATOMIC 0x1u
+#define __GFP_ZERO 0x2u
+#define SLAB_HWCACHE_ALIGN 0x0ul
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+#define PAGE_ALIGN(addr) (((addr) + PAGE_SIZE - 1) & PAGE_MASK)
+
+#define kmalloc(size, flags) malloc(size)
+#define kzalloc(size, flags) calloc(1, (size))
+#define kfree(p) free(p)
+#define vmalloc(size) malloc(size)
+#define vfree(p) free(p)
+
+struct kmem_cache {
+    size_t size;
+};
+
+struct kmem_cache * kmem_cache_create(const char * name, size_t size,
+        size_t align, unsigned long flags, void (*ctor)(void * object));
+void kmem_cache_destroy(struct kmem_cache * cache);
+#define kmem_cache_alloc(cache, flags) malloc((cache)->size)
+#define kmem_cache_free(cache, object) free(object)
+
+//sits in the page in front of every allocation of pages (see the top)
+struct page {
+    struct list_head lru;
+    atomic_t _count;
+};
+
+#define page_address(page) ((char *) (page) + PAGE_SIZE)
+#define virt_to_page(addr) ((struct page *) ((char *) (addr) - PAGE_SIZE))
+#define page_count(page) atomic_read(&(page)->_count)
+
+unsigned long __get_free_pages(gfp_t flags, unsigned int order);
+void __free_pages(struct page * page, unsigned int order);
+#define free_pages(addr, order) __free_pages(virt_to_page(addr), (order))
+
+//----------------------------------------------------------------------------
+
+/*
+ * PER-CPU DATA.
+ */
+#define NR_CPUS 256
+#define SSTORE_SHIM_CACHE_LINE 64
+
+//how far apart the copies of a size byte per-CPU object are
+#define sstore_shim_percpu_stride(size) \
+    (((size) + SSTORE_SHIM_CACHE_LINE - 1) & ~(SSTORE_SHIM_CACHE_LINE - 1))
+
+void * sstore_shim_alloc_percpu(size_t size);
+#define alloc_percpu(type) \
+    ((type *) sstore_shim_alloc_percpu(sizeof (type)))
+#define free_percpu(ptr) free(ptr)
+#define per_cpu_ptr(ptr, cpu) \
+    ((__typeof__(ptr)) ((char *) (ptr) + \
+                    (cpu) * sstore_shim_percpu_stride(sizeof (*(ptr)))))
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < NR_CPUS; ++(cpu))
+
+int get_cpu(void);
+#define put_cpu()
+
+//----------------------------------------------------------------------------
+
+/*
+ * BITS.
+ */
+static inline int ilog2(unsigned long n) {
+    return (int) (sizeof (long) * 8) - 1 - __builtin_clzl(n);
+}
+
+//the last set bit, counting from 1 (0 if none are set)
+static inline int fls64(u64 n) {
+    return n ? 64 - __builtin_clzll(n) : 0;
+}
+
+static inline unsigned long roundup_pow_of_two(unsigned long n) {
+    return n == 1 ? 1 : 1UL << (ilog2(n - 1) + 1);
+}
+
+//the page order needed for size bytes
+static inline int get_order(unsigned long size) {
+    int order = 0;
+
+    size = (size - 1) >> PAGE_SHIFT;
+    while (size) {
+        size >>= 1;
+        ++order;
+    }
+    return order;
+}
+
+//linux/hash.h's hash_long(), for 64 and 32 bit longs
+#define GOLDEN_RATIO_PRIME_32 0x9e370001UL
+#define GOLDEN_RATIO_PRIME_64 0x9e37fffffffc0001UL
+
+static inline unsigned long hash_long(unsigned long val, unsigned int bits) {
+    if (sizeof (long) == 8)
+        return (unsigned long) ((unsigned long long) val *
+                                    GOLDEN_RATIO_PRIME_64) >> (64 - bits);
+    return (unsigned long) (val * GOLDEN_RATIO_PRIME_32) >> (32 - bits);
+}
+
+//linux/jhash.h's jhash() (Bob Jenkins' lookup2), for hashing keys
+#define JHASH_GOLDEN_RATIO 0x9e3779b9
+
+#define __jhash_mix(a, b, c) \
+{ \
+    a -= b; a -= c; a ^= (c >> 13); \
+    b -= c; b -= a; b ^= (a << 8); \
+    c -= a; c -= b; c ^= (b >> 13); \
+    a -= b; a -= c; a ^= (c >> 12); \
+    b -= c; b -= a; b ^= (a << 16); \
+    c -= a; c -= b; c ^= (b >> 5); \
+    a -= b; a -= c; a ^= (c >> 3); \
+    b -= c; b -= a; b ^= (a << 10); \
+    c -= a; c -= b; c ^= (b >> 15); \
+}
+
+static inline u32 jhash(const void * key, u32 length, u32 initval) {
+    const u8 * k = key;
+    u32 a = JHASH_GOLDEN_RATIO;
+    u32 b = JHASH_GOLDEN_RATIO;
+    u32 c = initval;
+    u32 len = length;
+
+    while (len >= 12) {
+        a += k[0] + ((u32) k[1] << 8) + ((u32) k[2] << 16) + ((u32) k[3] << 24);
+        b += k[4] + ((u32) k[5] << 8) + ((u32) k[6] << 16) + ((u32) k[7] << 24);
+        c += k[8] + ((u32) k[9] << 8) + ((u32) k[10] << 16) +
+                                                        ((u32) k[11] << 24);
+        __jhash_mix(a, b, c);
+        k += 12;
+        len -= 12;
+    }
+
+    c += length;
+    switch (len) {
+        case 11: c += (u32) k[10] << 24;
+        case 10: c += (u32) k[9] << 16;
+        case 9: c += (u32) k[8] << 8;
+        case 8: b += (u32) k[7] << 24;
+        case 7: b += (u32) k[6] << 16;
+        case 6: b += (u32) k[5] << 8;
+        case 5: b += k[4];
+        case 4: a += (u32) k[3] << 24;
+        case 3: a += (u32) k[2] << 16;
+        case 2: a += (u32) k[1] << 8;
+        case 1: a += k[0];
+    }
+    __jhash_mix(a, b, c);
+
+    return c;
+}
+
+//----------------------------------------------------------------------------
+
+/*
+ * USER SPACE ACCESS.  Everything is in user space already.
+ */
+#define copy_to_user(to, from, n) (memcpy((to), (from), (n)), 0UL)
+#define copy_from_user(to, from, n) (memcpy((to), (from), (n)), 0UL)
+#define __copy_from_user_inatomic(to, from, n) copy_from_user(to, from, n)
+#define __copy_to_user_inatomic(to, from, n) copy_to_user(to, from, n)
+#define get_user(x, ptr) ({ (x) = *(ptr); (void) (x); 0; })
+#define put_user(x, ptr) (*(ptr) = (x), 0)
+#define pagefault_disable()
+#define pagefault_enable()
+
+//----------------------------------------------------------------------------
+
+/*
+ * LZO (see sstore_shim.c).  The sizes are the kernel's, so the core allocates
+ * the same buffers in both.
+ */
+#define LZO_E_OK 0
+#define LZO_E_INPUT_OVERRUN (-4)
+#define LZO_E_OUTPUT_OVERRUN (-5)
+#define LZO_E_LOOKBEHIND_OVERRUN (-6)
+#define LZO1X_1_MEM_COMPRESS (16384 * sizeof (unsigned char *))
+#define lzo1x_worst_compress(x) ((x) + ((x) / 16) + 64 + 3)
+
+int lzo1x_1_compress(const unsigned char * src, size_t src_len,
+        unsigned char * dst, size_t * dst_len, void * wrkmem);
+int lzo1x_decompress_safe(const unsigned char * src, size_t src_len,
+        unsigned char * dst, size_t * dst_len);
+
+//----------------------------------------------------------------------------
+
+/*
+ * RADIX TREE.  Only the calls the "radix" index backend makes.  Each node
+ * knows its own height (like the kernel's), so a lockless lookup that reads
+ * the root while the tree is being grown still walks a consistent tree.
+ */
+#define RADIX_TREE_MAP_SHIFT 6
+#define RADIX_TREE_MAP_SIZE (1UL << RADIX_TREE_MAP_SHIFT)
+#define RADIX_TREE_MAP_MASK (RADIX_TREE_MAP_SIZE - 1)
+
+struct radix_tree_node {
+    unsigned int height;    //1 for the nodes that hold items
+    unsigned int count;     //slots in use
+    void * slots[RADIX_TREE_MAP_SIZE];
+    struct rcu_head rcu_head;
+};
+
+struct radix_tree_root {
+    gfp_t gfp_mask;
+    struct radix_tree_node * rnode;
+};
+
+#define INIT_RADIX_TREE(root, mask) \
+    do { (root)->gfp_mask = (mask); (root)->rnode = NULL; } while (0)
+
+void ** radix_tree_lookup_slot(struct radix_tree_root * root,
+        unsigned long index);
+void * radix_tree_lookup(struct radix_tree_root * root, unsigned long index);
+int radix_tree_insert(struct radix_tree_root * root, unsigned long index,
+        void * item);
+void * radix_tree_delete(struct radix_tree_root * root, unsigned long index);
+unsigned int radix_tree_gang_lookup(struct radix_tree_root * root,
+        void ** results, unsigned long first_index, unsigned int max_items);
+#define radix_tree_deref_slot(slot) rcu_dereference(*(slot))
+#define radix_tree_replace_slot(slot, item) rcu_assign_pointer(*(slot), (item))
+//nodes are allocated with malloc() as they're needed, there's no preloading
+#define radix_tree_preload(gfp_mask) 0
+#define radix_tree_preload_end()
+
+#endif
@@ -0,0 +1,1133 @@
+/*
+ * sstore blob store tests.
+ *
+ * Runs the store (sstore_core.c) in user space, on top of sstore_shim.h, the
+ * same way bench_core.c does, and checks that what it hands back is what was
+ * put in, for the parts of it that are easy to get subtly wrong and hard to
+ * see go wrong through the device.  Each test gets a device of its own, and
+ * prints one line saying how it went.  Writes and deletes take the device's
+ * mutex, the same as the driver does; reads don't.
+ *
+ * $ make test_core
+ * $ ./test_core [-b backend]
+ *
+ * It exits with 1 if any check failed (each failed check is printed too).
+ * "make check" runs it with both backends.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "sstore_core.h"
+
+//check that cond holds, counting (and printing) it if it doesn't
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+int check(int ok, const char * what, const char * file, int line);
+struct sstore * newDevice();
+void freeDevice(struct sstore * device);
+int keyWrite(struct sstore * device, const char * key, const char * data);
+int keyCheck(struct sstore * device, const char * key, const char * data);
+int keyDelete(struct sstore * device, const char * key);
+void * keyReader(void * arg);
+void testKeys();
+void makeText(char * data, int size, int seed);
+int blobWrite(struct sstore * device, int index, const char * data, int size);
+int blobCheck(struct sstore * device, int index, const char * data, int size);
+void testCompression();
+int blobDelete(struct sstore * device, int index);
+int blobAppend(struct sstore * device, int index, const char * data, int size);
+void testSharing();
+struct sstore_snapshot * snapshotTake(struct sstore * device);
+int snapshotCheck(struct sstore * device, struct sstore_snapshot * snapshot,
+        int index, const char * data);
+int liveCheck(struct sstore * device, int index, const char * data);
+void testSnapshots();
+struct blob * blobPeek(struct sstore * device, int index);
+void * tailReader(void * arg);
+void testAppend();
+void * quickReader(void * arg);
+void testQuickReads();
+void testPunch();
+void testVersions();
+void testEviction();
+
+int failures = 0;       //checks that failed, in all
+int test_failures = 0;  //and in the test being run
+
+
+int main(int argc, char ** argv)
+{
+    int option = 0;
+
+    while ((option = getopt(argc, argv, "b:")) != -1) {
+        switch (option) {
+            case 'b': index_backend = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-b backend]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    max_blobs = 4096;
+    max_size = 64 * 1024;
+    if (sstore_core_init()) {
+        fprintf(stderr, "couldn't set up the store (bad backend?)\n");
+        return 1;
+    }
+    printf("backend \"%s\"\n", sstore_index->name);
+
+    testKeys();
+    testCompression();
+    testSharing();
+    testSnapshots();
+    testAppend();
+    testQuickReads();
+    testPunch();
+    testVersions();
+    testEviction();
+
+    sstore_core_exit();
+    printf("%s\n", failures ? "FAILED" : "all passed");
+    return failures ? 1 : 0;
+}
+
+
+
+int check(int ok, const char * what, const char * file, int line) {
+    if (!ok) {
+        printf("  %s:%d: check failed: %s\n", file, line, what);
+        ++failures;
+        ++test_failures;
+    }
+    return ok;
+}
+
+
+
+//a new, empty device (exits if it can't be made)
+struct sstore * newDevice() {
+    struct sstore * device;
+
+    //struct sstore is cache line aligned, which calloc() doesn't promise
+    if (posix_memalign((void **) &device, 64, sizeof (struct sstore)))
+        device = NULL;
+    else
+        memset(device, 0, sizeof (struct sstore));
+    if (!device || sstore_device_init(device)) {
+        printf("\nError in setting up a device: test_core.c\n");
+        exit(1);
+    }
+    return device;
+}
+
+//clear a device and free it, and everything waiting on a grace period
+void freeDevice(struct sstore * device) {
+    down_interruptible(&device->mutex);
+    sstore_device_clear(device);
+    up(&device->mutex);
+    rcu_barrier();
+    sstore_device_destroy(device);
+    free(device);
+}
+
+
+
+/*
+ * KEYS.  The key table doubles a few buckets at a time, with keys linked into
+ * two tables at once while it does (see KEYS in sstore_core.c), so this
+ * writes enough keys to double it several times, checks every key at every
+ * step of the way while it's part way through, deletes keys while it's part
+ * way through, and has a thread reading keys without the mutex the whole time.
+ */
+#define TEST_KEYS 2000
+#define TEST_STABLE_KEYS 100    //keys the reader thread reads (never deleted)
+
+//what the reader thread is given
+struct key_reader {
+    struct sstore * device;
+    volatile int stop;
+    unsigned long reads;
+};
+
+int keyWrite(struct sstore * device, const char * key, const char * data) {
+    ssize_t result = 0;
+
+    down_interruptible(&device->mutex);
+    result = sstore_key_write(device, key, strlen(key),
+                sstore_key_hash(key, strlen(key)), strlen(data), data);
+    up(&device->mutex);
+    return result == (ssize_t) strlen(data);
+}
+
+//whether key holds data (or doesn't exist, if data is NULL)
+int keyCheck(struct sstore * device, const char * key, const char * data) {
+    char buffer[64];
+    ssize_t result = 0;
+
+    result = sstore_key_read(device, key, strlen(key),
+                sstore_key_hash(key, strlen(key)), sizeof (buffer), buffer);
+    if (!data)
+        return result == -ENOENT;
+    return result == (ssize_t) strlen(data) && !memcmp(buffer, data, result);
+}
+
+int keyDelete(struct sstore * device, const char * key) {
+    int result = 0;
+
+    down_interruptible(&device->mutex);
+    result = sstore_key_delete(device, key, strlen(key),
+                                        sstore_key_hash(key, strlen(key)));
+    up(&device->mutex);
+    return result == 0;
+}
+
+//read the stable keys over and over until told to stop
+void * keyReader(void * arg) {
+    struct key_reader * reader = arg;
+    char key[32];
+    char data[32];
+    int i = 0;
+
+    while (!reader->stop) {
+        sprintf(key, "key-%d", i);
+        sprintf(data, "value-%d", i);
+        CHECK(keyCheck(reader->device, key, data));
+        ++reader->reads;
+        i = (i + 1) % TEST_STABLE_KEYS;
+    }
+    return NULL;
+}
+
+void testKeys() {
+    struct sstore * device = newDevice();
+    struct key_reader reader;
+    pthread_t thread;
+    char key[32];
+    char data[32];
+    unsigned int buckets = 0;   //buckets in the key table
+    int doublings = 0;          //times it was seen to double
+    int moving = 0;             //writes made while it was
+    char gone[TEST_KEYS] = { 0 };   //which keys were deleted
+    int deleted = 0;
+    int i = 0;
+    int j = 0;
+
+    test_failures = 0;
+    for (i = 0; i < TEST_STABLE_KEYS; ++i) {
+        sprintf(key, "key-%d", i);
+        sprintf(data, "value-%d", i);
+        CHECK(keyWrite(device, key, data));
+    }
+    reader.device = device;
+    reader.stop = 0;
+    reader.reads = 0;
+    pthread_create(&thread, NULL, keyReader, &reader);
+
+    for (i = TEST_STABLE_KEYS; i < TEST_KEYS; ++i) {
+        sprintf(key, "key-%d", i);
+        sprintf(data, "value-%d", i);
+        CHECK(keyWrite(device, key, data));
+
+        /*
+         * part way through moving keys to a bigger table: delete the key just
+         * written (which is in the new table) and one written a while ago
+         * (which may not have moved yet), then check every key
+         */
+        if (device->old_keys) {
+            ++moving;
+            CHECK(keyDelete(device, key));
+            gone[i] = 1;
+            j = i / 2;
+            if (j >= TEST_STABLE_KEYS && !gone[j]) {
+                sprintf(key, "key-%d", j);
+                CHECK(keyDelete(device, key));
+                gone[j] = 1;
+            }
+            for (j = 0; j <= i; ++j) {
+                sprintf(key, "key-%d", j);
+                sprintf(data, "value-%d", j);
+                CHECK(keyCheck(device, key, gone[j] ? NULL : data));
+            }
+        }
+        if (device->keys->mask + 1 != buckets) {
+            if (buckets)
+                ++doublings;
+            buckets = device->keys->mask + 1;
+        }
+        //let a grace period go by now and then, so the moving goes on
+        if (!(i % 8))
+            rcu_barrier();
+    }
+
+    reader.stop = 1;
+    pthread_join(thread, NULL);
+
+    //every key, once the moving is all done
+    for (i = 0; i < TEST_KEYS; ++i) {
+        sprintf(key, "key-%d", i);
+        sprintf(data, "value-%d", i);
+        CHECK(keyCheck(device, key, gone[i] ? NULL : data));
+        deleted += gone[i];
+    }
+
+    CHECK(doublings >= 3);
+    CHECK(moving > 0);
+    CHECK(device->key_count == TEST_KEYS - deleted);
+    printf("keys: %d writes, %d deleted, %d doublings, %d writes while "
+            "moving, %lu lockless reads: %s\n", TEST_KEYS, deleted, doublings,
+            moving, reader.reads, test_failures ? "FAILED" : "ok");
+
+    freeDevice(device);
+}
+
+
+
+/*
+ * COMPRESSION.  Blobs of compress_min bytes and up are kept compressed (see
+ * COMPRESSION in sstore_core.c), and every read decompresses the whole blob
+ * and copies out the part that was asked for, so this writes text of sizes
+ * around the page and chunk boundaries, reads each one back whole and in
+ * pieces at all sorts of offsets, and checks that a blob whose compressed data
+ * is corrupt fails the read without touching the reader's buffer.
+ */
+#define TEST_COMPRESS_MIN 256
+
+//size bytes of text that compresses well (different for each seed)
+void makeText(char * data, int size, int seed) {
+    char line[80];
+    int length = 0;
+    int i = 0;
+
+    while (i < size) {
+        length = sprintf(line, "{\"id\": %d, \"name\": \"item-%d\", "
+                            "\"tags\": [\"a\", \"b\"]}\n", seed + i, seed);
+        if (length > size - i)
+            length = size - i;
+        memcpy(data + i, line, length);
+        i += length;
+    }
+}
+
+int blobWrite(struct sstore * device, int index, const char * data, int size) {
+    ssize_t result = 0;
+
+    down_interruptible(&device->mutex);
+    result = sstore_do_write(device, index, size, data);
+    up(&device->mutex);
+    return result == size;
+}
+
+//whether the blob at index holds exactly size bytes of data
+int blobCheck(struct sstore * device, int index, const char * data, int size) {
+    char * buffer = malloc(size + 1);
+    ssize_t result = 0;
+
+    result = sstore_do_read(device, index, 0, size + 1, buffer);
+    result = result == size && !memcmp(buffer, data, size);
+    free(buffer);
+    return result;
+}
+
+void testCompression() {
+    struct sstore * device = newDevice();
+    int sizes[] = { TEST_COMPRESS_MIN, 1000, PAGE_SIZE - 1, PAGE_SIZE,
+            PAGE_SIZE + 1, 3 * PAGE_SIZE + 17, 40000, SSTORE_COMPRESS_MAX };
+    int count = sizeof (sizes) / sizeof (sizes[0]);
+    char * data = malloc(SSTORE_COMPRESS_MAX);
+    char * buffer = malloc(SSTORE_COMPRESS_MAX);
+    struct blob * blob;
+    int compressed = 0;         //blobs that were stored compressed
+    int reads = 0;              //range reads checked
+    unsigned int stored = 0;
+    int offset = 0;
+    int size = 0;
+    int i = 0;
+    int j = 0;
+
+    test_failures = 0;
+    CHECK(sstore_set_compression(device, TEST_COMPRESS_MIN) == 0);
+    for (i = 0; i < count; ++i) {
+        makeText(data, sizes[i], i);
+        CHECK(blobWrite(device, i + 1, data, sizes[i]));
+        blob = sstore_blob_get(device, i + 1);
+        if (CHECK(blob != NULL)) {
+            compressed += blob->stored != 0;
+            sstore_blob_put(blob);
+        }
+    }
+    //(too short to be compressed)
+    makeText(data, TEST_COMPRESS_MIN - 1, count);
+    CHECK(blobWrite(device, count + 1, data, TEST_COMPRESS_MIN - 1));
+    CHECK(blobCheck(device, count + 1, data, TEST_COMPRESS_MIN - 1));
+
+    for (i = 0; i < count; ++i) {
+        makeText(data, sizes[i], i);
+        CHECK(blobCheck(device, i + 1, data, sizes[i]));
+        //pieces of every size, from everywhere, and past the end
+        for (size = 1; size <= sizes[i]; size = size * 3 + 1) {
+            for (offset = 0; offset < sizes[i] + 2;
+                                            offset += sizes[i] / 7 + 1) {
+                j = offset < sizes[i] ? min(size, sizes[i] - offset) : 0;
+                CHECK(sstore_do_read(device, i + 1, offset, size,
+                                                            buffer) == j);
+                CHECK(!memcmp(buffer, data + offset, j));
+                ++reads;
+            }
+        }
+        //the last byte, and across the first page boundary
+        CHECK(sstore_do_read(device, i + 1, sizes[i] - 1, 8, buffer) == 1);
+        CHECK(buffer[0] == data[sizes[i] - 1]);
+        if (sizes[i] >= PAGE_SIZE + 3) {
+            CHECK(sstore_do_read(device, i + 1, PAGE_SIZE - 3, 6,
+                                                            buffer) == 6);
+            CHECK(!memcmp(buffer, data + PAGE_SIZE - 3, 6));
+        }
+    }
+    CHECK(compressed == count);
+
+    //corrupt data: the read fails and leaves the buffer alone
+    blob = sstore_blob_get(device, count);
+    if (CHECK(blob != NULL && blob->stored)) {
+        stored = blob->stored;
+        blob->stored = stored / 2;
+        memset(buffer, 'x', SSTORE_COMPRESS_MAX);
+        CHECK(sstore_do_read(device, count, 100, 5000, buffer) == -EIO);
+        for (j = 0; j < SSTORE_COMPRESS_MAX && buffer[j] == 'x'; ++j)
+            ;
+        CHECK(j == SSTORE_COMPRESS_MAX);
+        blob->stored = stored;
+        sstore_blob_put(blob);
+    }
+
+    printf("compression: %d blobs, %d compressed, %d range reads: %s\n",
+            count + 1, compressed, reads, test_failures ? "FAILED" : "ok");
+
+    free(data);
+    free(buffer);
+    freeDevice(device);
+}
+
+
+
+/*
+ * SHARING.  With dedup set, blobs with the same data share one copy of it
+ * (see SHARING in sstore_core.c), which only counts in the device's bytes
+ * once.  This writes the same data at several indices, and then overwrites,
+ * appends to and deletes them one at a time, checking every blob's data, the
+ * number of shares and the bytes counted each step of the way, and that the
+ * bytes are back where they started once everything's gone.
+ */
+#define TEST_SHARERS 6
+#define TEST_SHARE_SIZE 3000
+
+int blobDelete(struct sstore * device, int index) {
+    int result = 0;
+
+    down_interruptible(&device->mutex);
+    result = sstore_do_delete(device, index);
+    up(&device->mutex);
+    return result == 0;
+}
+
+int blobAppend(struct sstore * device, int index, const char * data, int size) {
+    ssize_t result = 0;
+
+    down_interruptible(&device->mutex);
+    result = sstore_do_append(device, index, size, data);
+    up(&device->mutex);
+    return result == size;
+}
+
+void testSharing() {
+    struct sstore * device;
+    char * texts[3];            //the data being shared (and some that isn't)
+    char * appended;            //texts[0] with more on the end
+    char * expect[TEST_SHARERS + 1];    //what each index should hold
+    int sizes[TEST_SHARERS + 1];
+    unsigned long baseline = 0; //the device's bytes before any writes
+    unsigned long one = 0;      //and with one copy of texts[0]
+    int i = 0;
+    int j = 0;
+
+    test_failures = 0;
+    dedup = 1;
+    device = newDevice();
+    dedup = 0;
+    CHECK(device->shares != NULL);
+    baseline = device->bytes;
+
+    for (i = 0; i < 3; ++i) {
+        texts[i] = malloc(TEST_SHARE_SIZE);
+        makeText(texts[i], TEST_SHARE_SIZE, i * 1000);
+    }
+    appended = malloc(TEST_SHARE_SIZE + 10);
+    memcpy(appended, texts[0], TEST_SHARE_SIZE);
+    memcpy(appended + TEST_SHARE_SIZE, "0123456789", 10);
+
+    //the same data everywhere: one share, one copy's worth of bytes
+    for (i = 1; i <= TEST_SHARERS; ++i) {
+        CHECK(blobWrite(device, i, texts[0], TEST_SHARE_SIZE));
+        expect[i] = texts[0];
+        sizes[i] = TEST_SHARE_SIZE;
+        if (i == 1)
+            one = device->bytes;
+        CHECK(device->share_count == 1);
+        CHECK(device->bytes == one);
+    }
+    CHECK(one > baseline);
+    CHECK(device->shared_bytes == (TEST_SHARERS - 1) * (one - baseline));
+
+    //overwrite the first one (whose data the share took over), and another
+    CHECK(blobWrite(device, 1, texts[1], TEST_SHARE_SIZE));
+    expect[1] = texts[1];
+    CHECK(blobWrite(device, 4, texts[1], TEST_SHARE_SIZE));
+    expect[4] = texts[1];
+    CHECK(device->share_count == 2);
+    CHECK(device->bytes == baseline + 2 * (one - baseline));
+    //data nobody else has is a share of its own
+    CHECK(blobWrite(device, 5, texts[2], TEST_SHARE_SIZE));
+    expect[5] = texts[2];
+    CHECK(device->share_count == 3);
+    //appending to shared data copies it
+    CHECK(blobAppend(device, 2, "0123456789", 10));
+    expect[2] = appended;
+    sizes[2] = TEST_SHARE_SIZE + 10;
+    CHECK(device->share_count == 3);
+    for (i = 1; i <= TEST_SHARERS; ++i)
+        CHECK(blobCheck(device, i, expect[i], sizes[i]));
+
+    //delete them one at a time, from the middle (the rest move down one)
+    CHECK(device->renumber);
+    for (j = TEST_SHARERS; j > 0; --j) {
+        i = (j + 1) / 2;
+        CHECK(blobDelete(device, i));
+        memmove(expect + i, expect + i + 1, (j - i) * sizeof (char *));
+        memmove(sizes + i, sizes + i + 1, (j - i) * sizeof (int));
+        for (i = 1; i < j; ++i)
+            CHECK(blobCheck(device, i, expect[i], sizes[i]));
+    }
+    CHECK(device->share_count == 0);
+    CHECK(device->shared_bytes == 0);
+    CHECK(device->bytes == baseline);
+
+    printf("sharing: %d blobs, %lu bytes for one copy: %s\n", TEST_SHARERS,
+            one - baseline, test_failures ? "FAILED" : "ok");
+
+    for (i = 0; i < 3; ++i)
+        free(texts[i]);
+    free(appended);
+    freeDevice(device);
+}
+
+
+
+/*
+ * SNAPSHOTS.  A snapshot keeps what every index held when it was taken, by
+ * having the blobs there kept before each change to an index (see SNAPSHOTS
+ * in sstore_core.c).  So this changes indices every way there is to change
+ * them (overwriting, writing an empty one, appending, deleting with the rest
+ * moving down, punching and evicting), with two snapshots taken along the
+ * way, and reads every index back through each of them, and the live ones.
+ * Dropping the snapshots has to let go of everything they kept.
+ */
+#define TEST_BIG_SIZE 9000      //a blob in chunks
+
+struct sstore_snapshot * snapshotTake(struct sstore * device) {
+    struct sstore_snapshot * snapshot;
+
+    down_interruptible(&device->mutex);
+    snapshot = sstore_snapshot_take(device);
+    up(&device->mutex);
+    if (!snapshot) {
+        printf("\nError in taking a snapshot: test_core.c\n");
+        exit(1);
+    }
+    return snapshot;
+}
+
+//whether the snapshot has data at index (or had nothing there, if it's NULL)
+int snapshotCheck(struct sstore * device, struct sstore_snapshot * snapshot,
+                                            int index, const char * data) {
+    char buffer[TEST_BIG_SIZE + 16];
+    ssize_t result = 0;
+
+    result = sstore_snapshot_read(device, snapshot, index, 0, sizeof (buffer),
+                                                                    buffer);
+    if (!data)
+        return result == -ENODATA;
+    return result == (ssize_t) strlen(data) && !memcmp(buffer, data, result);
+}
+
+//whether the device has data at index now (or nothing, if it's NULL)
+int liveCheck(struct sstore * device, int index, const char * data) {
+    char buffer[64];
+    ssize_t result = 0;
+
+    result = sstore_do_read(device, index, 0, sizeof (buffer), buffer);
+    if (!data)
+        return result == -EAGAIN;
+    return result == (ssize_t) strlen(data) && !memcmp(buffer, data, result);
+}
+
+void testSnapshots() {
+    struct sstore * device = newDevice();
+    struct sstore_snapshot * first;     //taken before anything changes
+    struct sstore_snapshot * second;    //after the overwrites and appends
+    struct sstore_snapshot * third;     //before everything is evicted
+    char big[TEST_BIG_SIZE + 1];
+    char bigger[TEST_BIG_SIZE + 4];     //big, appended to
+    char buffer[64];
+    unsigned long kept = 0;
+
+    test_failures = 0;
+    memset(big, 'b', TEST_BIG_SIZE);
+    big[TEST_BIG_SIZE] = '\0';
+    strcpy(bigger, big);
+    strcat(bigger, "xyz");
+
+    CHECK(blobWrite(device, 1, "one", 3));
+    CHECK(blobWrite(device, 2, "two", 3));
+    CHECK(blobWrite(device, 3, "three", 5));
+    CHECK(blobWrite(device, 5, "five", 4));
+    CHECK(blobWrite(device, 6, big, TEST_BIG_SIZE));
+    first = snapshotTake(device);
+
+    //an overwrite that would be made in place, an empty index, and appends
+    CHECK(blobWrite(device, 1, "ONE", 3));
+    CHECK(blobWrite(device, 4, "four", 4));
+    CHECK(blobAppend(device, 2, "TWO", 3));
+    CHECK(blobAppend(device, 6, "xyz", 3));
+    second = snapshotTake(device);
+
+    //a delete moves 4 up to 6 down one, under both snapshots
+    CHECK(device->renumber);
+    CHECK(blobDelete(device, 3));
+    CHECK(blobWrite(device, 1, "uno", 3));
+
+    CHECK(snapshotCheck(device, first, 1, "one"));
+    CHECK(snapshotCheck(device, first, 2, "two"));
+    CHECK(snapshotCheck(device, first, 3, "three"));
+    CHECK(snapshotCheck(device, first, 4, NULL));
+    CHECK(snapshotCheck(device, first, 5, "five"));
+    CHECK(snapshotCheck(device, first, 6, big));
+    CHECK(snapshotCheck(device, second, 1, "ONE"));
+    CHECK(snapshotCheck(device, second, 2, "twoTWO"));
+    CHECK(snapshotCheck(device, second, 3, "three"));
+    CHECK(snapshotCheck(device, second, 4, "four"));
+    CHECK(snapshotCheck(device, second, 5, "five"));
+    CHECK(snapshotCheck(device, second, 6, bigger));
+    CHECK(liveCheck(device, 1, "uno"));
+    CHECK(liveCheck(device, 3, "four"));
+    CHECK(liveCheck(device, 4, "five"));
+    CHECK(liveCheck(device, 6, NULL));
+    //part of a blob, through a snapshot
+    CHECK(sstore_snapshot_read(device, second, 6, TEST_BIG_SIZE - 2, 10,
+                                                                buffer) == 5);
+    CHECK(!memcmp(buffer, "bbxyz", 5));
+
+    //punch out every index
+    down_interruptible(&device->mutex);
+    CHECK(sstore_do_punch(device, 1, 7) == 0);
+    up(&device->mutex);
+    CHECK(liveCheck(device, 1, NULL));
+    CHECK(snapshotCheck(device, first, 1, "one"));
+    CHECK(snapshotCheck(device, first, 4, NULL));
+    CHECK(snapshotCheck(device, first, 6, big));
+    CHECK(snapshotCheck(device, second, 2, "twoTWO"));
+    CHECK(snapshotCheck(device, second, 4, "four"));
+    CHECK(snapshotCheck(device, second, 6, bigger));
+
+    //evict everything
+    CHECK(blobWrite(device, 1, "e-one", 5));
+    CHECK(blobWrite(device, 2, "e-two", 5));
+    third = snapshotTake(device);
+    down_interruptible(&device->mutex);
+    CHECK(sstore_evict(device, ~0UL) > 0);
+    up(&device->mutex);
+    CHECK(liveCheck(device, 1, NULL));
+    CHECK(liveCheck(device, 2, NULL));
+    CHECK(snapshotCheck(device, third, 1, "e-one"));
+    CHECK(snapshotCheck(device, third, 2, "e-two"));
+    CHECK(snapshotCheck(device, third, 3, NULL));
+    CHECK(snapshotCheck(device, first, 1, "one"));
+    CHECK(snapshotCheck(device, second, 1, "ONE"));
+
+    kept = device->kept_count;
+    CHECK(device->snapshot_count == 3);
+    down_interruptible(&device->mutex);
+    sstore_snapshot_drop(device, second);
+    sstore_snapshot_drop(device, first);
+    sstore_snapshot_drop(device, third);
+    up(&device->mutex);
+    CHECK(device->kept_count == 0);
+    CHECK(device->snapshot_count == 0);
+    CHECK(device->snapshots == NULL);
+
+    printf("snapshots: 3 snapshots, %lu indices kept: %s\n", kept,
+            test_failures ? "FAILED" : "ok");
+
+    freeDevice(device);
+}
+
+
+
+/*
+ * APPEND.  Appends add to the end of a blob where it is when there's room
+ * (or chunks can be added for it), and move it to a bigger blob otherwise
+ * (see sstore_do_append()), while readers following the blob with
+ * sstore_tail_blob() get each new piece as it comes.  So this appends pieces
+ * of all sizes to a blob until it's well into chunks, with a thread tailing
+ * it the whole time, checks that the data comes out right both ways and that
+ * the appends that should have been made in place were, and checks the
+ * limits: max_size, and bad arguments.
+ */
+#define TEST_APPEND_SIZE 20000
+
+//what the tail reader thread is given
+struct tail_reader {
+    struct sstore * device;
+    const char * data;          //what it should read
+    int size;                   //and how much of it
+    int read;                   //how much it did read
+};
+
+//the blob at index, for telling whether it was replaced (not for use)
+struct blob * blobPeek(struct sstore * device, int index) {
+    struct blob * blob = sstore_blob_get(device, index);
+
+    if (blob)
+        sstore_blob_put(blob);
+    return blob;
+}
+
+//follow the blob at index 1 until it has all of the data
+void * tailReader(void * arg) {
+    struct tail_reader * reader = arg;
+    char buffer[1000];
+    ssize_t result = 0;
+
+    while (reader->read < reader->size) {
+        result = sstore_tail_blob(reader->device, 1, reader->read,
+                            sizeof (buffer), buffer, msecs_to_jiffies(10000));
+        if (!CHECK(result > 0))
+            break;
+        CHECK(!memcmp(buffer, reader->data + reader->read, result));
+        reader->read += result;
+    }
+    return NULL;
+}
+
+void testAppend() {
+    struct sstore * device = newDevice();
+    struct tail_reader reader;
+    pthread_t thread;
+    char * data = malloc(max_size);
+    char buffer[16];
+    struct blob * blob;
+    int appends = 0;
+    int piece = 0;
+    int done = 0;
+
+    test_failures = 0;
+    makeText(data, max_size, 0);
+    reader.device = device;
+    reader.data = data;
+    reader.size = TEST_APPEND_SIZE;
+    reader.read = 0;
+    pthread_create(&thread, NULL, tailReader, &reader);
+
+    //the first append writes the blob, and the rest add to it
+    for (done = 0; done < TEST_APPEND_SIZE; done += piece) {
+        piece = min((appends * 37) % 700 + 1, TEST_APPEND_SIZE - done);
+        CHECK(blobAppend(device, 1, data + done, piece));
+        ++appends;
+        if (!(appends % 16))
+            usleep(100);
+    }
+    pthread_join(thread, NULL);
+    CHECK(reader.read == TEST_APPEND_SIZE);
+    CHECK(blobCheck(device, 1, data, TEST_APPEND_SIZE));
+    //nothing more to follow
+    CHECK(sstore_tail_blob(device, 1, TEST_APPEND_SIZE, sizeof (buffer),
+                                                        buffer, 0) == -EAGAIN);
+
+    //in place while there's room, moved when there isn't
+    CHECK(blobWrite(device, 2, data, 100));
+    blob = blobPeek(device, 2);
+    CHECK(blobAppend(device, 2, data + 100, 10));
+    CHECK(blobPeek(device, 2) == blob);
+    CHECK(blobAppend(device, 2, data + 110, 100));
+    CHECK(blobPeek(device, 2) != blob);
+    CHECK(blobCheck(device, 2, data, 210));
+    //chunked data just gets more chunks
+    blob = blobPeek(device, 1);
+    CHECK(blobAppend(device, 1, data + TEST_APPEND_SIZE, 5000));
+    CHECK(blobPeek(device, 1) == blob);
+    CHECK(blobCheck(device, 1, data, TEST_APPEND_SIZE + 5000));
+
+    //up to max_size and no further
+    CHECK(blobWrite(device, 3, data, max_size - 10));
+    down_interruptible(&device->mutex);
+    CHECK(sstore_do_append(device, 3, 20, data + max_size - 10) == 10);
+    CHECK(sstore_do_append(device, 3, 1, data) == -EFBIG);
+    CHECK(sstore_do_append(device, 0, 1, data) == -EINVAL);
+    CHECK(sstore_do_append(device, max_blobs + 1, 1, data) == -EINVAL);
+    CHECK(sstore_do_append(device, 3, 0, data) == -EINVAL);
+    up(&device->mutex);
+    CHECK(blobCheck(device, 3, data, max_size));
+
+    printf("append: %d appends, %d bytes followed: %s\n", appends,
+            reader.read, test_failures ? "FAILED" : "ok");
+
+    free(data);
+    freeDevice(device);
+}
+
+
+
+/*
+ * QUICK READS.  Small reads copy without a reference to the blob (see
+ * sstore_read_quick() in sstore_core.c), so they can be reading a blob while
+ * it's overwritten in place, and have to notice and read it again.  This has
+ * threads reading a blob while it's overwritten over and over with data of
+ * two sizes, each all one letter, and checks that every read got all of one
+ * write: the right size for its letter, and nothing but that letter.
+ */
+#define TEST_QUICK_WRITES 20000
+#define TEST_QUICK_READERS 2
+
+//what each reader thread is given
+struct quick_reader {
+    struct sstore * device;
+    volatile int * stop;
+    unsigned long reads;
+};
+
+void * quickReader(void * arg) {
+    struct quick_reader * reader = arg;
+    char buffer[256];
+    ssize_t result = 0;
+    int i = 0;
+
+    while (!*reader->stop) {
+        result = sstore_do_read(reader->device, 1, 0, sizeof (buffer), buffer);
+        ++reader->reads;
+        if (!CHECK(result == (buffer[0] == 'a' ? 200 : 150)))
+            continue;
+        for (i = 1; i < result && buffer[i] == buffer[0]; ++i)
+            ;
+        CHECK(i == result);
+    }
+    return NULL;
+}
+
+void testQuickReads() {
+    struct sstore * device = newDevice();
+    struct quick_reader readers[TEST_QUICK_READERS];
+    pthread_t threads[TEST_QUICK_READERS];
+    volatile int stop = 0;
+    char data[2][200];
+    long in_place = atomic_long_read(&sstore_allocs.in_place);
+    unsigned long reads = 0;
+    int i = 0;
+
+    test_failures = 0;
+    memset(data[0], 'a', 200);
+    memset(data[1], 'b', 150);
+    CHECK(blobWrite(device, 1, data[0], 200));
+    for (i = 0; i < TEST_QUICK_READERS; ++i) {
+        readers[i].device = device;
+        readers[i].stop = &stop;
+        readers[i].reads = 0;
+        pthread_create(&threads[i], NULL, quickReader, &readers[i]);
+    }
+    //(once they're all reading)
+    for (i = 0; i < TEST_QUICK_READERS; ++i) {
+        while (!readers[i].reads)
+            usleep(100);
+    }
+
+    for (i = 0; i < TEST_QUICK_WRITES; ++i)
+        CHECK(blobWrite(device, 1, data[i % 2], i % 2 ? 150 : 200));
+
+    stop = 1;
+    for (i = 0; i < TEST_QUICK_READERS; ++i) {
+        pthread_join(threads[i], NULL);
+        reads += readers[i].reads;
+    }
+    in_place = atomic_long_read(&sstore_allocs.in_place) - in_place;
+    //(readers not holding references, most of them were)
+    CHECK(in_place > TEST_QUICK_WRITES / 2);
+    printf("quick reads: %lu reads, %ld of %d overwrites in place: %s\n",
+            reads, in_place, TEST_QUICK_WRITES,
+            test_failures ? "FAILED" : "ok");
+
+    freeDevice(device);
+}
+
+
+
+/*
+ * PUNCH.  With renumber off, a delete just leaves a hole at its index instead
+ * of moving every blob after it down (see sstore_do_punch()), and a range of
+ * indices can be punched at once.  So this punches single indices, a range in
+ * the middle and a range off the end, checking which blobs are left where and
+ * what blob_count ends up as after each, that a delete with renumber on still
+ * moves the blobs down, that bad ranges are turned away without touching
+ * anything, and that clearing the device empties all of it.
+ */
+#define TEST_PUNCH_BLOBS 20
+
+void testPunch() {
+    struct sstore * device = newDevice();
+    char data[TEST_PUNCH_BLOBS + 1][16];
+    int i = 0;
+
+    test_failures = 0;
+    for (i = 1; i <= TEST_PUNCH_BLOBS; ++i) {
+        sprintf(data[i], "blob %d", i);
+        CHECK(blobWrite(device, i, data[i], strlen(data[i])));
+    }
+    CHECK(device->blob_count == TEST_PUNCH_BLOBS);
+
+    //a hole at 3, with everything after it left where it is
+    device->renumber = 0;
+    CHECK(blobDelete(device, 3));
+    CHECK(liveCheck(device, 3, NULL));
+    CHECK(liveCheck(device, 4, data[4]));
+    CHECK(device->blob_count == TEST_PUNCH_BLOBS);
+    //(a hole is still an index, and deleting it again is fine)
+    CHECK(blobDelete(device, 3));
+
+    //5 up to 10 in the middle, then 15 to the end
+    down_interruptible(&device->mutex);
+    CHECK(sstore_do_punch(device, 5, 10) == 0);
+    CHECK(sstore_do_punch(device, 15, max_blobs + 1) == 0);
+    up(&device->mutex);
+    for (i = 1; i <= TEST_PUNCH_BLOBS; ++i) {
+        if (i == 3 || (i >= 5 && i < 10) || i >= 15)
+            CHECK(liveCheck(device, i, NULL));
+        else
+            CHECK(liveCheck(device, i, data[i]));
+    }
+    CHECK(device->blob_count == 14);
+
+    //bad ranges, and deleting past the last blob
+    down_interruptible(&device->mutex);
+    CHECK(sstore_do_punch(device, 0, 2) == -EINVAL);
+    CHECK(sstore_do_punch(device, 4, 4) == -EINVAL);
+    CHECK(sstore_do_punch(device, 4, 2) == -EINVAL);
+    CHECK(sstore_do_punch(device, 1, max_blobs + 2) == -EINVAL);
+    CHECK(sstore_do_delete(device, 15) == -EINVAL);
+    CHECK(sstore_do_delete(device, 0) == -EINVAL);
+    up(&device->mutex);
+    CHECK(liveCheck(device, 1, data[1]));
+    CHECK(liveCheck(device, 14, data[14]));
+    CHECK(device->blob_count == 14);
+
+    //with renumber back on, a delete moves the rest down again
+    device->renumber = 1;
+    CHECK(blobDelete(device, 1));
+    CHECK(liveCheck(device, 1, data[2]));
+    CHECK(liveCheck(device, 2, NULL));
+    CHECK(liveCheck(device, 3, data[4]));
+    CHECK(liveCheck(device, 13, data[14]));
+    CHECK(device->blob_count == 13);
+
+    //and clearing it empties everything
+    down_interruptible(&device->mutex);
+    sstore_device_clear(device);
+    up(&device->mutex);
+    CHECK(liveCheck(device, 1, NULL));
+    CHECK(liveCheck(device, 13, NULL));
+    CHECK(device->blob_count == 0);
+    CHECK(device->bytes == 0);
+    CHECK(blobWrite(device, 1, data[1], strlen(data[1])));
+    CHECK(liveCheck(device, 1, data[1]));
+
+    printf("punch: %d blobs, holes and ranges punched: %s\n",
+            TEST_PUNCH_BLOBS, test_failures ? "FAILED" : "ok");
+
+    freeDevice(device);
+}
+
+
+
+/*
+ * VERSIONS.  Every write and append gives the blob the next version of the
+ * device (see VERSIONS in sstore_core.c), a conditional write only goes in if
+ * the caller has the version that's there, and a conditional read only copies
+ * anything if the caller doesn't.  So this writes, overwrites in place,
+ * appends to, deletes and rewrites a blob, checking each time that the
+ * version moved on and never came back, that writes with a stale version (or
+ * 0, for a blob that's already there) are turned away without touching the
+ * data, and that reads with the current version copy nothing.
+ */
+void testVersions() {
+    struct sstore * device = newDevice();
+    struct sstore_cpu_stats stats;
+    char buffer[16];
+    u64 version = 0;
+    u64 old = 0;
+    u64 seen = 0;           //the newest version seen so far
+    int conflicts = 0;
+
+    test_failures = 0;
+
+    //0 stands for "no blob there yet"
+    down_interruptible(&device->mutex);
+    CHECK(sstore_do_write_if(device, 1, 3, "one", &version) == 3);
+    up(&device->mutex);
+    CHECK(version != 0);
+    seen = version;
+
+    //written again with the version it has, then with that one gone stale
+    old = version;
+    down_interruptible(&device->mutex);
+    CHECK(sstore_do_write_if(device, 1, 3, "ONE", &version) == 3);
+    CHECK(version > old);
+    seen = version;
+    CHECK(sstore_do_write_if(device, 1, 3, "bad", &old) == -ESTALE);
+    ++conflicts;
+    CHECK(old == version);
+    old = 0;
+    CHECK(sstore_do_write_if(device, 1, 3, "bad", &old) == -ESTALE);
+    ++conflicts;
+    CHECK(old == version);
+    //(and an empty index isn't at any version but 0)
+    old = version;
+    CHECK(sstore_do_write_if(device, 2, 3, "bad", &old) == -ESTALE);
+    ++conflicts;
+    CHECK(old == 0);
+    CHECK(sstore_do_write_if(device, 0, 3, "bad", &old) == -EINVAL);
+    up(&device->mutex);
+    CHECK(liveCheck(device, 1, "ONE"));
+    CHECK(liveCheck(device, 2, NULL));
+
+    //nothing to copy while it's current, the data once it's not
+    memset(buffer, 0, sizeof (buffer));
+    CHECK(sstore_do_read_if(device, 1, sizeof (buffer), buffer,
+                                                            &version) == 0);
+    CHECK(buffer[0] == '\0');
+    old = version - 1;
+    CHECK(sstore_do_read_if(device, 1, sizeof (buffer), buffer, &old) == 3);
+    CHECK(old == version);
+    CHECK(!memcmp(buffer, "ONE", 3));
+    CHECK(sstore_do_read_if(device, 2, sizeof (buffer), buffer,
+                                                        &old) == -ENODATA);
+    CHECK(sstore_do_read_if(device, 0, sizeof (buffer), buffer,
+                                                        &old) == -EINVAL);
+
+    //appends and plain writes move it on too
+    CHECK(blobAppend(device, 1, "+", 1));
+    old = 0;
+    CHECK(sstore_do_read_if(device, 1, sizeof (buffer), buffer, &old) == 4);
+    CHECK(old > seen);
+    seen = old;
+    CHECK(blobWrite(device, 1, "uno", 3));
+    old = seen;
+    CHECK(sstore_do_read_if(device, 1, sizeof (buffer), buffer, &old) == 3);
+    CHECK(old > seen);
+    seen = old;
+
+    //a version never comes back, even once the blob is deleted and rewritten
+    CHECK(blobDelete(device, 1));
+    CHECK(blobWrite(device, 1, "one", 3));
+    old = 0;
+    CHECK(sstore_do_read_if(device, 1, sizeof (buffer), buffer, &old) == 3);
+    CHECK(old > seen);
+
+    memset(&stats, 0, sizeof (stats));
+    sstore_stats_sum(device, &stats);
+    CHECK(stats.count[SSTORE_CONFLICTS] == conflicts);
+    printf("versions: %d stale writes turned away: %s\n", conflicts,
+            test_failures ? "FAILED" : "ok");
+
+    freeDevice(device);
+}
+
+
+
+/*
+ * EVICTION.  A device with a byte budget evicts blobs to make room for writes
+ * that would go over it, picking them with the CLOCK algorithm (see EVICTION
+ * in sstore_core.c).  So this fills a device up to its budget with blobs of
+ * one size class, then writes more, checking the bytes never go over the
+ * budget, that blobs read since the clock hand last went by are passed over
+ * for ones that weren't, that a write bigger than the whole budget fails with
+ * -ENOSPC, and that a blob a snapshot has is still there through the snapshot
+ * once it's evicted, without counting against the budget anymore.
+ */
+#define TEST_EVICT_SIZE 1000    //each blob takes up 1024 bytes
+#define TEST_EVICT_BLOBS 8      //how many of them the budget holds
+
+void testEviction() {
+    struct sstore * device = newDevice();
+    struct sstore_snapshot * snapshot;
+    char data[TEST_EVICT_BLOBS + 4][TEST_EVICT_SIZE + 1];
+    char * big = malloc(TEST_EVICT_BLOBS * 1024 + 1);
+    unsigned long evicted = 0;
+    int i = 0;
+
+    test_failures = 0;
+    for (i = 1; i < TEST_EVICT_BLOBS + 4; ++i) {
+        memset(data[i], 'a' + i, TEST_EVICT_SIZE);
+        data[i][TEST_EVICT_SIZE] = '\0';
+    }
+    device->budget = TEST_EVICT_BLOBS * 1024;
+
+    for (i = 1; i <= TEST_EVICT_BLOBS; ++i)
+        CHECK(blobWrite(device, i, data[i], TEST_EVICT_SIZE));
+    CHECK(device->bytes == device->budget);
+
+    /*
+     * every blob was just written, so the hand has to go all the way around
+     * clearing them before it evicts the first one, 1
+     */
+    CHECK(blobWrite(device, 9, data[9], TEST_EVICT_SIZE));
+    CHECK(!blobCheck(device, 1, data[1], TEST_EVICT_SIZE));
+    CHECK(device->bytes <= device->budget);
+    //2 and 3 are read before the hand comes back, so 4 goes instead
+    CHECK(blobCheck(device, 2, data[2], TEST_EVICT_SIZE));
+    CHECK(blobCheck(device, 3, data[3], TEST_EVICT_SIZE));
+    CHECK(blobWrite(device, 10, data[10], TEST_EVICT_SIZE));
+    CHECK(blobCheck(device, 2, data[2], TEST_EVICT_SIZE));
+    CHECK(blobCheck(device, 3, data[3], TEST_EVICT_SIZE));
+    CHECK(!blobCheck(device, 4, data[4], TEST_EVICT_SIZE));
+    CHECK(blobCheck(device, 5, data[5], TEST_EVICT_SIZE));
+    CHECK(device->bytes <= device->budget);
+
+    //more than the whole budget can't be made room for
+    memset(big, 'z', TEST_EVICT_BLOBS * 1024 + 1);
+    down_interruptible(&device->mutex);
+    CHECK(sstore_do_write(device, 11, TEST_EVICT_BLOBS * 1024 + 1,
+                                                            big) == -ENOSPC);
+    up(&device->mutex);
+    CHECK(blobCheck(device, 5, data[5], TEST_EVICT_SIZE));
+    CHECK(device->bytes <= device->budget);
+
+    //evicting what a snapshot has leaves it there for the snapshot
+    snapshot = snapshotTake(device);
+    down_interruptible(&device->mutex);
+    evicted = sstore_evict(device, ~0UL);
+    up(&device->mutex);
+    CHECK(evicted == TEST_EVICT_BLOBS * 1024);
+    CHECK(device->bytes == 0);
+    CHECK(liveCheck(device, 5, NULL));
+    CHECK(snapshotCheck(device, snapshot, 2, data[2]));
+    CHECK(snapshotCheck(device, snapshot, 5, data[5]));
+    CHECK(snapshotCheck(device, snapshot, 10, data[10]));
+    CHECK(snapshotCheck(device, snapshot, 1, NULL));
+    down_interruptible(&device->mutex);
+    sstore_snapshot_drop(device, snapshot);
+    up(&device->mutex);
+
+    printf("eviction: %d blob budget, %lu bytes evicted: %s\n",
+            TEST_EVICT_BLOBS, evicted, test_failures ? "FAILED" : "ok");
+
+    free(big);
+    freeDevice(device);
+}